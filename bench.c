@@ -0,0 +1,477 @@
+//
+// bench.c: micro-benchmarks for the request parsing hot paths.
+//
+// To run, try:
+//      make bench
+// or
+//      ./wbench [-f <name filter>] [-t <min ms per benchmark>] [-j <out.json>]
+//
+// Every benchmark runs on a synthetic corpus and reports time per
+// operation, throughput and heap allocations per operation. The JSON file
+// is meant to be kept around and compared against after a change.
+//
+
+#include "io_helper.h"
+#include "request.h"
+#include "mime.h"
+#include "ratelimit.h"
+#include "router.h"
+#include "trace.h"
+#include "manifest.h"
+#include "connpool.h"
+#include <time.h>
+
+#ifndef BENCH_CFLAGS
+#define BENCH_CFLAGS ""
+#endif
+
+#define BENCH_RUNS 5
+#define BENCH_MAX_RESULTS 64
+
+//
+// Allocation counting: wrap the libc allocator for the whole process
+//
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long alloc_count = 0;
+
+void *malloc(size_t size) {
+    alloc_count++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    alloc_count++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    alloc_count++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+//
+// Harness
+//
+
+typedef struct {
+    char name[64];
+    unsigned long iterations;
+    double ns_per_op;
+    double bytes_per_sec;
+    double allocs_per_op;
+    size_t bytes_per_op;
+} bench_result_t;
+
+typedef void (*bench_fn)(void *arg);
+
+static bench_result_t results[BENCH_MAX_RESULTS];
+static int num_results = 0;
+static double min_time_ms = 200;
+static const char *filter = NULL;
+static int null_fd = -1;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Runs fn until a run takes min_time_ms, then reports the median of
+// BENCH_RUNS runs of that many iterations
+static void bench_run(const char *name, bench_fn fn, void *arg, size_t bytes_per_op) {
+    if (filter && !strstr(name, filter)) return;
+    if (num_results == BENCH_MAX_RESULTS) return;
+
+    unsigned long iterations = 1;
+    for (;;) {
+        double start = now_ns();
+        for (unsigned long i = 0; i < iterations; i++) fn(arg);
+        double elapsed = now_ns() - start;
+        if (elapsed >= min_time_ms * 1e6 / BENCH_RUNS || iterations >= (1UL << 30)) break;
+        iterations *= elapsed > 0 && elapsed * 10 < min_time_ms * 1e6 / BENCH_RUNS ? 10 : 2;
+    }
+
+    double samples[BENCH_RUNS];
+    unsigned long allocs = 0;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        unsigned long allocs_before = alloc_count;
+        double start = now_ns();
+        for (unsigned long i = 0; i < iterations; i++) fn(arg);
+        samples[run] = (now_ns() - start) / iterations;
+        allocs += alloc_count - allocs_before;
+    }
+    qsort(samples, BENCH_RUNS, sizeof(double), compare_double);
+
+    bench_result_t *r = &results[num_results++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->iterations = iterations;
+    r->ns_per_op = samples[BENCH_RUNS / 2];
+    r->bytes_per_op = bytes_per_op;
+    r->bytes_per_sec = bytes_per_op ? bytes_per_op / (r->ns_per_op / 1e9) : 0;
+    r->allocs_per_op = (double) allocs / ((double) iterations * BENCH_RUNS);
+
+    printf("%-36s %12.1f ns/op %10.1f MB/s %8.2f allocs/op\n",
+        r->name, r->ns_per_op, r->bytes_per_sec / 1e6, r->allocs_per_op);
+    fflush(stdout);
+}
+
+static void write_json(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+        return;
+    }
+    fprintf(fp, "{\n  \"cflags\": \"%s\",\n  \"benchmarks\": [\n", BENCH_CFLAGS);
+    for (int i = 0; i < num_results; i++) {
+        bench_result_t *r = &results[i];
+        fprintf(fp, "    {\"name\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.1f, "
+            "\"bytes_per_op\": %zu, \"bytes_per_sec\": %.0f, \"allocs_per_op\": %.2f}%s\n",
+            r->name, r->iterations, r->ns_per_op, r->bytes_per_op, r->bytes_per_sec,
+            r->allocs_per_op, i + 1 < num_results ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+}
+
+//
+// Corpora
+//
+
+// Form body of n fields; every 'escape_every'-th character is percent-encoded
+// and every 'space_every'-th is a '+' (0 disables either)
+static char *make_form(int fields, int value_len, int escape_every, int space_every) {
+    size_t cap = (size_t) fields * (value_len * 3 + 32) + 1;
+    char *form = malloc(cap);
+    size_t len = 0;
+    for (int i = 0; i < fields; i++) {
+        len += sprintf(form + len, "%sfield%d=", i ? "&" : "", i);
+        for (int j = 0; j < value_len; j++) {
+            if (escape_every && j % escape_every == 0) len += sprintf(form + len, "%%%02X", '/' );
+            else if (space_every && j % space_every == 3) form[len++] = '+';
+            else form[len++] = 'a' + j % 26;
+        }
+    }
+    form[len] = '\0';
+    return form;
+}
+
+#define BENCH_BOUNDARY "----WebKitFormBoundary7MA4YWxkTrZu0gW"
+
+// multipart/form-data body with 'parts' text fields of part_size bytes
+// each; no part has a filename, so nothing is written to disk and
+// handle_multipart_upload() spends its time scanning for boundaries
+static char *make_multipart(int parts, size_t part_size, size_t *body_len) {
+    size_t cap = parts * (part_size + 256) + 64;
+    char *body = malloc(cap);
+    size_t len = 0;
+    for (int i = 0; i < parts; i++) {
+        len += sprintf(body + len, "--%s\r\nContent-Disposition: form-data; name=\"field%d\"\r\n\r\n",
+            BENCH_BOUNDARY, i);
+        for (size_t j = 0; j < part_size; j++) {
+            // Plenty of '-' and '\r' so that naive scanners see false starts
+            body[len++] = j % 61 == 0 ? '-' : j % 97 == 0 ? '\r' : 'A' + j % 23;
+        }
+        len += sprintf(body + len, "\r\n");
+    }
+    len += sprintf(body + len, "--%s--\r\n", BENCH_BOUNDARY);
+    *body_len = len;
+    return body;
+}
+
+//
+// Benchmarks
+//
+
+typedef struct {
+    char *input;
+    char *output;
+    size_t len;
+} decode_arg_t;
+
+static void bench_url_decode(void *arg) {
+    decode_arg_t *a = arg;
+    url_decode(a->output, a->input);
+}
+
+typedef struct {
+    char *form;
+} form_arg_t;
+
+static void bench_parse_post_data(void *arg) {
+    form_arg_t *a = arg;
+    int num_params;
+    post_param_t *params = parse_post_data(a->form, &num_params);
+    free_post_params(params, num_params);
+}
+
+static void bench_get_boundary(void *arg) {
+    char *boundary = get_boundary(arg);
+    free(boundary);
+}
+
+static void bench_get_filetype(void *arg) {
+    static char *names[] = {
+        "./index.html", "./css/index.css", "./favicon.ico", "./img/image.png",
+        "./uploads/4fcc523e47899fb8535021d582d713065d6c330d25585ba11ce6c3ac244b1824.jpg",
+        "./js/app.js", "./cat.html", "./photo.gif",
+    };
+    char filetype[MAXBUF];
+    (void) arg;
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        mime_get_filetype(names[i], filetype);
+    }
+}
+
+typedef struct {
+    int fd;
+} headers_arg_t;
+
+static void bench_parse_headers(void *arg) {
+    headers_arg_t *a = arg;
+    char buf[MAXBUF];
+    static char headers[MAXBUF * 8];
+    lseek(a->fd, 0, SEEK_SET);
+    readline_or_die(a->fd, buf, MAXBUF); // request line
+    request_parse_headers(a->fd, headers, sizeof(headers));
+}
+
+typedef struct {
+    char *body;
+    size_t len;
+    char *boundary;
+} multipart_arg_t;
+
+static void bench_multipart(void *arg) {
+    multipart_arg_t *a = arg;
+    handle_multipart_upload(null_fd, a->body, a->len, a->boundary);
+}
+
+// Cycles through 'arg' client addresses, so the table holds that many buckets
+static void bench_ratelimit(void *arg) {
+    static uint32_t next = 0;
+    uint32_t clients = *(uint32_t *) arg;
+    int retry_after;
+    ratelimit_request(htonl(0x0a000000 + next), "/img/image.png", &retry_after);
+    if (++next == clients) next = 0;
+}
+
+static void bench_router(void *arg) {
+    static const char *uris[] = {
+        "/img/image.png", "/upload", "/css/index.css?v=3",
+        "/thumb/4fcc523e47899fb8535021d582d713065d6c330d25585ba11ce6c3ac244b1824.jpg",
+    };
+    route_handler_t handler;
+    route_match_t match;
+    void *ctx;
+    (void) arg;
+    for (size_t i = 0; i < sizeof(uris) / sizeof(uris[0]); i++) {
+        router_lookup("GET", uris[i], &handler, &ctx, &match);
+    }
+}
+
+// One traced request the size of a static GET
+static void bench_trace(void *arg) {
+    (void) arg;
+    trace_begin();
+    trace_request("GET", "/img/image.png");
+    for (int phase = 0; phase < 6; phase++) {
+        uint64_t t = trace_start();
+        trace_span(phase, t);
+    }
+    trace_end();
+}
+
+// Error page with a cause that needs escaping
+static void bench_request_error(void *arg) {
+    (void) arg;
+    request_error(null_fd, "/img/<missing>.png", "404", "Not found", "Server could not find this file");
+}
+
+// What the accept loop and a connection thread do with the pool
+static void bench_connpool(void *arg) {
+    (void) arg;
+    conn_t *conn = connpool_get(-1, 0);
+    conn->line[0] = conn->headers[0] = '\0';
+    connpool_put(conn);
+}
+
+// One gallery page as JSON; the manifest holds 'arg' records
+static void bench_manifest_page(void *arg) {
+    FILE *f = arg;
+    manifest_write_page(f, UINT64_MAX, MANIFEST_PAGE, 1);
+}
+
+static void run_manifest_page(const char *name, FILE *f, uint64_t records) {
+    char blob[80];
+    for (uint64_t i = manifest_count(); i < records; i++) {
+        snprintf(blob, sizeof(blob), "%064lx.jpg", (unsigned long) i);
+        manifest_append(blob, "holiday photo.jpg", 123456, "image/jpeg");
+    }
+    bench_run(name, bench_manifest_page, f, 0);
+}
+
+static void run_url_decode(const char *name, int fields, int value_len, int escape_every, int space_every) {
+    decode_arg_t a;
+    a.input = make_form(fields, value_len, escape_every, space_every);
+    a.len = strlen(a.input);
+    a.output = malloc(a.len + 1);
+    bench_run(name, bench_url_decode, &a, a.len);
+    free(a.input);
+    free(a.output);
+}
+
+static void run_parse_post_data(const char *name, int fields, int value_len) {
+    form_arg_t a;
+    a.form = make_form(fields, value_len, 5, 7);
+    bench_run(name, bench_parse_post_data, &a, strlen(a.form));
+    free(a.form);
+}
+
+static void run_multipart(const char *name, int parts, size_t part_size) {
+    multipart_arg_t a;
+    a.body = make_multipart(parts, part_size, &a.len);
+    a.boundary = get_boundary("multipart/form-data; boundary=" BENCH_BOUNDARY);
+    bench_run(name, bench_multipart, &a, a.len);
+    free(a.body);
+    free(a.boundary);
+}
+
+static void run_parse_headers(const char *name, int extra_headers) {
+    headers_arg_t a;
+    char line[256];
+    a.fd = memfd_create("bench-headers", 0);
+    const char *request =
+        "GET /img/image.png HTTP/1.1\r\n"
+        "Host: localhost:10000\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+        "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Accept-Language: en-US,en;q=0.9\r\n"
+        "Referer: http://localhost:10000/index.html\r\n";
+    size_t len = write_or_die(a.fd, request, strlen(request));
+    for (int i = 0; i < extra_headers; i++) {
+        int n = snprintf(line, sizeof(line), "X-Custom-Header-%d: value-%d-abcdefghijklmnopqrstuvwxyz\r\n", i, i);
+        len += write_or_die(a.fd, line, n);
+    }
+    len += write_or_die(a.fd, "\r\n", 2);
+    bench_run(name, bench_parse_headers, &a, len);
+    close(a.fd);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    char *json_path = NULL;
+    char tmpdir[] = "/tmp/wbench.XXXXXX";
+
+    while ((c = getopt(argc, argv, "f:t:j:")) != -1)
+    switch (c) {
+    case 'f':
+        filter = optarg;
+        break;
+    case 't':
+        min_time_ms = atof(optarg);
+        break;
+    case 'j':
+        json_path = optarg;
+        break;
+    default:
+        fprintf(stderr, "usage: wbench [-f filter] [-t min_ms] [-j out.json]\n");
+        exit(1);
+    }
+
+    // Handlers write their HTML to /dev/null and may create uploads/
+    null_fd = open_or_die("/dev/null", O_WRONLY, 0);
+    char cwd[MAXBUF];
+    if (!getcwd(cwd, sizeof(cwd))) strcpy(cwd, ".");
+    if (!mkdtemp(tmpdir)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    chdir_or_die(tmpdir);
+
+    printf("cflags: %s\n", BENCH_CFLAGS);
+
+    run_url_decode("url_decode/plain_1KB", 1, 1024, 0, 0);
+    run_url_decode("url_decode/plain_1MB", 1, 1 << 20, 0, 0);
+    run_url_decode("url_decode/text_1KB", 1, 1024, 0, 7);
+    run_url_decode("url_decode/escaped_1KB", 1, 1024, 5, 7);
+    run_url_decode("url_decode/escaped_1MB", 1, 1 << 20, 5, 7);
+
+    run_parse_post_data("parse_post_data/small_form", 4, 16);
+    run_parse_post_data("parse_post_data/large_form", 256, 512);
+
+    bench_run("get_boundary/unquoted", bench_get_boundary,
+        "multipart/form-data; boundary=" BENCH_BOUNDARY, 0);
+    bench_run("get_boundary/quoted", bench_get_boundary,
+        "multipart/form-data; boundary=\"" BENCH_BOUNDARY "\"", 0);
+
+    bench_run("mime_get_filetype/8_names", bench_get_filetype, NULL, 0);
+
+    run_parse_headers("request_parse_headers/browser", 0);
+    run_parse_headers("request_parse_headers/64_extra", 64);
+
+    // Limits high enough that every request passes and keeps its bucket
+    ratelimit_set_global("1e9:1e9");
+    ratelimit_add_route("/img/=1e9:1e9");
+    uint32_t one_client = 1, many_clients = 100000;
+    bench_run("ratelimit/one_client", bench_ratelimit, &one_client, 0);
+    bench_run("ratelimit/100k_clients", bench_ratelimit, &many_clients, 0);
+
+    // Lookup cost should not depend on how many routes there are
+    request_init();
+    bench_run("router_lookup/builtin", bench_router, NULL, 0);
+    bench_run("request_error/404", bench_request_error, NULL, 0);
+    bench_run("connpool/get_put", bench_connpool, NULL, 0);
+    for (int i = 0; i < 1000; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/api/v%d/items/*/r%d", i % 10, i);
+        router_add(i % 2 ? "GET" : "POST", path, i % 3 ? ROUTE_EXACT : ROUTE_PREFIX, NULL, NULL);
+    }
+    bench_run("router_lookup/1000_routes", bench_router, NULL, 0);
+
+    bench_run("trace/untraced_request", bench_trace, NULL, 0);
+    trace_init(1, 0);
+    bench_run("trace/sampled_request", bench_trace, NULL, 0);
+
+    // Listing cost should not depend on how many uploads there are
+    FILE *devnull = fopen("/dev/null", "w");
+    if (manifest_init() == 0) {
+        run_manifest_page("manifest_page/100_uploads", devnull, 100);
+        run_manifest_page("manifest_page/100k_uploads", devnull, 100000);
+    }
+    fclose(devnull);
+
+    run_multipart("multipart_scan/4x16KB", 4, 16 * 1024);
+    run_multipart("multipart_scan/4x1MB", 4, 1 << 20);
+    run_multipart("multipart_scan/2x8MB", 2, 8 << 20);
+
+    if (json_path) {
+        char path[MAXBUF * 2];
+        if (json_path[0] == '/') snprintf(path, sizeof(path), "%s", json_path);
+        else snprintf(path, sizeof(path), "%s/%s", cwd, json_path);
+        write_json(path);
+        printf("results written to %s\n", path);
+    }
+
+    // Leave nothing behind in /tmp
+    unlink(MANIFEST_FILE);
+    rmdir("uploads/thumbs");
+    rmdir("uploads");
+    chdir_or_die(cwd);
+    rmdir(tmpdir);
+    return 0;
+}
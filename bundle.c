@@ -0,0 +1,130 @@
+#include "io_helper.h"
+#include "bundle.h"
+#include <sys/mman.h>
+
+static const char *bundle_map = NULL;
+static size_t bundle_size = 0;
+static int bundle_fd = -1;
+static const bundle_record_t *records = NULL;
+static uint32_t num_records = 0;
+
+uint64_t bundle_hash(const char *path, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) path[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int in_bundle(uint64_t off, uint64_t len) {
+    return off <= bundle_size && len <= bundle_size - off;
+}
+
+// Every offset is checked once here, so serving needs no bounds checks
+static int bundle_check(void) {
+    const bundle_header_t *hdr = (const bundle_header_t *) bundle_map;
+    if (bundle_size < sizeof(bundle_header_t) || memcmp(hdr->magic, BUNDLE_MAGIC, 8) != 0) return -1;
+    if (hdr->index_off % sizeof(uint64_t) != 0 ||
+        !in_bundle(hdr->index_off, (uint64_t) hdr->count * sizeof(bundle_record_t))) return -1;
+
+    records = (const bundle_record_t *) (bundle_map + hdr->index_off);
+    num_records = hdr->count;
+    for (uint32_t i = 0; i < num_records; i++) {
+        const bundle_record_t *r = &records[i];
+        if (!in_bundle(r->path_off, r->path_len) || !in_bundle(r->body_off, r->body_len) ||
+            !in_bundle(r->head_off, r->head_len) || !in_bundle(r->gz_off, r->gz_len) ||
+            !in_bundle(r->gz_head_off, r->gz_head_len)) return -1;
+        if (r->hash != bundle_hash(bundle_map + r->path_off, r->path_len)) return -1;
+        if (i > 0 && records[i - 1].hash > r->hash) return -1;
+        if (memchr(r->mime, '\0', sizeof(r->mime)) == NULL ||
+            memchr(r->etag, '\0', sizeof(r->etag)) == NULL) return -1;
+    }
+    return 0;
+}
+
+int bundle_open(const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    bundle_map = map;
+    bundle_size = st.st_size;
+    if (bundle_check() < 0) {
+        fprintf(stderr, "%s is not a valid bundle\n", path);
+        munmap(map, st.st_size);
+        close(fd);
+        bundle_map = NULL;
+        records = NULL;
+        num_records = 0;
+        return -1;
+    }
+    // The descriptor stays open for sendfile()
+    bundle_fd = fd;
+    return 0;
+}
+
+int bundle_enabled(void) {
+    return bundle_map != NULL;
+}
+
+const bundle_record_t *bundle_find(const char *path) {
+    if (!bundle_map) return NULL;
+    if (path[0] == '.' && path[1] == '/') path += 2;
+    size_t len = strlen(path);
+    uint64_t h = bundle_hash(path, len);
+
+    // Leftmost record with this hash, then the (rare) collisions after it
+    uint32_t lo = 0, hi = num_records;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (records[mid].hash < h) lo = mid + 1;
+        else hi = mid;
+    }
+    for (; lo < num_records && records[lo].hash == h; lo++) {
+        const bundle_record_t *r = &records[lo];
+        if (r->path_len == len && memcmp(bundle_map + r->path_off, path, len) == 0) return r;
+    }
+    return NULL;
+}
+
+void bundle_gzip_etag(const char *etag, char *out, size_t size) {
+    size_t len = strlen(etag);
+    if (len > 0 && etag[len - 1] == '"') len--;
+    snprintf(out, size, "%.*s-gz\"", (int) len, etag);
+}
+
+const char *bundle_etag(const char *path, int gzip_ok, char *buf, size_t size) {
+    const bundle_record_t *r = bundle_find(path);
+    if (!r) return NULL;
+    if (!gzip_ok || r->gz_len == 0) return r->etag;
+    bundle_gzip_etag(r->etag, buf, size);
+    return buf;
+}
+
+int bundle_serve(int fd, const char *path, int gzip_ok) {
+    const bundle_record_t *r = bundle_find(path);
+    if (!r) return 0;
+
+    int gz = gzip_ok && r->gz_len > 0;
+    write_or_die(fd, (void *) (bundle_map + (gz ? r->gz_head_off : r->head_off)),
+                 gz ? r->gz_head_len : r->head_len);
+
+    // The body goes from the bundle's page cache to the socket by offset
+    off_t offset = gz ? r->gz_off : r->body_off;
+    off_t end = offset + (gz ? r->gz_len : r->body_len);
+    while (offset < end) {
+        ssize_t n = sendfile(fd, bundle_fd, &offset, end - offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+    }
+    return 1;
+}
@@ -0,0 +1,67 @@
+#ifndef __BUNDLE_H__
+#define __BUNDLE_H__
+#include <stdint.h>
+#include <stddef.h>
+
+// A bundle packs a whole docroot into one file (see wbundle.c): the bytes
+// of every file, the response head for it, an optional gzip variant and a
+// table of records sorted by path hash. The server maps it once at start
+// and answers GETs for bundled paths with one binary search and a
+// sendfile() from the bundle; no file metadata is touched per request.
+//
+// Layout: bundle_header_t at offset 0, then data (paths, heads, bodies),
+// then 'count' bundle_record_t at index_off. Offsets are absolute.
+
+#define BUNDLE_MAGIC "WBUNDLE1"
+
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t index_off;
+} bundle_header_t;
+
+typedef struct {
+    uint64_t hash;          // bundle_hash() of the path
+    uint64_t path_off;
+    uint32_t path_len;      // relative path, no leading "./", not terminated
+    uint32_t mode;
+    uint64_t mtime;
+    uint64_t body_off;
+    uint64_t body_len;
+    uint64_t head_off;      // "HTTP/1.0 200 OK..." up to and including the blank line
+    uint64_t gz_head_off;
+    uint64_t gz_off;        // gzip variant, gz_len 0 if there is none
+    uint64_t gz_len;
+    uint32_t head_len;
+    uint32_t gz_head_len;
+    char mime[32];
+    char etag[48];          // of the identity variant; see bundle_gzip_etag()
+} bundle_record_t;
+
+// Hash that orders the records (FNV-1a over the relative path)
+uint64_t bundle_hash(const char *path, size_t len);
+
+// Maps the bundle at path and checks its records. Returns 0 on success.
+int bundle_open(const char *path);
+
+// Returns 1 once a bundle is mapped
+int bundle_enabled(void);
+
+// Returns the record for a relative path ("./" prefix allowed), or NULL
+const bundle_record_t *bundle_find(const char *path);
+
+// Writes the ETag of the gzip variant: the identity ETag with "-gz" before
+// its closing quote, since each content coding needs its own strong
+// validator (RFC 9110, 8.8.3)
+void bundle_gzip_etag(const char *etag, char *out, size_t size);
+
+// The ETag of the variant bundle_serve() would send for path and gzip_ok,
+// or NULL if path is not in the bundle
+const char *bundle_etag(const char *path, int gzip_ok, char *buf, size_t size);
+
+// Sends the bundled response for path, gzip-encoded if gzip_ok and the
+// bundle has a variant. Returns 0 if path is not in the bundle.
+int bundle_serve(int fd, const char *path, int gzip_ok);
+
+#endif // __BUNDLE_H__
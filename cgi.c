@@ -0,0 +1,594 @@
+#include "io_helper.h"
+#include "request.h"
+#include "cgi.h"
+#include "docroot.h"
+#include "membudget.h"
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define CGI_TIMEOUT_MS 30000
+#define CGI_MAX_OUTPUT (16 * 1024 * 1024)
+#define CGI_MAX_ENV 64
+#define CGI_CACHE_BUCKETS 1024          // power of two
+#define CGI_CACHE_MAX_ENTRIES 1024
+#define CGI_CACHE_MAX_BYTES (64 * 1024 * 1024)
+
+typedef struct {
+    int refs;                   // the cache and each request sending it
+    int status;
+    int ttl, swr;               // seconds; ttl 0: not cacheable
+    size_t head_len;            // status line and headers, without the blank line
+    size_t body_len;
+    char *data;                 // head, then body
+} cgi_response_t;
+
+typedef struct cgi_entry {
+    char *key;
+    uint64_t hash;
+    cgi_response_t *resp;       // latest cacheable response
+    time_t fresh_until, stale_until;
+    time_t pass_until;          // last answer was not cacheable: run per request
+    int filling;                // an execution for this key is running
+    int pins;                   // requests waiting on the entry
+    unsigned gen;               // bumped when an execution finishes
+    struct cgi_entry *hnext;
+    struct cgi_entry *prev, *next; // LRU list, most recent first
+} cgi_entry_t;
+
+// Background refresh of a stale entry
+typedef struct {
+    cgi_entry_t *entry;
+    char script[MAXBUF];
+    char **env;
+} cgi_refresh_t;
+
+static int cache_ttl = 0;
+static cgi_entry_t *buckets[CGI_CACHE_BUCKETS];
+static cgi_entry_t *lru_head = NULL, *lru_tail = NULL;
+static int num_entries = 0;
+static size_t cache_bytes = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+
+void cgi_init(int max_ttl) {
+    cache_ttl = max_ttl > 0 ? max_ttl : 0;
+}
+
+//
+// Execution
+//
+
+// Builds the CGI/1.1 environment as one allocation (pointers, then strings)
+static char **cgi_env(http_request_t *req, const char *script, const char *query) {
+    size_t headers_len = req->headers ? strlen(req->headers) : 0;
+    size_t size = (CGI_MAX_ENV + 1) * sizeof(char *) + 2 * headers_len + 3 * strlen(req->uri) + 4096;
+    char **env = malloc(size);
+    if (!env) return NULL;
+    char *p = (char *) (env + CGI_MAX_ENV + 1), *end = (char *) env + size;
+    int n = 0;
+    char ip[INET_ADDRSTRLEN], value[MAXBUF];
+
+#define CGI_SETENV(...) do { \
+        if (n < CGI_MAX_ENV && p < end) { \
+            env[n++] = p; \
+            p += snprintf(p, end - p, __VA_ARGS__) + 1; \
+        } \
+    } while (0)
+
+    inet_ntop(AF_INET, &req->client_ip, ip, sizeof(ip));
+    CGI_SETENV("GATEWAY_INTERFACE=CGI/1.1");
+    CGI_SETENV("SERVER_SOFTWARE=Webserver C");
+    CGI_SETENV("SERVER_PROTOCOL=%s", req->version);
+    CGI_SETENV("REQUEST_METHOD=%s", req->method);
+    CGI_SETENV("REQUEST_URI=%s", req->uri);
+    CGI_SETENV("SCRIPT_NAME=%s", script + 1);
+    CGI_SETENV("SCRIPT_FILENAME=%s", script);
+    CGI_SETENV("QUERY_STRING=%s", query);
+    CGI_SETENV("REMOTE_ADDR=%s", ip);
+    CGI_SETENV("PATH=/usr/local/bin:/usr/bin:/bin");
+    if (req->body) CGI_SETENV("CONTENT_LENGTH=%d", req->body_len);
+    if (req->headers && request_find_header(req->headers, "Content-Type", value, sizeof(value))) {
+        CGI_SETENV("CONTENT_TYPE=%s", value);
+    }
+
+    // Every other header as HTTP_NAME. "Proxy" is dropped: HTTP_PROXY
+    // would be taken for a proxy setting by the script's HTTP clients.
+    for (const char *line = req->headers; line && *line; ) {
+        const char *colon = strchr(line, ':');
+        const char *eol = strchr(line, '\n');
+        if (!eol) eol = line + strlen(line);
+        if (colon && colon < eol && n < CGI_MAX_ENV && p < end &&
+            strncasecmp(line, "Content-Type:", 13) != 0 && strncasecmp(line, "Content-Length:", 15) != 0 &&
+            strncasecmp(line, "Proxy:", 6) != 0) {
+            const char *v = colon + 1;
+            while (*v == ' ' || *v == '\t') v++;
+            size_t vlen = eol - v;
+            while (vlen > 0 && (v[vlen - 1] == '\r' || v[vlen - 1] == ' ')) vlen--;
+            char name[128];
+            size_t nlen = 0;
+            for (const char *c = line; c < colon && nlen < sizeof(name) - 1; c++) {
+                name[nlen++] = *c == '-' ? '_' : toupper((unsigned char) *c);
+            }
+            name[nlen] = '\0';
+            CGI_SETENV("HTTP_%s=%.*s", name, (int) vlen, v);
+        }
+        line = *eol ? eol + 1 : eol;
+    }
+#undef CGI_SETENV
+
+    if (p > end) {
+        free(env);
+        return NULL;
+    }
+    env[n] = NULL;
+    return env;
+}
+
+// Reads Cache-Control into ttl and swr (seconds, before capping)
+static void cgi_cache_policy(const char *value, int *ttl, int *swr) {
+    const char *p;
+    *ttl = cache_ttl;
+    *swr = 0;
+    if (strcasestr(value, "no-store") || strcasestr(value, "no-cache") || strcasestr(value, "private")) {
+        *ttl = 0;
+        return;
+    }
+    if ((p = strcasestr(value, "s-maxage="))) *ttl = atoi(p + 9);
+    else if ((p = strcasestr(value, "max-age="))) *ttl = atoi(p + 8);
+    if ((p = strcasestr(value, "stale-while-revalidate="))) *swr = atoi(p + 23);
+}
+
+// Turns raw script output (CGI headers, blank line, body) into a response
+static cgi_response_t *cgi_parse_output(char *out, size_t len) {
+    char *sep = memmem(out, len, "\n\n", 2);
+    char *crlf = memmem(out, len, "\r\n\r\n", 4);
+    if (!sep || (crlf && crlf < sep)) sep = crlf;
+    if (!sep) return NULL;
+    char *body = sep + (sep == crlf ? 4 : 2);
+    size_t body_len = out + len - body;
+
+    cgi_response_t *r = calloc(1, sizeof(cgi_response_t));
+    char *head = malloc(2 * (sep - out) + 512); // "\n" may become "\r\n"
+    if (!r || !head) {
+        free(r);
+        free(head);
+        return NULL;
+    }
+    char status[128] = "200 OK";
+    int has_cache_control = 0, has_status = 0, has_location = 0, uncacheable = 0;
+
+    // Status goes first in the response but may come anywhere in the output
+    for (char *line = out; line < sep; line++) {
+        if (line != out && line[-1] != '\n') continue;
+        if (strncasecmp(line, "Status:", 7) == 0) {
+            const char *v = line + 7;
+            while (*v == ' ') v++;
+            snprintf(status, sizeof(status), "%.*s", (int) strcspn(v, "\r\n"), v);
+            has_status = 1;
+        } else if (strncasecmp(line, "Location:", 9) == 0) {
+            has_location = 1;
+        }
+    }
+    if (has_location && !has_status) strcpy(status, "302 Found");
+    size_t n = snprintf(head, 256, "HTTP/1.0 %s\r\nServer: Webserver C\r\n", status);
+    r->status = atoi(status);
+    r->ttl = cache_ttl;
+    r->swr = cache_ttl;
+
+    for (char *line = out; line < sep; ) {
+        char *eol = memchr(line, '\n', sep + 1 - line);
+        if (!eol) eol = sep;
+        size_t line_len = eol - line;
+        if (line_len > 0 && line[line_len - 1] == '\r') line_len--;
+        // Status is in the status line, the length is recomputed
+        if (line_len > 0 && strncasecmp(line, "Status:", 7) != 0 && strncasecmp(line, "Content-Length:", 15) != 0) {
+            if (strncasecmp(line, "Cache-Control:", 14) == 0) {
+                char value[256];
+                snprintf(value, sizeof(value), "%.*s", (int) (line_len - 14), line + 14);
+                cgi_cache_policy(value, &r->ttl, &r->swr);
+                has_cache_control = 1;
+            } else if (strncasecmp(line, "Set-Cookie:", 11) == 0) {
+                // One client's session must never be replayed to another
+                uncacheable = 1;
+            } else if (strncasecmp(line, "Vary:", 5) == 0) {
+                // The key holds no request headers, so every variant would
+                // be served to every client (a gzip body to one that never
+                // asked for it)
+                uncacheable = 1;
+            }
+            memcpy(head + n, line, line_len);
+            memcpy(head + n + line_len, "\r\n", 2);
+            n += line_len + 2;
+        }
+        line = eol + 1;
+    }
+    n += snprintf(head + n, 64, "Content-Length: %zu\r\n", body_len);
+
+    if (!has_cache_control) r->swr = r->ttl;
+    if (r->status != 200 || r->ttl <= 0 || uncacheable) r->ttl = 0;
+    if (r->ttl > cache_ttl) r->ttl = cache_ttl;
+    if (r->swr > cache_ttl) r->swr = cache_ttl;
+
+    r->data = malloc(n + body_len);
+    if (!r->data) {
+        free(head);
+        free(r);
+        return NULL;
+    }
+    memcpy(r->data, head, n);
+    memcpy(r->data + n, body, body_len);
+    free(head);
+    r->head_len = n;
+    r->body_len = body_len;
+    r->refs = 1;
+    return r;
+}
+
+// Runs a script with body on stdin. Returns its response or NULL with
+// the HTTP status to answer in *error.
+static cgi_response_t *cgi_run(const char *script, char **env, const char *body, size_t body_len, int *error) {
+    int in[2], out[2];
+    *error = 502;
+    if (pipe2(in, O_CLOEXEC) < 0) return NULL;
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        close(in[0]);
+        close(in[1]);
+        return NULL;
+    }
+
+    // posix_spawn rather than fork: no copy of a multi-threaded address space
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    char *argv[] = { (char *) script, NULL };
+    pid_t pid;
+    int rc = posix_spawn(&pid, script, &actions, NULL, argv, env);
+    posix_spawn_file_actions_destroy(&actions);
+    close(in[0]);
+    close(out[1]);
+    if (rc != 0) {
+        close(in[1]);
+        close(out[0]);
+        return NULL;
+    }
+
+    // A script that exits without reading its input must give EPIPE, not
+    // a process-killing SIGPIPE
+    sigset_t pipe_set, old_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+
+    // The output buffer counts against the memory budget
+    size_t cap = 16 * 1024, len = 0, written = 0, reserved = 0;
+    int no_memory = membudget_acquire(cap, 0) < 0;
+    char *output = no_memory ? NULL : malloc(cap);
+    if (!no_memory) reserved = cap;
+    int in_fd = body_len > 0 ? in[1] : -1, epipe = 0, timed_out = 0, failed = !output;
+    if (in_fd < 0) close(in[1]);
+    else fcntl(in_fd, F_SETFL, O_NONBLOCK);
+
+    // Feed stdin and drain stdout together so neither pipe can fill up
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!failed) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (elapsed >= CGI_TIMEOUT_MS) {
+            timed_out = 1;
+            break;
+        }
+        struct pollfd fds[2] = { { out[0], POLLIN, 0 }, { in_fd, POLLOUT, 0 } };
+        if (poll(fds, 2, CGI_TIMEOUT_MS - elapsed) < 0) {
+            if (errno == EINTR) continue;
+            failed = 1;
+            break;
+        }
+        if (fds[1].revents) {
+            ssize_t w = write(in_fd, body + written, body_len - written);
+            if (w > 0) written += w;
+            if (w < 0 && errno == EPIPE) epipe = 1;
+            if ((w < 0 && errno != EAGAIN && errno != EINTR) || written == body_len) {
+                close(in_fd);
+                in_fd = -1;
+            }
+        }
+        if (fds[0].revents) {
+            if (len == cap) {
+                if (cap >= CGI_MAX_OUTPUT || membudget_acquire(cap, 0) < 0) {
+                    no_memory = cap < CGI_MAX_OUTPUT;
+                    failed = 1;
+                    break;
+                }
+                reserved += cap;
+                char *bigger = realloc(output, cap * 2);
+                if (!bigger) {
+                    failed = 1;
+                    break;
+                }
+                output = bigger;
+                cap *= 2;
+            }
+            ssize_t r = read(out[0], output + len, cap - len);
+            if (r == 0) break;
+            if (r < 0 && errno != EINTR) failed = 1;
+            if (r > 0) len += r;
+        }
+    }
+    if (in_fd >= 0) close(in_fd);
+    close(out[0]);
+
+    if (timed_out || failed) kill(pid, SIGKILL);
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR);
+
+    if (epipe) {
+        struct timespec zero = { 0, 0 };
+        sigtimedwait(&pipe_set, NULL, &zero);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+    cgi_response_t *resp = NULL;
+    if (timed_out) *error = 504;
+    else if (no_memory) *error = 503;
+    else if (!failed && !WIFSIGNALED(wstatus)) resp = cgi_parse_output(output, len);
+    free(output);
+    membudget_release(reserved);
+    return resp;
+}
+
+static void cgi_send(int fd, cgi_response_t *r, const char *cache_state) {
+    char buf[64];
+    write_or_die(fd, r->data, r->head_len);
+    snprintf(buf, sizeof(buf), "X-Cache: %s\r\n\r\n", cache_state);
+    write_or_die(fd, buf, strlen(buf));
+    if (r->body_len > 0) write_or_die(fd, r->data + r->head_len, r->body_len);
+}
+
+static void cgi_error(int fd, http_request_t *req, int status) {
+    if (status == 503) request_error_retry(fd, req->uri, "503", "Service Unavailable", "Server is out of memory for script output", 1);
+    else if (status == 504) request_error(fd, req->uri, "504", "Gateway Timeout", "The script did not finish in time");
+    else request_error(fd, req->uri, "502", "Bad Gateway", "The script failed to produce a response");
+}
+
+//
+// Micro-cache
+//
+
+static uint64_t cgi_hash(const char *s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *s; s++) h = (h ^ (unsigned char) *s) * 0x100000001b3ULL;
+    return h;
+}
+
+// The rest are called with cache_lock held
+
+static void response_put(cgi_response_t *r) {
+    if (r && --r->refs == 0) {
+        free(r->data);
+        free(r);
+    }
+}
+
+static void lru_unlink(cgi_entry_t *e) {
+    if (e->prev) e->prev->next = e->next;
+    else lru_head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else lru_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push(cgi_entry_t *e) {
+    e->next = lru_head;
+    if (lru_head) lru_head->prev = e;
+    lru_head = e;
+    if (!lru_tail) lru_tail = e;
+}
+
+// Drops least recently used entries nobody is working on
+static void cache_evict(void) {
+    cgi_entry_t *e = lru_tail;
+    while (e && (num_entries > CGI_CACHE_MAX_ENTRIES || cache_bytes > CGI_CACHE_MAX_BYTES)) {
+        cgi_entry_t *prev = e->prev;
+        if (!e->filling && e->pins == 0) {
+            cgi_entry_t **link = &buckets[e->hash & (CGI_CACHE_BUCKETS - 1)];
+            while (*link != e) link = &(*link)->hnext;
+            *link = e->hnext;
+            lru_unlink(e);
+            if (e->resp) cache_bytes -= e->resp->head_len + e->resp->body_len;
+            response_put(e->resp);
+            free(e->key);
+            free(e);
+            num_entries--;
+        }
+        e = prev;
+    }
+}
+
+static cgi_entry_t *cache_get(const char *key) {
+    uint64_t h = cgi_hash(key);
+    cgi_entry_t **bucket = &buckets[h & (CGI_CACHE_BUCKETS - 1)];
+    for (cgi_entry_t *e = *bucket; e; e = e->hnext) {
+        if (e->hash == h && strcmp(e->key, key) == 0) {
+            lru_unlink(e);
+            lru_push(e);
+            return e;
+        }
+    }
+    cgi_entry_t *e = calloc(1, sizeof(cgi_entry_t));
+    if (!e || !(e->key = strdup(key))) {
+        free(e);
+        return NULL;
+    }
+    e->hash = h;
+    e->hnext = *bucket;
+    *bucket = e;
+    lru_push(e);
+    num_entries++;
+    e->pins = 1; // kept through its own eviction pass
+    cache_evict();
+    e->pins = 0;
+    return e;
+}
+
+// Records the outcome of an execution and wakes whoever waits for it
+static void cache_finish(cgi_entry_t *e, cgi_response_t *r) {
+    time_t now = time(NULL);
+    if (r && r->ttl > 0) {
+        if (e->resp) cache_bytes -= e->resp->head_len + e->resp->body_len;
+        response_put(e->resp);
+        r->refs++;
+        e->resp = r;
+        e->fresh_until = now + r->ttl;
+        e->stale_until = e->fresh_until + r->swr;
+        e->pass_until = 0;
+        cache_bytes += r->head_len + r->body_len;
+    } else if (r) {
+        // Not for sharing: later requests run the script themselves for a while
+        e->pass_until = now + cache_ttl;
+    }
+    e->filling = 0;
+    e->gen++;
+    pthread_cond_broadcast(&cache_cond);
+    cache_evict();
+}
+
+static void *cgi_refresh(void *arg) {
+    cgi_refresh_t *job = arg;
+    int error;
+    cgi_response_t *r = cgi_run(job->script, job->env, NULL, 0, &error);
+
+    pthread_mutex_lock(&cache_lock);
+    cache_finish(job->entry, r);
+    response_put(r);
+    pthread_mutex_unlock(&cache_lock);
+    free(job->env);
+    free(job);
+    return NULL;
+}
+
+static void cgi_serve_cached(int fd, http_request_t *req, const char *script, char **env) {
+    cgi_response_t *r = NULL;
+    cgi_refresh_t *refresh = NULL;
+    const char *state;
+    int error = 502;
+
+    pthread_mutex_lock(&cache_lock);
+    cgi_entry_t *e = cache_get(req->uri);
+    if (!e) {
+        pthread_mutex_unlock(&cache_lock);
+        r = cgi_run(script, env, NULL, 0, &error);
+        state = "BYPASS";
+        goto send;
+    }
+    for (;;) {
+        time_t now = time(NULL);
+        if (e->resp && now < e->fresh_until) {
+            r = e->resp;
+            state = "HIT";
+        } else if (e->resp && now < e->stale_until) {
+            // Serve stale now; one execution in the background refreshes it
+            r = e->resp;
+            state = "STALE";
+            if (!e->filling && (refresh = malloc(sizeof(cgi_refresh_t)))) {
+                e->filling = 1;
+                refresh->entry = e;
+                refresh->env = env;
+                snprintf(refresh->script, sizeof(refresh->script), "%s", script);
+                env = NULL;
+            }
+        } else if (now < e->pass_until) {
+            state = "BYPASS";
+        } else if (!e->filling) {
+            e->filling = 1;
+            state = "MISS";
+        } else {
+            // Someone runs the script for this key already: take its result
+            unsigned gen = e->gen;
+            e->pins++;
+            while (e->filling && e->gen == gen) pthread_cond_wait(&cache_cond, &cache_lock);
+            e->pins--;
+            continue;
+        }
+        break;
+    }
+    if (r) r->refs++;
+    pthread_mutex_unlock(&cache_lock);
+
+    if (refresh) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, cgi_refresh, refresh) == 0) {
+            pthread_detach(thread);
+        } else {
+            pthread_mutex_lock(&cache_lock);
+            cache_finish(e, NULL);
+            pthread_mutex_unlock(&cache_lock);
+            free(refresh->env);
+            free(refresh);
+        }
+    }
+
+    if (!r) {
+        r = cgi_run(script, env, NULL, 0, &error);
+        if (strcmp(state, "MISS") == 0) {
+            pthread_mutex_lock(&cache_lock);
+            cache_finish(e, r);
+            pthread_mutex_unlock(&cache_lock);
+        }
+    }
+
+send:
+    if (r) cgi_send(fd, r, state);
+    else cgi_error(fd, req, error);
+
+    pthread_mutex_lock(&cache_lock);
+    response_put(r);
+    pthread_mutex_unlock(&cache_lock);
+    free(env);
+}
+
+void cgi_serve(int fd, http_request_t *req) {
+    char script[MAXBUF], value[MAXBUF];
+    docroot_entry_t entry;
+
+    int found = docroot_lookup(req->uri, script, sizeof(script), &entry);
+    if (found == DOCROOT_INVALID) {
+        request_error(fd, req->uri, "403", "Forbidden", "Path is outside of the document root");
+        return;
+    }
+    if (found == DOCROOT_MISSING) {
+        request_error(fd, script, "404", "Not found", "Server could not find this file");
+        return;
+    }
+    if (!S_ISREG(entry.mode) || !(entry.mode & S_IXUSR)) {
+        request_error(fd, script, "403", "Forbidden", "Server could not run this script");
+        return;
+    }
+
+    const char *query = strchr(req->uri, '?');
+    char **env = cgi_env(req, script, query ? query + 1 : "");
+    if (!env) {
+        request_error(fd, req->uri, "500", "Internal Server Error", "Failed to set up the script environment");
+        return;
+    }
+
+    int cacheable = cache_ttl > 0 && strcasecmp(req->method, "GET") == 0 && req->headers &&
+        !request_find_header(req->headers, "Authorization", value, sizeof(value)) &&
+        !request_find_header(req->headers, "Cookie", value, sizeof(value));
+    if (cacheable) {
+        cgi_serve_cached(fd, req, script, env);
+        return;
+    }
+
+    int error;
+    cgi_response_t *r = cgi_run(script, env, req->body, req->body ? req->body_len : 0, &error);
+    if (r) cgi_send(fd, r, "BYPASS");
+    else cgi_error(fd, req, error);
+    response_put(r);
+    free(env);
+}
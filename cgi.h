@@ -0,0 +1,24 @@
+#ifndef __CGI_H__
+#define __CGI_H__
+#include "request.h"
+
+// CGI/1.1 scripts under /cgi/ and /cgi-bin/, with an optional micro-cache
+// for their GET responses.
+//
+// The cache is keyed by path and query string. How long a response is
+// reused comes from the script's Cache-Control (s-maxage, max-age,
+// stale-while-revalidate; no-store, no-cache and private keep it out),
+// capped at the configured TTL; without Cache-Control the TTL applies as
+// both freshness and stale window. A stale entry is served at once while
+// one background execution refreshes it. Concurrent misses on a key wait
+// for a single execution and share its result. Requests carrying
+// Authorization or Cookie are never cached, nor are responses that set a
+// cookie or carry Vary: the key has no request headers to tell variants apart.
+
+// Enables the micro-cache with the given TTL in seconds (0: off)
+void cgi_init(int max_ttl);
+
+// Runs the script req->uri names (after docroot checks) and sends its output
+void cgi_serve(int fd, http_request_t *req);
+
+#endif // __CGI_H__
@@ -0,0 +1,71 @@
+#include "io_helper.h"
+#include "connpool.h"
+#include <pthread.h>
+
+#define PAGE_SIZE 4096
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#define ROUND_UP(x, to) (((x) + (to) - 1) / (to) * (to))
+
+static conn_t *free_list = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int use_huge_pages = 0;
+static size_t slot_size = ROUND_UP(sizeof(conn_t), PAGE_SIZE);
+
+void connpool_init(int huge_pages) {
+    use_huge_pages = huge_pages;
+}
+
+// Maps a slab and threads its objects onto the free list (lock held)
+static int add_slab(void) {
+    size_t size = slot_size * CONNPOOL_SLAB_OBJECTS;
+    char *slab = MAP_FAILED;
+    if (use_huge_pages) {
+        size = ROUND_UP(size, HUGE_PAGE_SIZE);
+        slab = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (slab == MAP_FAILED) {
+        slab = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED) return -1;
+        if (use_huge_pages) madvise(slab, size, MADV_HUGEPAGE);
+    }
+
+    for (size_t off = 0; off + slot_size <= size; off += slot_size) {
+        conn_t *conn = (conn_t *) (slab + off);
+        conn->next = free_list;
+        free_list = conn;
+    }
+    return 0;
+}
+
+conn_t *connpool_get(int fd, uint32_t client_ip) {
+    pthread_mutex_lock(&lock);
+    if (!free_list && add_slab() < 0) {
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    conn_t *conn = free_list;
+    free_list = conn->next;
+    pthread_mutex_unlock(&lock);
+
+    conn->next = NULL;
+    conn->fd = fd;
+    conn->client_ip = client_ip;
+    return conn;
+}
+
+void connpool_put(conn_t *conn) {
+    // A request with a large header block should not pin it for good.
+    // Huge pages are not split for this.
+    if (!use_huge_pages && conn->headers_used > CONNPOOL_HEADERS_KEEP) {
+        uintptr_t start = ROUND_UP((uintptr_t) conn->headers + CONNPOOL_HEADERS_KEEP, PAGE_SIZE);
+        uintptr_t end = ((uintptr_t) conn->headers + CONNPOOL_HEADERS_SIZE) / PAGE_SIZE * PAGE_SIZE;
+        if (end > start) madvise((void *) start, end - start, MADV_DONTNEED);
+        conn->headers_used = 0;
+    }
+
+    pthread_mutex_lock(&lock);
+    conn->next = free_list;
+    free_list = conn;
+    pthread_mutex_unlock(&lock);
+}
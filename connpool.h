@@ -0,0 +1,44 @@
+#ifndef __CONNPOOL_H__
+#define __CONNPOOL_H__
+#include "request.h"
+
+// Connection objects: everything a connection needs up to the dispatch of
+// its request (the request line, the header block and the parsed
+// request), which used to take about 100KB of the thread's stack and a
+// malloc() in the accept loop. Objects are carved from slabs of mmap()ed
+// memory and recycled through a free list, never returned to malloc.
+//
+// A recycled object is not cleared: only the pages a request actually
+// writes become resident, and a slot whose header block grew past
+// CONNPOOL_HEADERS_KEEP gives the rest back to the kernel on release. With
+// huge pages the slabs come from MAP_HUGETLB (or transparent huge pages
+// if none are reserved) and stay whole: fewer TLB misses, more memory.
+//
+// Pages are faulted in by the thread serving the connection, so with the
+// kernel's first-touch policy they land on that thread's NUMA node.
+
+#define CONNPOOL_HEADERS_SIZE (MAXBUF * 8)
+#define CONNPOOL_HEADERS_KEEP (4 * 4096)   // resident part of a slot's header block
+#define CONNPOOL_SLAB_OBJECTS 64
+#define CONNPOOL_STACK_SIZE (512 * 1024)   // threads no longer keep buffers on the stack
+
+typedef struct conn {
+    struct conn *next;      // in the free list
+    int fd;
+    uint32_t client_ip;
+    size_t headers_used;    // high-water mark of the header block since the last trim
+    http_request_t req;
+    char line[MAXBUF];
+    char headers[CONNPOOL_HEADERS_SIZE];
+} conn_t;
+
+// Backs the slabs with huge pages; call before the first connpool_get()
+void connpool_init(int huge_pages);
+
+// A connection object for fd, or NULL if no memory is left
+conn_t *connpool_get(int fd, uint32_t client_ip);
+
+// Returns an object to the pool
+void connpool_put(conn_t *conn);
+
+#endif // __CONNPOOL_H__
@@ -0,0 +1,497 @@
+#include "io_helper.h"
+#include "request.h"
+#include "mime.h"
+#include "docroot.h"
+#include "bundle.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/inotify.h>
+
+#define DOCROOT_BUCKETS 1024        // initial size, doubled as the tree grows
+#define DOCROOT_BATCH 256           // entries a walker inserts per lock
+#define DOCROOT_MAX_WALKERS 16
+#define DOCROOT_EVENT_BUF (64 * 1024)
+
+// File contents are picked up on close; IN_MODIFY would cost a stat() per
+// write() while uploads are being stored
+#define DOCROOT_WATCH_MASK (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_ATTRIB | \
+                            IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+typedef struct index_entry {
+    struct index_entry *next;
+    uint64_t hash;
+    docroot_entry_t meta;
+    char path[];                // relative to the root, no leading "./"
+} index_entry_t;
+
+static index_entry_t **buckets = NULL;
+static size_t num_buckets = 0;
+static size_t num_entries = 0;
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static volatile int index_ready = 0;   // lookups may use the index
+static volatile int watch_failed = 0;  // some directory is not watched
+
+// inotify watch descriptor -> directory it watches
+static int inotify_fd = -1;
+static char **watch_paths = NULL;
+static int watch_cap = 0;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Hash table
+//
+
+static uint64_t path_hash(const char *path) {
+    uint64_t h = 14695981039346656037ULL; // FNV-1a
+    while (*path) {
+        h ^= (unsigned char) *path++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void fill_meta(const char *path, struct stat *st, docroot_entry_t *meta) {
+    char filetype[MAXBUF];
+    meta->size = st->st_size;
+    meta->mtime = st->st_mtime;
+    meta->mode = st->st_mode;
+    mime_get_filetype(path, filetype);
+    snprintf(meta->mime, sizeof(meta->mime), "%.31s", filetype);
+    snprintf(meta->etag, sizeof(meta->etag), "\"%llx-%llx\"",
+             (unsigned long long) st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec,
+             (unsigned long long) st->st_size);
+}
+
+static index_entry_t *entry_new(const char *path, struct stat *st) {
+    size_t len = strlen(path);
+    index_entry_t *e = malloc(sizeof(index_entry_t) + len + 1);
+    if (!e) return NULL;
+    memcpy(e->path, path, len + 1);
+    e->hash = path_hash(path);
+    e->next = NULL;
+    fill_meta(path, st, &e->meta);
+    return e;
+}
+
+static void index_grow_locked(void) {
+    size_t n = num_buckets * 2;
+    index_entry_t **b = calloc(n, sizeof(index_entry_t *));
+    if (!b) return; // keep the longer chains
+    for (size_t i = 0; i < num_buckets; i++) {
+        index_entry_t *e = buckets[i];
+        while (e) {
+            index_entry_t *next = e->next;
+            e->next = b[e->hash & (n - 1)];
+            b[e->hash & (n - 1)] = e;
+            e = next;
+        }
+    }
+    free(buckets);
+    buckets = b;
+    num_buckets = n;
+}
+
+// Inserts e, replacing an entry for the same path
+static void index_put_locked(index_entry_t *e) {
+    index_entry_t **slot = &buckets[e->hash & (num_buckets - 1)];
+    for (index_entry_t **p = slot; *p; p = &(*p)->next) {
+        if ((*p)->hash == e->hash && strcmp((*p)->path, e->path) == 0) {
+            index_entry_t *old = *p;
+            e->next = old->next;
+            *p = e;
+            free(old);
+            return;
+        }
+    }
+    e->next = *slot;
+    *slot = e;
+    if (++num_entries > num_buckets * 2) index_grow_locked();
+}
+
+static void index_put_batch(index_entry_t **batch, int n) {
+    pthread_rwlock_wrlock(&index_lock);
+    for (int i = 0; i < n; i++) index_put_locked(batch[i]);
+    pthread_rwlock_unlock(&index_lock);
+}
+
+// Removes path and, if it is a directory, everything below it
+static void index_remove_tree(const char *path) {
+    size_t len = strlen(path);
+    pthread_rwlock_wrlock(&index_lock);
+    if (len > 0) {
+        // Most removals are files (every upload unlinks its temporary):
+        // one chain is enough, only a directory needs the full scan
+        uint64_t h = path_hash(path);
+        int is_dir = 0, found = 0;
+        for (index_entry_t **p = &buckets[h & (num_buckets - 1)]; *p; p = &(*p)->next) {
+            index_entry_t *e = *p;
+            if (e->hash == h && strcmp(e->path, path) == 0) {
+                is_dir = S_ISDIR(e->meta.mode);
+                found = 1;
+                *p = e->next;
+                free(e);
+                num_entries--;
+                break;
+            }
+        }
+        if (!found || !is_dir) {
+            pthread_rwlock_unlock(&index_lock);
+            return;
+        }
+    }
+    for (size_t i = 0; i < num_buckets; i++) {
+        index_entry_t **p = &buckets[i];
+        while (*p) {
+            index_entry_t *e = *p;
+            if (len == 0 || (strncmp(e->path, path, len) == 0 &&
+                             (e->path[len] == '\0' || e->path[len] == '/'))) {
+                *p = e->next;
+                free(e);
+                num_entries--;
+            } else {
+                p = &e->next;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+}
+
+static int index_find(const char *path, docroot_entry_t *meta) {
+    uint64_t h = path_hash(path);
+    int found = 0;
+    pthread_rwlock_rdlock(&index_lock);
+    for (index_entry_t *e = buckets[h & (num_buckets - 1)]; e; e = e->next) {
+        if (e->hash == h && strcmp(e->path, path) == 0) {
+            if (meta) *meta = e->meta;
+            found = 1;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return found;
+}
+
+//
+// Watches
+//
+
+static int watch_add(const char *dir) {
+    int wd = inotify_add_watch(inotify_fd, dir[0] ? dir : ".", DOCROOT_WATCH_MASK);
+    if (wd < 0) {
+        // Without a watch this part of the tree would go stale
+        fprintf(stderr, "docroot: cannot watch '%s' (%s), using stat() instead of the index\n",
+                dir[0] ? dir : ".", strerror(errno));
+        watch_failed = 1;
+        index_ready = 0;
+        return -1;
+    }
+    pthread_mutex_lock(&watch_lock);
+    if (wd >= watch_cap) {
+        int cap = watch_cap ? watch_cap : 64;
+        while (cap <= wd) cap *= 2;
+        char **p = realloc(watch_paths, cap * sizeof(char *));
+        if (p) {
+            memset(p + watch_cap, 0, (cap - watch_cap) * sizeof(char *));
+            watch_paths = p;
+            watch_cap = cap;
+        }
+    }
+    if (wd < watch_cap) {
+        // A moved directory keeps its descriptor: the new name wins
+        free(watch_paths[wd]);
+        watch_paths[wd] = strdup(dir);
+    }
+    pthread_mutex_unlock(&watch_lock);
+    return 0;
+}
+
+static void watch_forget(int wd) {
+    pthread_mutex_lock(&watch_lock);
+    if (wd >= 0 && wd < watch_cap) {
+        free(watch_paths[wd]);
+        watch_paths[wd] = NULL;
+    }
+    pthread_mutex_unlock(&watch_lock);
+}
+
+//
+// Parallel walk: directories are a shared work list, every walker takes
+// one, indexes its entries and pushes the subdirectories it finds
+//
+
+typedef struct dir_job {
+    struct dir_job *next;
+    char path[];
+} dir_job_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    dir_job_t *head;
+    int active;            // walkers busy with a directory
+} walk_t;
+
+static void join_path(char *out, size_t size, const char *dir, const char *name) {
+    if (dir[0]) snprintf(out, size, "%s/%s", dir, name);
+    else snprintf(out, size, "%s", name);
+}
+
+static void walk_push(walk_t *w, const char *path) {
+    size_t len = strlen(path);
+    dir_job_t *job = malloc(sizeof(dir_job_t) + len + 1);
+    if (!job) return;
+    memcpy(job->path, path, len + 1);
+    pthread_mutex_lock(&w->lock);
+    job->next = w->head;
+    w->head = job;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void walk_dir(walk_t *w, const char *dir) {
+    index_entry_t *batch[DOCROOT_BATCH];
+    int n = 0;
+    char path[MAXBUF];
+
+    // Watch before reading, so nothing created in between is missed
+    if (watch_add(dir) < 0) return;
+    DIR *d = opendir(dir[0] ? dir : ".");
+    if (!d) return;
+
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        join_path(path, sizeof(path), dir, de->d_name);
+
+        struct stat st;
+        if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) continue;
+        if (S_ISLNK(st.st_mode)) {
+            // Serve what the link points to, but do not descend into it
+            if (fstatat(dirfd(d), de->d_name, &st, 0) < 0) continue;
+        } else if (S_ISDIR(st.st_mode)) {
+            walk_push(w, path);
+        }
+
+        index_entry_t *e = entry_new(path, &st);
+        if (!e) continue;
+        batch[n++] = e;
+        if (n == DOCROOT_BATCH) {
+            index_put_batch(batch, n);
+            n = 0;
+        }
+    }
+    closedir(d);
+    if (n) index_put_batch(batch, n);
+}
+
+static void *walker(void *arg) {
+    walk_t *w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->head && w->active > 0) pthread_cond_wait(&w->cond, &w->lock);
+        if (!w->head) break; // nothing queued and nobody can queue more
+
+        dir_job_t *job = w->head;
+        w->head = job->next;
+        w->active++;
+        pthread_mutex_unlock(&w->lock);
+
+        walk_dir(w, job->path);
+        free(job);
+
+        pthread_mutex_lock(&w->lock);
+        w->active--;
+        if (!w->head && w->active == 0) pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static void walk_tree(const char *root, int walkers) {
+    walk_t w;
+    pthread_t threads[DOCROOT_MAX_WALKERS];
+    int started = 0;
+
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    w.head = NULL;
+    w.active = 0;
+    walk_push(&w, root);
+
+    if (walkers > DOCROOT_MAX_WALKERS) walkers = DOCROOT_MAX_WALKERS;
+    for (int i = 1; i < walkers; i++) {
+        if (pthread_create(&threads[started], NULL, walker, &w) == 0) started++;
+    }
+    walker(&w);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.cond);
+}
+
+//
+// Updates
+//
+
+static void refresh_path(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+        index_remove_tree(path);
+        return;
+    }
+    int is_dir = S_ISDIR(st.st_mode);
+    if (S_ISLNK(st.st_mode) && stat(path, &st) < 0) {
+        index_remove_tree(path);
+        return;
+    }
+    // A directory new to the index (created or moved in) is walked; known
+    // ones only get their own metadata updated
+    int known = index_find(path, NULL);
+    index_entry_t *e = entry_new(path, &st);
+    if (e) index_put_batch(&e, 1);
+    if (is_dir && !known) walk_tree(path, 1);
+}
+
+void docroot_refresh(const char *path) {
+    if (!index_ready) return;
+    while (path[0] == '.' && path[1] == '/') path += 2;
+    refresh_path(path);
+}
+
+// Walks the whole root; the index is used once the walk is complete
+static void index_build(int walkers) {
+    struct stat st;
+    if (stat(".", &st) == 0) {
+        index_entry_t *e = entry_new("", &st);
+        if (e) index_put_batch(&e, 1);
+    }
+    walk_tree("", walkers);
+    index_ready = !watch_failed;
+}
+
+static void *docroot_watch(void *arg) {
+    (void) arg;
+    char buf[DOCROOT_EVENT_BUF] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[MAXBUF];
+
+    for (;;) {
+        ssize_t n = read(inotify_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // Events were lost: serve through stat() while re-walking
+                fprintf(stderr, "docroot: inotify queue overflow, rebuilding the index\n");
+                index_ready = 0;
+                index_remove_tree("");
+                index_build(1);
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                watch_forget(ev->wd);
+                continue;
+            }
+            if (ev->len == 0) continue; // the parent's watch reports it by name
+
+            pthread_mutex_lock(&watch_lock);
+            int known = ev->wd < watch_cap && watch_paths[ev->wd];
+            if (known) join_path(path, sizeof(path), watch_paths[ev->wd], ev->name);
+            pthread_mutex_unlock(&watch_lock);
+            if (known && !watch_failed) refresh_path(path);
+        }
+    }
+    return NULL;
+}
+
+int docroot_init(int walkers) {
+    buckets = calloc(DOCROOT_BUCKETS, sizeof(index_entry_t *));
+    if (!buckets) return -1;
+    num_buckets = DOCROOT_BUCKETS;
+
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        fprintf(stderr, "docroot: inotify unavailable (%s), using stat() instead of the index\n",
+                strerror(errno));
+        return -1;
+    }
+
+    index_build(walkers > 0 ? walkers : 1);
+    if (!index_ready) return -1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, docroot_watch, NULL) != 0) {
+        index_ready = 0;
+        return -1;
+    }
+    pthread_detach(thread);
+    printf("Indexed %zu paths in the document root\n", num_entries);
+    return 0;
+}
+
+//
+// Lookup
+//
+
+// Turns the path part of uri into a relative path without "", "." or ".."
+// segments. Returns -1 for ".." or a uri that is not absolute.
+static int normalize_uri(const char *uri, char *out, size_t size) {
+    size_t len = 0;
+    const char *p = uri;
+
+    if (*p != '/') return -1;
+    out[0] = '\0';
+    while (*p && *p != '?' && *p != '#') {
+        while (*p == '/') p++;
+        size_t seg = strcspn(p, "/?#");
+        if (seg == 0) break;
+        if (seg == 2 && p[0] == '.' && p[1] == '.') return -1;
+        if (!(seg == 1 && p[0] == '.')) {
+            if (len + (len > 0) + seg + 1 > size) return -1;
+            if (len > 0) out[len++] = '/';
+            memcpy(out + len, p, seg);
+            len += seg;
+            out[len] = '\0';
+        }
+        p += seg;
+    }
+
+    // ".../" names the directory's index page
+    if (p > uri && p[-1] == '/') {
+        const char *index = "index.html";
+        if (len + (len > 0) + strlen(index) + 1 > size) return -1;
+        if (len > 0) out[len++] = '/';
+        strcpy(out + len, index);
+    }
+    return 0;
+}
+
+int docroot_lookup(const char *uri, char *path, size_t path_size, docroot_entry_t *entry) {
+    char rel[MAXBUF];
+    if (normalize_uri(uri, rel, sizeof(rel)) < 0) return DOCROOT_INVALID;
+    if ((size_t) snprintf(path, path_size, "./%s", rel) >= path_size) return DOCROOT_INVALID;
+
+    // Bundled assets shadow the files on disk
+    const bundle_record_t *r = bundle_find(rel);
+    if (r) {
+        entry->size = r->body_len;
+        entry->mtime = r->mtime;
+        entry->mode = r->mode;
+        memcpy(entry->mime, r->mime, sizeof(entry->mime));
+        memcpy(entry->etag, r->etag, sizeof(entry->etag));
+        return DOCROOT_FOUND;
+    }
+
+    if (index_ready) {
+        return index_find(rel, entry) ? DOCROOT_FOUND : DOCROOT_MISSING;
+    }
+
+    struct stat st;
+    if (stat(path, &st) < 0) return DOCROOT_MISSING;
+    fill_meta(path, &st, entry);
+    return DOCROOT_FOUND;
+}
@@ -0,0 +1,46 @@
+#ifndef __DOCROOT_H__
+#define __DOCROOT_H__
+#include <sys/types.h>
+#include <time.h>
+
+// In-memory index of the document root (the working directory). At start
+// the tree is walked by several threads into a hash table keyed by the
+// normalised relative path; inotify keeps it current afterwards. A GET
+// is then one hash probe whether the file exists or not, and paths that
+// try to leave the root with ".." never reach the file system.
+//
+// Symlinked directories are not descended into. If the index cannot be
+// maintained (no inotify, watch limit reached) lookups fall back to
+// stat() with the same path rules.
+//
+// Paths packed into a bundle (bundle.h) are answered from the bundle.
+
+// Return values of docroot_lookup()
+#define DOCROOT_INVALID  (-1)  // the path escapes the root or is malformed
+#define DOCROOT_MISSING    0
+#define DOCROOT_FOUND      1
+
+typedef struct {
+    off_t size;
+    time_t mtime;
+    mode_t mode;
+    char mime[32];
+    char etag[48];   // quoted, derived from size and mtime
+} docroot_entry_t;
+
+// Builds the index of the current directory with 'walkers' threads and
+// starts the inotify thread. Returns 0 on success, -1 if the server has
+// to do without the index.
+int docroot_init(int walkers);
+
+// Resolves a request URI: drops the query, collapses "//" and "/./",
+// appends index.html to directories named with a trailing '/' and
+// rejects "..". On success path receives "./<normalised path>".
+int docroot_lookup(const char *uri, char *path, size_t path_size, docroot_entry_t *entry);
+
+// Re-reads path (relative to the root) right away. For files the server
+// itself has just created, so that they can be served before the inotify
+// event arrives.
+void docroot_refresh(const char *path);
+
+#endif // __DOCROOT_H__
@@ -0,0 +1,144 @@
+#include "io_helper.h"
+#include "request.h"
+#include "handoff.h"
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+
+#define HANDOFF_READY_MSG "ready"
+
+static char **saved_argv = NULL;
+static char exe_path[PATH_MAX];
+static char start_dir[PATH_MAX];
+static int channel_fd = -1;       // to the predecessor, until ready
+
+void handoff_init(int argc, char *argv[]) {
+    // getopt() may permute argv: keep the arguments as given
+    saved_argv = calloc(argc + 1, sizeof(char *));
+    for (int i = 0; saved_argv && i < argc; i++) saved_argv[i] = argv[i];
+
+    // The successor is whatever binary is at this path now (the new
+    // version after a deploy), started from the same directory
+    if (!getcwd(start_dir, sizeof(start_dir))) start_dir[0] = '\0';
+    if (strchr(argv[0], '/') && realpath(argv[0], exe_path)) return;
+    snprintf(exe_path, sizeof(exe_path), "%s", argv[0]); // looked up in PATH
+}
+
+int handoff_receive(void) {
+    const char *env = getenv(HANDOFF_ENV);
+    if (!env) return -1;
+    channel_fd = atoi(env);
+    unsetenv(HANDOFF_ENV);
+    fcntl(channel_fd, F_SETFD, FD_CLOEXEC);
+
+    char byte;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(channel_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    struct cmsghdr *cmsg = n == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "handoff: no listening socket from the predecessor\n");
+        close(channel_fd);
+        channel_fd = -1;
+        return -1;
+    }
+    int listen_fd;
+    memcpy(&listen_fd, CMSG_DATA(cmsg), sizeof(int));
+    return listen_fd;
+}
+
+void handoff_ready(void) {
+    if (channel_fd < 0) return;
+    send(channel_fd, HANDOFF_READY_MSG, sizeof(HANDOFF_READY_MSG) - 1, MSG_NOSIGNAL);
+    close(channel_fd);
+    channel_fd = -1;
+}
+
+// Waits for the successor's "ready"; 0 on success
+static int wait_ready(int fd) {
+    char buf[sizeof(HANDOFF_READY_MSG)];
+    size_t got = 0;
+    time_t deadline = time(NULL) + HANDOFF_READY_TIMEOUT;
+    while (got < sizeof(HANDOFF_READY_MSG) - 1) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int left = deadline - time(NULL);
+        if (left <= 0) return -1;
+        int rc = poll(&pfd, 1, left * 1000);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) return -1;
+        ssize_t n = recv(fd, buf + got, sizeof(HANDOFF_READY_MSG) - 1 - got, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1; // the successor died during startup
+        got += n;
+    }
+    return memcmp(buf, HANDOFF_READY_MSG, got) == 0 ? 0 : -1;
+}
+
+int handoff_start(int listen_fd) {
+    int sv[2];
+    if (!saved_argv || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) return -1;
+
+    // The environment is built before fork(): other threads may hold the
+    // malloc lock, so the child only makes async-signal-safe calls
+    size_t n = 0;
+    while (environ[n]) n++;
+    char **envp = calloc(n + 2, sizeof(char *));
+    char env[64];
+    snprintf(env, sizeof(env), HANDOFF_ENV "=%d", sv[1]);
+    if (envp) {
+        memcpy(envp, environ, n * sizeof(char *));
+        envp[n] = env;
+    }
+
+    pid_t pid = envp ? fork() : -1;
+    if (pid < 0) {
+        free(envp);
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        // Only the successor's end survives exec
+        fcntl(sv[1], F_SETFD, 0);
+        if (start_dir[0] && chdir(start_dir) < 0) _exit(127);
+        execvpe(exe_path, saved_argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(sv[1]);
+
+    // Pass the socket; both processes accept on it until the successor is ready
+    char byte = 'L';
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listen_fd, sizeof(int));
+
+    int ok = sendmsg(sv[0], &msg, MSG_NOSIGNAL) == 1 && wait_ready(sv[0]) == 0;
+    close(sv[0]);
+    if (!ok) {
+        fprintf(stderr, "handoff: successor %d did not come up, still serving\n", (int) pid);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    return pid;
+}
@@ -0,0 +1,28 @@
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+// Zero-downtime upgrade. The running server starts its successor (the
+// binary at the path it was started from, with the same arguments and
+// working directory) and passes it the listening socket over a Unix
+// socket with SCM_RIGHTS. The successor finishes its startup (document
+// root index, routes, caches) while the old process keeps accepting, then
+// reports ready; only then does the old process stop accepting and drain.
+// The socket is never closed, so no connection is refused.
+
+#define HANDOFF_ENV "WSERVER_HANDOFF_FD"
+#define HANDOFF_READY_TIMEOUT 30 // seconds the successor has to start up
+
+// Remembers how this process was started; call first thing in main()
+void handoff_init(int argc, char *argv[]);
+
+// The listening socket inherited from a predecessor, or -1
+int handoff_receive(void);
+
+// Tells the predecessor that this process is accepting connections
+void handoff_ready(void);
+
+// Starts the successor and hands it listen_fd. Returns its pid once it is
+// ready, or -1 if it failed to come up (this process keeps serving).
+int handoff_start(int listen_fd);
+
+#endif // __HANDOFF_H__
@@ -0,0 +1,482 @@
+#include "hpack.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_STATIC_COUNT 61
+#define HPACK_MAX_STRING (64 * 1024)
+
+// Huffman code of each symbol (RFC 7541, Appendix B); 256 is EOS
+static const struct { unsigned int code; unsigned char bits; } huffman_codes[257] = {
+    { 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+    { 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+    { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+    { 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+    { 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+    { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+    { 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+    { 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+    { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+    { 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+    { 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+    { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+    { 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+    { 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+    { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+    { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+    { 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+    { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+    { 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+    { 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+    { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+    { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+    { 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+    { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+    { 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+    { 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+    { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+    { 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+    { 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+    { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+    { 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+    { 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+    { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+    { 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+    { 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+    { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+    { 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+    { 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+    { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+    { 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+    { 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+    { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+    { 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+    { 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+    { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+    { 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+    { 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+    { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+    { 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+    { 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+    { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+    { 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+    { 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+    { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+    { 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+    { 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+    { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+    { 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+    { 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+    { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+    { 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+    { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+    { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+    { 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+    { 0x3fffffff, 30 },
+};
+
+// Static table (RFC 7541, Appendix A); index 0 is unused
+static const struct { const char *name; const char *value; } static_table[] = {
+    { NULL, NULL },
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+//
+// Huffman decoding
+//
+
+// Binary decoding tree built from huffman_codes. A child value > 0 is an
+// inner node, < 0 encodes the leaf symbol as -(symbol + 1), 0 is unused.
+static short huffman_tree[512][2];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_build(void) {
+    int next_node = 1;
+    for (int sym = 0; sym < 257; sym++) {
+        unsigned int code = huffman_codes[sym].code;
+        int bits = huffman_codes[sym].bits;
+        int node = 0;
+        for (int i = bits - 1; i > 0; i--) {
+            int bit = (code >> i) & 1;
+            if (huffman_tree[node][bit] == 0) huffman_tree[node][bit] = next_node++;
+            node = huffman_tree[node][bit];
+        }
+        huffman_tree[node][code & 1] = -(sym + 1);
+    }
+}
+
+// Decodes len bytes of Huffman-coded data into out (at most 8/5 * len bytes)
+static int huffman_decode(const unsigned char *in, size_t len, char *out, size_t *out_len) {
+    pthread_once(&huffman_once, huffman_build);
+
+    size_t n = 0;
+    int node = 0;
+    int depth = 0;      // bits consumed since the last complete symbol
+    int all_ones = 1;   // padding must be a prefix of EOS (all 1 bits)
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            int bit = (in[i] >> b) & 1;
+            int child = huffman_tree[node][bit];
+            depth++;
+            all_ones &= bit;
+            if (child < 0) {
+                int sym = -child - 1;
+                if (sym == 256) return -1; // EOS must not appear in the data
+                out[n++] = sym;
+                node = 0;
+                depth = 0;
+                all_ones = 1;
+            } else if (child == 0) {
+                return -1;
+            } else {
+                node = child;
+            }
+        }
+    }
+    if (depth > 7 || !all_ones) return -1;
+    *out_len = n;
+    return 0;
+}
+
+//
+// Primitive types
+//
+
+static int decode_int(const unsigned char **p, const unsigned char *end, int prefix_bits, size_t *value) {
+    if (*p >= end) return -1;
+    size_t max_prefix = (1u << prefix_bits) - 1;
+    size_t v = **p & max_prefix;
+    (*p)++;
+    if (v < max_prefix) {
+        *value = v;
+        return 0;
+    }
+    int shift = 0;
+    while (*p < end) {
+        unsigned char byte = **p;
+        (*p)++;
+        if (shift > 28) return -1;
+        v += (size_t) (byte & 0x7f) << shift;
+        shift += 7;
+        if (!(byte & 0x80)) {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Decodes a string literal into a freshly allocated NUL terminated buffer
+static int decode_string(const unsigned char **p, const unsigned char *end, char **str, size_t *str_len) {
+    if (*p >= end) return -1;
+    int huffman = **p & 0x80;
+    size_t len;
+    if (decode_int(p, end, 7, &len) < 0 || len > (size_t) (end - *p) || len > HPACK_MAX_STRING) return -1;
+
+    // Huffman codes are at least 5 bits long
+    size_t cap = huffman ? len * 8 / 5 + 1 : len + 1;
+    char *s = malloc(cap);
+    if (!s) return -1;
+    if (huffman) {
+        if (huffman_decode(*p, len, s, str_len) < 0) {
+            free(s);
+            return -1;
+        }
+    } else {
+        memcpy(s, *p, len);
+        *str_len = len;
+    }
+    s[*str_len] = '\0';
+    *p += len;
+    *str = s;
+    return 0;
+}
+
+//
+// Dynamic table
+//
+
+void hpack_decoder_init(hpack_decoder_t *dec, size_t max_size) {
+    memset(dec, 0, sizeof(*dec));
+    dec->max_size = max_size;
+    dec->settings_max_size = max_size;
+}
+
+static void entry_free(hpack_entry_t *e) {
+    free(e->name);
+    free(e->value);
+    e->name = e->value = NULL;
+}
+
+void hpack_decoder_free(hpack_decoder_t *dec) {
+    for (size_t i = 0; i < dec->count; i++) {
+        entry_free(&dec->entries[(dec->head + dec->capacity - i) % dec->capacity]);
+    }
+    free(dec->entries);
+    memset(dec, 0, sizeof(*dec));
+}
+
+// Evicts the oldest entries until the table fits into limit
+static void table_evict(hpack_decoder_t *dec, size_t limit) {
+    while (dec->count > 0 && dec->size > limit) {
+        size_t oldest = (dec->head + dec->capacity - (dec->count - 1)) % dec->capacity;
+        hpack_entry_t *e = &dec->entries[oldest];
+        dec->size -= e->name_len + e->value_len + HPACK_ENTRY_OVERHEAD;
+        entry_free(e);
+        dec->count--;
+    }
+}
+
+// Takes ownership of name and value
+static int table_add(hpack_decoder_t *dec, char *name, size_t name_len, char *value, size_t value_len) {
+    size_t entry_size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+    if (entry_size > dec->max_size) {
+        // An entry larger than the table empties it and is not stored
+        table_evict(dec, 0);
+        free(name);
+        free(value);
+        return 0;
+    }
+    table_evict(dec, dec->max_size - entry_size);
+
+    if (dec->count == dec->capacity) {
+        size_t new_capacity = dec->capacity ? dec->capacity * 2 : 16;
+        hpack_entry_t *entries = calloc(new_capacity, sizeof(hpack_entry_t));
+        if (!entries) {
+            free(name);
+            free(value);
+            return -1;
+        }
+        // Re-linearise so the oldest entry lands in slot 0
+        for (size_t i = 0; i < dec->count; i++) {
+            entries[i] = dec->entries[(dec->head + dec->capacity - (dec->count - 1 - i)) % dec->capacity];
+        }
+        free(dec->entries);
+        dec->entries = entries;
+        dec->capacity = new_capacity;
+        dec->head = dec->count ? dec->count - 1 : new_capacity - 1;
+    }
+
+    dec->head = (dec->head + 1) % dec->capacity;
+    hpack_entry_t *e = &dec->entries[dec->head];
+    e->name = name;
+    e->value = value;
+    e->name_len = name_len;
+    e->value_len = value_len;
+    dec->count++;
+    dec->size += entry_size;
+    return 0;
+}
+
+// Resolves an index into the static or dynamic table
+static int table_get(hpack_decoder_t *dec, size_t index, const char **name, size_t *name_len,
+                     const char **value, size_t *value_len) {
+    if (index == 0) return -1;
+    if (index <= HPACK_STATIC_COUNT) {
+        *name = static_table[index].name;
+        *value = static_table[index].value;
+        *name_len = strlen(*name);
+        *value_len = strlen(*value);
+        return 0;
+    }
+    index -= HPACK_STATIC_COUNT + 1;
+    if (index >= dec->count) return -1;
+    hpack_entry_t *e = &dec->entries[(dec->head + dec->capacity - index) % dec->capacity];
+    *name = e->name;
+    *value = e->value;
+    *name_len = e->name_len;
+    *value_len = e->value_len;
+    return 0;
+}
+
+//
+// Header block decoding
+//
+
+int hpack_decode(hpack_decoder_t *dec, const unsigned char *block, size_t len,
+                 hpack_header_cb cb, void *ctx) {
+    const unsigned char *p = block;
+    const unsigned char *end = block + len;
+    int headers_seen = 0;
+
+    while (p < end) {
+        unsigned char first = *p;
+        size_t index;
+        int rc;
+
+        if (first & 0x80) {
+            // Indexed header field
+            const char *name, *value;
+            size_t name_len, value_len;
+            if (decode_int(&p, end, 7, &index) < 0 ||
+                table_get(dec, index, &name, &name_len, &value, &value_len) < 0) return -1;
+            if ((rc = cb(ctx, name, name_len, value, value_len)) != 0) return rc;
+            headers_seen = 1;
+        } else if ((first & 0xe0) == 0x20) {
+            // Dynamic table size update, only allowed before the first header
+            if (headers_seen || decode_int(&p, end, 5, &index) < 0 || index > dec->settings_max_size) return -1;
+            dec->max_size = index;
+            table_evict(dec, dec->max_size);
+        } else {
+            // Literal header field, with incremental indexing (01xxxxxx),
+            // without indexing (0000xxxx) or never indexed (0001xxxx)
+            int indexing = (first & 0xc0) == 0x40;
+            char *name = NULL, *value = NULL;
+            size_t name_len, value_len;
+
+            if (decode_int(&p, end, indexing ? 6 : 4, &index) < 0) return -1;
+            if (index == 0) {
+                if (decode_string(&p, end, &name, &name_len) < 0) return -1;
+            } else {
+                const char *ref_name, *ref_value;
+                size_t ref_value_len;
+                if (table_get(dec, index, &ref_name, &name_len, &ref_value, &ref_value_len) < 0) return -1;
+                name = strndup(ref_name, name_len);
+                if (!name) return -1;
+            }
+            if (decode_string(&p, end, &value, &value_len) < 0) {
+                free(name);
+                return -1;
+            }
+
+            rc = cb(ctx, name, name_len, value, value_len);
+            if (indexing && rc == 0) {
+                if (table_add(dec, name, name_len, value, value_len) < 0) return -1;
+            } else {
+                free(name);
+                free(value);
+            }
+            if (rc != 0) return rc;
+            headers_seen = 1;
+        }
+    }
+    return 0;
+}
+
+//
+// Encoding
+//
+
+static int encode_int(unsigned char *out, size_t out_size, int prefix_bits, unsigned char flags, size_t value) {
+    size_t max_prefix = (1u << prefix_bits) - 1;
+    size_t n = 0;
+    if (out_size < 1) return -1;
+    if (value < max_prefix) {
+        out[n++] = flags | value;
+        return n;
+    }
+    out[n++] = flags | max_prefix;
+    value -= max_prefix;
+    while (value >= 0x80) {
+        if (n >= out_size) return -1;
+        out[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if (n >= out_size) return -1;
+    out[n++] = value;
+    return n;
+}
+
+static int encode_string(unsigned char *out, size_t out_size, const char *s, size_t len) {
+    int n = encode_int(out, out_size, 7, 0x00, len);
+    if (n < 0 || (size_t) n + len > out_size) return -1;
+    memcpy(out + n, s, len);
+    return n + len;
+}
+
+int hpack_encode_status(unsigned char *out, size_t out_size, int status) {
+    char value[8];
+    // Fully indexed forms exist for the most common codes
+    for (int i = 8; i <= 14; i++) {
+        if (atoi(static_table[i].value) == status) return encode_int(out, out_size, 7, 0x80, i);
+    }
+    snprintf(value, sizeof(value), "%03d", status % 1000);
+    return hpack_encode_header(out, out_size, ":status", value, 3);
+}
+
+int hpack_encode_header(unsigned char *out, size_t out_size,
+                        const char *name, const char *value, size_t value_len) {
+    int name_index = 0;
+    for (int i = 1; i <= HPACK_STATIC_COUNT; i++) {
+        if (strcasecmp(static_table[i].name, name) == 0) {
+            name_index = i;
+            break;
+        }
+    }
+
+    // Literal without indexing: nothing is added to the peer's table
+    int n = encode_int(out, out_size, 4, 0x00, name_index);
+    if (n < 0) return -1;
+    int m;
+    if (name_index == 0) {
+        m = encode_string(out + n, out_size - n, name, strlen(name));
+        if (m < 0) return -1;
+        n += m;
+    }
+    m = encode_string(out + n, out_size - n, value, value_len);
+    if (m < 0) return -1;
+    return n + m;
+}
@@ -0,0 +1,47 @@
+#ifndef __HPACK_H__
+#define __HPACK_H__
+#include <stddef.h>
+
+// HPACK header compression for HTTP/2 (RFC 7541).
+// The decoder keeps the dynamic table of one connection; the encoder never
+// adds to the peer's dynamic table, so it needs no state at all.
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+
+typedef struct {
+    char *name;
+    char *value;
+    size_t name_len;
+    size_t value_len;
+} hpack_entry_t;
+
+typedef struct {
+    hpack_entry_t *entries;   // ring buffer, newest entry at 'head'
+    size_t capacity;          // number of slots in entries
+    size_t count;
+    size_t head;
+    size_t size;              // RFC 7541 size (lengths + 32 per entry)
+    size_t max_size;          // current limit set by the encoder
+    size_t settings_max_size; // upper bound we advertised in SETTINGS
+} hpack_decoder_t;
+
+// Called once per decoded header; name and value are NUL terminated
+typedef int (*hpack_header_cb)(void *ctx, const char *name, size_t name_len,
+                               const char *value, size_t value_len);
+
+void hpack_decoder_init(hpack_decoder_t *dec, size_t max_size);
+void hpack_decoder_free(hpack_decoder_t *dec);
+
+// Decodes a complete header block. Returns 0 on success, -1 on a
+// compression error (the connection must then be torn down), or the
+// callback's non-zero return value.
+int hpack_decode(hpack_decoder_t *dec, const unsigned char *block, size_t len,
+                 hpack_header_cb cb, void *ctx);
+
+// Encoders append to out and return the number of bytes written, or -1
+// if out_size is too small
+int hpack_encode_status(unsigned char *out, size_t out_size, int status);
+int hpack_encode_header(unsigned char *out, size_t out_size,
+                        const char *name, const char *value, size_t value_len);
+
+#endif // __HPACK_H__
@@ -0,0 +1,1055 @@
+#include "io_helper.h"
+#include "request.h"
+#include "http2.h"
+#include "hpack.h"
+#include "ratelimit.h"
+#include "trace.h"
+#include "membudget.h"
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_TAIL "SM\r\n\r\n"
+#define H2_FRAME_HEADER_LEN 9
+#define H2_MAX_FRAME 16384              // largest frame we accept (protocol default)
+#define H2_MAX_STREAMS 100
+#define H2_DEFAULT_WINDOW 65535
+#define H2_WINDOW (1 << 20)             // receive window granted per stream and connection
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_IDLE_TIMEOUT_MS 30000
+#define H2_MAX_HEADER_BLOCK (64 * 1024)
+#define H2_MAX_BODY MAX_BODY_SIZE
+#define H2_DEFAULT_URGENCY 3
+#define H2_WORKER_STACK_SIZE (512 * 1024)
+
+// Frame types
+#define H2_DATA          0x0
+#define H2_HEADERS       0x1
+#define H2_PRIORITY      0x2
+#define H2_RST_STREAM    0x3
+#define H2_SETTINGS      0x4
+#define H2_PUSH_PROMISE  0x5
+#define H2_PING          0x6
+#define H2_GOAWAY        0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION  0x9
+
+// Frame flags
+#define H2_FLAG_END_STREAM  0x1
+#define H2_FLAG_ACK         0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED      0x8
+#define H2_FLAG_PRIORITY    0x20
+
+// Error codes
+#define H2_NO_ERROR          0x0
+#define H2_PROTOCOL_ERROR    0x1
+#define H2_INTERNAL_ERROR    0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED     0x5
+#define H2_FRAME_SIZE_ERROR  0x6
+#define H2_REFUSED_STREAM    0x7
+#define H2_COMPRESSION_ERROR 0x9
+
+// Settings
+#define H2_SETTINGS_HEADER_TABLE_SIZE      0x1
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE    0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE         0x5
+
+typedef struct h2_stream {
+    uint32_t id;
+    int remote_closed;      // peer sent END_STREAM
+    int responded;          // response has been produced
+    int refused;            // headers are decoded but the stream is dropped
+    int urgency;            // 0 (most urgent) .. 7, as in RFC 9218
+    int incremental;        // share bandwidth with streams of equal urgency
+    int has_priority;       // urgency was signalled by the client
+    int headers_overflow;
+    int malformed;          // a field RFC 9113 8.2.1 forbids: reset the stream
+    int rate_checked;       // already counted against the rate limits
+    char method[32];
+    char *path;
+    char *headers;          // HTTP/1-style "Name: value\r\n" lines
+    size_t headers_len;
+    size_t headers_cap;
+    char *body;
+    size_t body_len;
+    size_t body_cap;
+    size_t recv_unacked;    // DATA bytes not yet returned by WINDOW_UPDATE
+    // Response, captured from request_dispatch()
+    char *resp;
+    size_t resp_size;
+    size_t resp_reserved;   // of the memory budget, for the captured response
+    size_t data_off;
+    int64_t send_window;
+    struct h2_stream *next;
+} h2_stream_t;
+
+typedef struct {
+    int fd;
+    uint32_t client_ip;
+    int dead;               // connection error or socket failure
+    int closing;            // peer sent GOAWAY: finish responses, read no more
+    int inflight;           // streams whose handler is still running
+    int wake_fd;            // eventfd: a worker finished a response
+    pthread_mutex_t done_lock;
+    struct h2_job *done;    // finished responses, not yet picked up
+    hpack_decoder_t decoder;
+    h2_stream_t *streams;
+    int num_streams;
+    uint32_t last_stream_id;
+    uint32_t rr_last;       // last stream served, for round-robin scheduling
+    int64_t send_window;
+    size_t recv_unacked;
+    uint32_t peer_initial_window;
+    uint32_t peer_max_frame;
+    // Header block being assembled from HEADERS + CONTINUATION
+    int block_open;
+    unsigned char *block;
+    size_t block_len;
+    size_t block_cap;
+    uint32_t block_stream;
+    int block_end_stream;
+    unsigned char frame[H2_MAX_FRAME];
+} h2_conn_t;
+
+//
+// Helpers
+//
+
+static uint32_t get_u32(const unsigned char *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, (char *) buf + got, len - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        got += n;
+    }
+    return 0;
+}
+
+int http2_is_preface(http_request_t *req) {
+    return strcmp(req->method, "PRI") == 0 && strcmp(req->uri, "*") == 0 &&
+           strcmp(req->version, "HTTP/2.0") == 0;
+}
+
+int http2_is_upgrade(http_request_t *req) {
+    char value[MAXBUF];
+    if (strcmp(req->version, "HTTP/1.1") != 0) return 0;
+    if (!request_find_header(req->headers, "Upgrade", value, sizeof(value)) || !strcasestr(value, "h2c")) return 0;
+    return request_find_header(req->headers, "HTTP2-Settings", value, sizeof(value));
+}
+
+//
+// Frame output
+//
+
+static int h2_send_frame(h2_conn_t *conn, int type, int flags, uint32_t stream_id,
+                         const void *payload, size_t len) {
+    unsigned char header[H2_FRAME_HEADER_LEN];
+    header[0] = len >> 16;
+    header[1] = len >> 8;
+    header[2] = len;
+    header[3] = type;
+    header[4] = flags;
+    put_u32(header + 5, stream_id & 0x7fffffff);
+
+    struct iovec iov[2] = {
+        { header, H2_FRAME_HEADER_LEN },
+        { (void *) payload, len },
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len ? 2 : 1;
+
+    // sendmsg rather than write: MSG_NOSIGNAL keeps a vanished peer from
+    // killing the process with SIGPIPE
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            conn->dead = 1;
+            return -1;
+        }
+        while (msg.msg_iovlen > 0 && (size_t) n >= msg.msg_iov[0].iov_len) {
+            n -= msg.msg_iov[0].iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov[0].iov_base = (char *) msg.msg_iov[0].iov_base + n;
+            msg.msg_iov[0].iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static void h2_send_rst(h2_conn_t *conn, uint32_t stream_id, uint32_t code) {
+    unsigned char payload[4];
+    put_u32(payload, code);
+    h2_send_frame(conn, H2_RST_STREAM, 0, stream_id, payload, 4);
+}
+
+static void h2_send_window_update(h2_conn_t *conn, uint32_t stream_id, uint32_t increment) {
+    unsigned char payload[4];
+    put_u32(payload, increment);
+    h2_send_frame(conn, H2_WINDOW_UPDATE, 0, stream_id, payload, 4);
+}
+
+static void h2_send_goaway(h2_conn_t *conn, uint32_t code) {
+    unsigned char payload[8];
+    put_u32(payload, conn->last_stream_id);
+    put_u32(payload + 4, code);
+    h2_send_frame(conn, H2_GOAWAY, 0, 0, payload, 8);
+}
+
+// Connection error: tell the peer why and stop processing
+static int h2_conn_error(h2_conn_t *conn, uint32_t code) {
+    h2_send_goaway(conn, code);
+    conn->dead = 1;
+    return -1;
+}
+
+static void h2_send_settings(h2_conn_t *conn) {
+    unsigned char payload[12];
+    payload[0] = 0;
+    payload[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    put_u32(payload + 2, H2_MAX_STREAMS);
+    payload[6] = 0;
+    payload[7] = H2_SETTINGS_INITIAL_WINDOW_SIZE;
+    put_u32(payload + 8, H2_WINDOW);
+    h2_send_frame(conn, H2_SETTINGS, 0, 0, payload, sizeof(payload));
+    // The connection window can only be raised by WINDOW_UPDATE
+    h2_send_window_update(conn, 0, H2_WINDOW - H2_DEFAULT_WINDOW);
+}
+
+//
+// Streams
+//
+
+static h2_stream_t *h2_find_stream(h2_conn_t *conn, uint32_t id) {
+    for (h2_stream_t *s = conn->streams; s; s = s->next) {
+        if (s->id == id) return s;
+    }
+    return NULL;
+}
+
+static h2_stream_t *h2_new_stream(h2_conn_t *conn, uint32_t id) {
+    h2_stream_t *s = calloc(1, sizeof(h2_stream_t));
+    if (!s) return NULL;
+    s->id = id;
+    s->urgency = H2_DEFAULT_URGENCY;
+    s->send_window = conn->peer_initial_window;
+    s->next = conn->streams;
+    conn->streams = s;
+    conn->num_streams++;
+    return s;
+}
+
+static void h2_free_stream(h2_conn_t *conn, h2_stream_t *stream) {
+    for (h2_stream_t **pp = &conn->streams; *pp; pp = &(*pp)->next) {
+        if (*pp == stream) {
+            *pp = stream->next;
+            break;
+        }
+    }
+    conn->num_streams--;
+    if (stream->resp) munmap(stream->resp, stream->resp_size);
+    membudget_release(stream->resp_reserved);
+    free(stream->path);
+    free(stream->headers);
+    free(stream->body);
+    membudget_release(stream->body_cap);
+    free(stream);
+}
+
+static int append(char **buf, size_t *len, size_t *cap, const char *data, size_t n, size_t limit) {
+    if (*len + n + 1 > limit) return -1;
+    if (*len + n + 1 > *cap) {
+        size_t new_cap = *cap ? *cap : 256;
+        while (new_cap < *len + n + 1) new_cap *= 2;
+        if (new_cap > limit) new_cap = limit;
+        char *p = realloc(*buf, new_cap);
+        if (!p) return -1;
+        *buf = p;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+    return 0;
+}
+
+// Appends DATA to a stream's body, charging the buffer's growth to the
+// memory budget. Returns -1 if the body is too large, -2 if the budget is
+// exhausted (the connection thread cannot wait for it).
+static int h2_body_append(h2_stream_t *s, const char *data, size_t n) {
+    size_t need = s->body_len + n + 1, new_cap = s->body_cap;
+    if (need > H2_MAX_BODY) return -1;
+    if (need > new_cap) {
+        if (!new_cap) new_cap = 256;
+        while (new_cap < need) new_cap *= 2;
+        if (new_cap > H2_MAX_BODY) new_cap = H2_MAX_BODY;
+    }
+    size_t growth = new_cap - s->body_cap;
+    if (growth && membudget_acquire(growth, 0) < 0) return -2;
+    if (append(&s->body, &s->body_len, &s->body_cap, data, n, H2_MAX_BODY) < 0) {
+        membudget_release(growth);
+        return -1;
+    }
+    return 0;
+}
+
+// RFC 9218 priority field, e.g. "u=1, i"
+static void parse_priority(h2_stream_t *s, const char *value) {
+    const char *u = strstr(value, "u=");
+    if (u && u[2] >= '0' && u[2] <= '7') s->urgency = u[2] - '0';
+    s->incremental = strstr(value, "i") != NULL && strstr(value, "i=?0") == NULL;
+    s->has_priority = 1;
+}
+
+// RFC 7540 weights map onto urgencies; heavier streams are more urgent
+static void apply_weight(h2_stream_t *s, int weight) {
+    if (s->has_priority) return;
+    s->urgency = (256 - weight) / 37;
+    s->incremental = 1;
+}
+
+typedef struct {
+    h2_stream_t *stream;  // NULL when the block is decoded only for HPACK state
+} header_ctx_t;
+
+// Fields are copied into HTTP/1-style lines (and may be proxied as such):
+// CR, LF or NUL would end a line early, upper case is not valid in h2
+static int field_is_valid(const char *name, size_t name_len, const char *value, size_t value_len) {
+    if (strlen(name) != name_len || strlen(value) != value_len) return 0;
+    if (strpbrk(name, "\r\n") || strpbrk(value, "\r\n")) return 0;
+    for (size_t i = 0; i < name_len; i++) {
+        if (isupper((unsigned char) name[i])) return 0;
+    }
+    return 1;
+}
+
+static int h2_on_header(void *arg, const char *name, size_t name_len, const char *value, size_t value_len) {
+    header_ctx_t *ctx = arg;
+    h2_stream_t *s = ctx->stream;
+    if (!s || s->malformed) return 0;
+    if (!field_is_valid(name, name_len, value, value_len)) {
+        s->malformed = 1;
+        return 0;
+    }
+    if (s->headers_overflow) return 0;
+
+    if (name[0] == ':') {
+        if (strcmp(name, ":method") == 0) {
+            if (value_len == 0 || strpbrk(value, " \t")) s->malformed = 1;
+            snprintf(s->method, sizeof(s->method), "%s", value);
+        } else if (strcmp(name, ":path") == 0 && !s->path) {
+            if (value[0] != '/' || strpbrk(value, " \t")) s->malformed = 1;
+            s->path = strdup(value);
+        } else if (strcmp(name, ":authority") == 0) {
+            name = "host";
+            name_len = 4;
+        } else {
+            return 0;
+        }
+        if (name[0] == ':') return 0;
+    }
+    if (strcmp(name, "priority") == 0) parse_priority(s, value);
+
+    // Header names arrive in lower case; the HTTP/1 handlers look up the
+    // canonical spelling ("Content-Type"), so capitalise each word
+    char line[MAXBUF];
+    if (name_len + value_len + 5 > sizeof(line)) {
+        s->headers_overflow = 1;
+        return 0;
+    }
+    for (size_t i = 0; i < name_len; i++) {
+        line[i] = (i == 0 || name[i - 1] == '-') ? toupper((unsigned char) name[i]) : name[i];
+    }
+    int n = name_len;
+    n += sprintf(line + n, ": %s\r\n", value);
+    if (append(&s->headers, &s->headers_len, &s->headers_cap, line, n, H2_MAX_HEADER_BLOCK) < 0) {
+        s->headers_overflow = 1;
+    }
+    return 0;
+}
+
+//
+// Responses
+//
+
+// A stream's handler runs on a thread of its own so that a slow one (CGI,
+// a proxied upstream, a thumbnail) does not stall the other streams, PING
+// and flow control. The job owns a copy of the request; the connection
+// thread picks the captured response up from the completion list.
+typedef struct h2_job {
+    struct h2_job *next;    // in the completion list
+    h2_conn_t *conn;
+    uint32_t stream_id;
+    int status_override;
+    int rate_checked;
+    size_t body_cap;        // of the memory budget, released by the worker
+    int mfd;                // captured response, -1 on failure
+    http_request_t req;
+} h2_job_t;
+
+// Produces the response into a memfd (worker thread)
+static void h2_job_run(h2_job_t *job) {
+    http_request_t *req = &job->req;
+    int mfd = memfd_create("h2-response", MFD_CLOEXEC);
+    if (mfd >= 0) {
+        if (job->status_override == 413) {
+            request_error(mfd, req->uri, "413", "Payload Too Large", "Request body is too large");
+        } else if (job->status_override == 503) {
+            request_error_retry(mfd, req->uri, "503", "Service Unavailable", "Server is out of memory for request bodies", 1);
+        } else if (job->status_override == 431) {
+            request_error(mfd, req->uri, "431", "Request Header Fields Too Large", "Request headers are too large");
+        } else {
+            printf("method:%s uri:%s version:%s stream:%u\n", req->method, req->uri, req->version, job->stream_id);
+            trace_begin();
+            trace_request(req->method, req->uri);
+            int retry_after;
+            if (ratelimit_enabled() && !job->rate_checked &&
+                !ratelimit_request(req->client_ip, req->uri, &retry_after)) {
+                request_error_retry(mfd, req->uri, "429", "Too Many Requests", "Request rate limit exceeded", retry_after);
+            } else {
+                request_dispatch(mfd, req);
+            }
+            trace_end();
+        }
+    }
+    job->mfd = mfd;
+
+    // The request body is done with; the response is held in memory until
+    // the peer has read it, so it counts against the budget like bodies do
+    free(req->headers);
+    req->headers = NULL;
+    free(req->body);
+    req->body = NULL;
+    membudget_release(job->body_cap);
+}
+
+static void h2_job_post(h2_job_t *job) {
+    h2_conn_t *conn = job->conn;
+    uint64_t one = 1;
+    pthread_mutex_lock(&conn->done_lock);
+    job->next = conn->done;
+    conn->done = job;
+    pthread_mutex_unlock(&conn->done_lock);
+    // Fails only if the counter is saturated, and then the loop wakes anyway
+    ssize_t rc = write(conn->wake_fd, &one, sizeof(one));
+    (void) rc;
+}
+
+static void *h2_worker(void *arg) {
+    h2_job_run(arg);
+    h2_job_post(arg);
+    return NULL;
+}
+
+// Hands the stream's request to a worker; h2_stream_finish() sends the
+// response once it is ready
+static void h2_stream_respond(h2_conn_t *conn, h2_stream_t *s, int status_override) {
+    s->responded = 1;
+
+    h2_job_t *job = calloc(1, sizeof(h2_job_t));
+    if (!job) {
+        h2_send_rst(conn, s->id, H2_INTERNAL_ERROR);
+        h2_free_stream(conn, s);
+        return;
+    }
+    job->conn = conn;
+    job->stream_id = s->id;
+    job->status_override = status_override;
+    job->rate_checked = s->rate_checked;
+    job->mfd = -1;
+    http_request_t *req = &job->req;
+    snprintf(req->method, sizeof(req->method), "%s", s->method);
+    snprintf(req->uri, sizeof(req->uri), "%s", s->path ? s->path : "/");
+    strcpy(req->version, "HTTP/2.0");
+    req->headers = s->headers ? s->headers : strdup("");
+    req->body = s->body;
+    req->body_len = s->body_len;
+    req->body_fd = -1;
+    req->client_ip = conn->client_ip;
+    job->body_cap = s->body_cap;
+    s->headers = NULL;
+    s->headers_len = s->headers_cap = 0;
+    s->body = NULL;
+    s->body_len = s->body_cap = 0;
+    if (!req->headers) {
+        membudget_release(job->body_cap);
+        free(req->body);
+        free(job);
+        h2_send_rst(conn, s->id, H2_INTERNAL_ERROR);
+        h2_free_stream(conn, s);
+        return;
+    }
+
+    conn->inflight++;
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, H2_WORKER_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, h2_worker, job) != 0) {
+        // Out of threads: answer on the connection thread as before
+        h2_worker(job);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Converts the HTTP/1 response head captured in mfd into a HEADERS frame
+// and queues the body for h2_send_next_data()
+static void h2_stream_finish(h2_conn_t *conn, h2_stream_t *s, int mfd) {
+    off_t size = lseek(mfd, 0, SEEK_END);
+    if (size > 0 && membudget_acquire(size, 0) < 0) {
+        // The client may retry a refused stream
+        close(mfd);
+        h2_send_rst(conn, s->id, H2_REFUSED_STREAM);
+        h2_free_stream(conn, s);
+        return;
+    }
+    if (size > 0) {
+        s->resp_reserved = size;
+        s->resp = mmap(NULL, size, PROT_READ, MAP_PRIVATE, mfd, 0);
+        if (s->resp == MAP_FAILED) s->resp = NULL;
+        else s->resp_size = size;
+    }
+    close(mfd);
+
+    // The mapping is not NUL-terminated: every scan stops at the head's end
+    char *head_end = s->resp ? memmem(s->resp, s->resp_size, "\r\n\r\n", 4) : NULL;
+    char *status = head_end ? memchr(s->resp, ' ', head_end - s->resp) : NULL;
+    if (!status || head_end - s->resp < 5 || memcmp(s->resp, "HTTP/", 5) != 0) {
+        h2_send_rst(conn, s->id, H2_INTERNAL_ERROR);
+        h2_free_stream(conn, s);
+        return;
+    }
+    s->data_off = head_end + 4 - s->resp;
+
+    unsigned char block[H2_MAX_FRAME];
+    size_t len = 0;
+    int n = hpack_encode_status(block, sizeof(block), atoi(status + 1));
+    if (n < 0) goto too_large;
+    len += n;
+
+    int has_length = 0;
+    char *line = (char *) memmem(s->resp, head_end + 2 - s->resp, "\r\n", 2) + 2;
+    while (line < head_end) {
+        char *eol = memmem(line, head_end + 2 - line, "\r\n", 2);
+        char *colon = memchr(line, ':', eol - line);
+        if (colon) {
+            char name[256];
+            size_t name_len = colon - line;
+            if (name_len >= sizeof(name)) name_len = sizeof(name) - 1;
+            for (size_t i = 0; i < name_len; i++) name[i] = tolower((unsigned char) line[i]);
+            name[name_len] = '\0';
+            char *value = colon + 1;
+            while (value < eol && (*value == ' ' || *value == '\t')) value++;
+
+            // Connection-specific fields are not allowed in HTTP/2
+            if (strcmp(name, "connection") && strcmp(name, "keep-alive") &&
+                strcmp(name, "transfer-encoding") && strcmp(name, "upgrade")) {
+                if (strcmp(name, "content-length") == 0) has_length = 1;
+                if (strcmp(name, "content-type") == 0 && !s->has_priority) {
+                    // Without a client signal, render-blocking resources go first
+                    if (!strncasecmp(value, "text/html", 9) || !strncasecmp(value, "text/css", 8) ||
+                        !strncasecmp(value, "application/javascript", 22)) s->urgency = 2;
+                    else if (!strncasecmp(value, "image/", 6)) s->urgency = 4;
+                }
+                n = hpack_encode_header(block + len, sizeof(block) - len, name, value, eol - value);
+                if (n < 0) goto too_large;
+                len += n;
+            }
+        }
+        line = eol + 2;
+    }
+    if (!has_length) {
+        char value[32];
+        int value_len = snprintf(value, sizeof(value), "%zu", s->resp_size - s->data_off);
+        n = hpack_encode_header(block + len, sizeof(block) - len, "content-length", value, value_len);
+        if (n < 0) goto too_large;
+        len += n;
+    }
+
+    int flags = H2_FLAG_END_HEADERS;
+    if (s->data_off == s->resp_size) flags |= H2_FLAG_END_STREAM;
+    h2_send_frame(conn, H2_HEADERS, flags, s->id, block, len);
+    if (flags & H2_FLAG_END_STREAM) {
+        if (!s->remote_closed) h2_send_rst(conn, s->id, H2_NO_ERROR);
+        h2_free_stream(conn, s);
+    }
+    return;
+
+too_large:
+    h2_send_rst(conn, s->id, H2_INTERNAL_ERROR);
+    h2_free_stream(conn, s);
+}
+
+// Sends the responses workers have finished. A stream the peer reset in
+// the meantime is gone; its response is dropped.
+static void h2_collect(h2_conn_t *conn) {
+    uint64_t count;
+    ssize_t rc = read(conn->wake_fd, &count, sizeof(count));
+    (void) rc;
+    pthread_mutex_lock(&conn->done_lock);
+    h2_job_t *job = conn->done;
+    conn->done = NULL;
+    pthread_mutex_unlock(&conn->done_lock);
+
+    while (job) {
+        h2_job_t *next = job->next;
+        conn->inflight--;
+        h2_stream_t *s = conn->dead ? NULL : h2_find_stream(conn, job->stream_id);
+        if (s && job->mfd >= 0) {
+            h2_stream_finish(conn, s, job->mfd);
+        } else {
+            if (job->mfd >= 0) close(job->mfd);
+            if (s) {
+                h2_send_rst(conn, s->id, H2_INTERNAL_ERROR);
+                h2_free_stream(conn, s);
+            }
+        }
+        free(job);
+        job = next;
+    }
+}
+
+static int h2_sendable(h2_conn_t *conn, h2_stream_t *s) {
+    return s->resp && s->data_off < s->resp_size && s->send_window > 0 && conn->send_window > 0;
+}
+
+// Picks the stream to send the next DATA frame for: most urgent first;
+// within one urgency, sequential streams in id order, then incremental
+// streams round-robin
+static h2_stream_t *h2_schedule(h2_conn_t *conn) {
+    h2_stream_t *best = NULL;
+    for (h2_stream_t *s = conn->streams; s; s = s->next) {
+        if (!h2_sendable(conn, s)) continue;
+        if (!best || s->urgency < best->urgency) {
+            best = s;
+        } else if (s->urgency == best->urgency) {
+            if (s->incremental != best->incremental) {
+                if (!s->incremental) best = s;
+            } else if (!s->incremental) {
+                if (s->id < best->id) best = s;
+            } else if (s->id - conn->rr_last - 1 < best->id - conn->rr_last - 1) {
+                best = s;
+            }
+        }
+    }
+    return best;
+}
+
+static void h2_send_next_data(h2_conn_t *conn) {
+    h2_stream_t *s = h2_schedule(conn);
+    if (!s) return;
+
+    size_t n = s->resp_size - s->data_off;
+    if (n > conn->peer_max_frame) n = conn->peer_max_frame;
+    if ((int64_t) n > s->send_window) n = s->send_window;
+    if ((int64_t) n > conn->send_window) n = conn->send_window;
+
+    int last = s->data_off + n == s->resp_size;
+    if (h2_send_frame(conn, H2_DATA, last ? H2_FLAG_END_STREAM : 0, s->id, s->resp + s->data_off, n) < 0) return;
+    s->data_off += n;
+    s->send_window -= n;
+    conn->send_window -= n;
+    conn->rr_last = s->id;
+
+    if (last) {
+        if (!s->remote_closed) h2_send_rst(conn, s->id, H2_NO_ERROR);
+        h2_free_stream(conn, s);
+    }
+}
+
+//
+// Frame input
+//
+
+static int h2_on_header_block(h2_conn_t *conn) {
+    h2_stream_t *s = h2_find_stream(conn, conn->block_stream);
+    header_ctx_t ctx = { NULL };
+    int new_stream = 0;
+
+    if (!s && conn->block_stream > conn->last_stream_id) {
+        if (!(conn->block_stream & 1)) return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+        conn->last_stream_id = conn->block_stream;
+        if (!conn->closing) {
+            s = h2_new_stream(conn, conn->block_stream);
+            if (!s) return h2_conn_error(conn, H2_INTERNAL_ERROR);
+            new_stream = 1;
+            // Reset streams leave their handlers running: count those too
+            if (conn->num_streams > H2_MAX_STREAMS || conn->inflight >= H2_MAX_STREAMS) s->refused = 1;
+        }
+    }
+    // Trailers and headers for closed streams still update the HPACK state
+    if (s && new_stream) ctx.stream = s;
+
+    int rc = hpack_decode(&conn->decoder, conn->block, conn->block_len, h2_on_header, &ctx);
+    conn->block_open = 0;
+    conn->block_len = 0;
+    if (rc < 0) return h2_conn_error(conn, H2_COMPRESSION_ERROR);
+    if (!s) return 0;
+
+    if (s->refused) {
+        h2_send_rst(conn, s->id, H2_REFUSED_STREAM);
+        h2_free_stream(conn, s);
+        return 0;
+    }
+    if (new_stream && (s->malformed || !s->method[0] || !s->path)) {
+        h2_send_rst(conn, s->id, H2_PROTOCOL_ERROR);
+        h2_free_stream(conn, s);
+        return 0;
+    }
+    if (conn->block_end_stream) {
+        s->remote_closed = 1;
+        if (!s->responded) h2_stream_respond(conn, s, s->headers_overflow ? 431 : 0);
+    }
+    return 0;
+}
+
+static int h2_on_headers(h2_conn_t *conn, int flags, uint32_t stream_id, unsigned char *p, size_t len) {
+    if (stream_id == 0) return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+    size_t pad = 0;
+    if (flags & H2_FLAG_PADDED) {
+        if (len < 1) return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+        pad = p[0];
+        p++;
+        len--;
+    }
+    int weight = -1;
+    if (flags & H2_FLAG_PRIORITY) {
+        if (len < 5) return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+        weight = p[4] + 1;
+        p += 5;
+        len -= 5;
+    }
+    if (pad > len) return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+    len -= pad;
+
+    conn->block_len = 0;
+    conn->block_stream = stream_id;
+    conn->block_end_stream = flags & H2_FLAG_END_STREAM;
+    if (append((char **) &conn->block, &conn->block_len, &conn->block_cap, (char *) p, len, H2_MAX_HEADER_BLOCK) < 0) {
+        return h2_conn_error(conn, H2_INTERNAL_ERROR);
+    }
+    if (!(flags & H2_FLAG_END_HEADERS)) {
+        conn->block_open = 1;
+        return 0;
+    }
+
+    int rc = h2_on_header_block(conn);
+    h2_stream_t *s = h2_find_stream(conn, stream_id);
+    if (s && weight > 0) apply_weight(s, weight);
+    return rc;
+}
+
+static int h2_on_data(h2_conn_t *conn, int flags, uint32_t stream_id, unsigned char *p, size_t len) {
+    if (stream_id == 0) return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+    if (stream_id > conn->last_stream_id) return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+
+    // Flow control counts the whole payload, padding included. The peer
+    // may not send more than the windows we advertised.
+    if (conn->recv_unacked + len > H2_WINDOW) return h2_conn_error(conn, H2_FLOW_CONTROL_ERROR);
+    conn->recv_unacked += len;
+    if (conn->recv_unacked >= H2_WINDOW / 2) {
+        h2_send_window_update(conn, 0, conn->recv_unacked);
+        conn->recv_unacked = 0;
+    }
+
+    h2_stream_t *s = h2_find_stream(conn, stream_id);
+    if (!s) return 0; // stream already closed or reset: discard
+    if (s->remote_closed) {
+        h2_send_rst(conn, s->id, H2_STREAM_CLOSED);
+        h2_free_stream(conn, s);
+        return 0;
+    }
+    if (s->recv_unacked + len > H2_WINDOW) {
+        h2_send_rst(conn, s->id, H2_FLOW_CONTROL_ERROR);
+        h2_free_stream(conn, s);
+        return 0;
+    }
+
+    size_t pad = 0;
+    if (flags & H2_FLAG_PADDED) {
+        if (len < 1) return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+        pad = p[0];
+        if (pad >= len) return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+    }
+    size_t data_len = len - pad - (flags & H2_FLAG_PADDED ? 1 : 0);
+    char *data = (char *) p + (flags & H2_FLAG_PADDED ? 1 : 0);
+
+    int rc = s->responded ? 0 : h2_body_append(s, data, data_len);
+    if (rc < 0) {
+        // Too large or no memory for it: answer right away, further DATA is discarded
+        h2_stream_respond(conn, s, rc == -2 ? 503 : 413);
+        s = h2_find_stream(conn, stream_id);
+        if (!s) return 0;
+    }
+
+    if (flags & H2_FLAG_END_STREAM) {
+        s->remote_closed = 1;
+        if (!s->responded) h2_stream_respond(conn, s, 0);
+    } else {
+        s->recv_unacked += len;
+        if (s->recv_unacked >= H2_WINDOW / 2) {
+            h2_send_window_update(conn, s->id, s->recv_unacked);
+            s->recv_unacked = 0;
+        }
+    }
+    return 0;
+}
+
+static int h2_apply_settings(h2_conn_t *conn, const unsigned char *p, size_t len) {
+    if (len % 6) return h2_conn_error(conn, H2_FRAME_SIZE_ERROR);
+    for (size_t i = 0; i < len; i += 6) {
+        int id = (p[i] << 8) | p[i + 1];
+        uint32_t value = get_u32(p + i + 2);
+        if (id == H2_SETTINGS_INITIAL_WINDOW_SIZE) {
+            if (value > H2_MAX_WINDOW) return h2_conn_error(conn, H2_FLOW_CONTROL_ERROR);
+            int64_t delta = (int64_t) value - conn->peer_initial_window;
+            for (h2_stream_t *s = conn->streams; s; s = s->next) s->send_window += delta;
+            conn->peer_initial_window = value;
+        } else if (id == H2_SETTINGS_MAX_FRAME_SIZE) {
+            if (value < 16384 || value > 16777215) return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+            // Our frame buffers are sized for the default
+            conn->peer_max_frame = value < H2_MAX_FRAME ? value : H2_MAX_FRAME;
+        }
+    }
+    return 0;
+}
+
+static int h2_read_frame(h2_conn_t *conn) {
+    unsigned char header[H2_FRAME_HEADER_LEN];
+    if (read_full(conn->fd, header, sizeof(header)) < 0) return -1;
+
+    size_t len = ((size_t) header[0] << 16) | (header[1] << 8) | header[2];
+    int type = header[3];
+    int flags = header[4];
+    uint32_t stream_id = get_u32(header + 5) & 0x7fffffff;
+    if (len > H2_MAX_FRAME) return h2_conn_error(conn, H2_FRAME_SIZE_ERROR);
+    if (read_full(conn->fd, conn->frame, len) < 0) return -1;
+    unsigned char *p = conn->frame;
+
+    // Nothing may interleave with an unfinished header block
+    if (conn->block_open && (type != H2_CONTINUATION || stream_id != conn->block_stream)) {
+        return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+    }
+
+    switch (type) {
+    case H2_DATA:
+        return h2_on_data(conn, flags, stream_id, p, len);
+    case H2_HEADERS:
+        return h2_on_headers(conn, flags, stream_id, p, len);
+    case H2_CONTINUATION:
+        if (!conn->block_open) return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+        if (append((char **) &conn->block, &conn->block_len, &conn->block_cap, (char *) p, len, H2_MAX_HEADER_BLOCK) < 0) {
+            return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+        }
+        return (flags & H2_FLAG_END_HEADERS) ? h2_on_header_block(conn) : 0;
+    case H2_PRIORITY: {
+        if (len != 5 || stream_id == 0) return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+        h2_stream_t *s = h2_find_stream(conn, stream_id);
+        if (s) apply_weight(s, p[4] + 1);
+        return 0;
+    }
+    case H2_RST_STREAM: {
+        if (len != 4 || stream_id == 0) return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+        h2_stream_t *s = h2_find_stream(conn, stream_id);
+        if (s) h2_free_stream(conn, s);
+        return 0;
+    }
+    case H2_SETTINGS:
+        if (stream_id != 0) return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+        if (flags & H2_FLAG_ACK) return 0;
+        if (h2_apply_settings(conn, p, len) < 0) return -1;
+        return h2_send_frame(conn, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+    case H2_PING:
+        if (len != 8 || stream_id != 0) return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+        if (flags & H2_FLAG_ACK) return 0;
+        return h2_send_frame(conn, H2_PING, H2_FLAG_ACK, 0, p, 8);
+    case H2_GOAWAY:
+        conn->closing = 1;
+        return 0;
+    case H2_WINDOW_UPDATE: {
+        if (len != 4) return h2_conn_error(conn, H2_FRAME_SIZE_ERROR);
+        uint32_t increment = get_u32(p) & 0x7fffffff;
+        if (stream_id == 0) {
+            if (increment == 0) return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+            conn->send_window += increment;
+            if (conn->send_window > H2_MAX_WINDOW) return h2_conn_error(conn, H2_FLOW_CONTROL_ERROR);
+            return 0;
+        }
+        h2_stream_t *s = h2_find_stream(conn, stream_id);
+        if (!s) return 0;
+        if (increment == 0 || s->send_window + increment > H2_MAX_WINDOW) {
+            h2_send_rst(conn, s->id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+            h2_free_stream(conn, s);
+            return 0;
+        }
+        s->send_window += increment;
+        return 0;
+    }
+    case H2_PUSH_PROMISE:
+        // Clients never push
+        return h2_conn_error(conn, H2_PROTOCOL_ERROR);
+    default:
+        // Unknown frame types must be ignored
+        return 0;
+    }
+}
+
+//
+// Connection
+//
+
+// HTTP2-Settings carries a SETTINGS payload in base64url
+static int base64url_decode(const char *in, unsigned char *out, size_t out_size) {
+    size_t n = 0;
+    unsigned int acc = 0;
+    int bits = 0;
+    for (; *in && *in != '='; in++) {
+        int v;
+        if (*in >= 'A' && *in <= 'Z') v = *in - 'A';
+        else if (*in >= 'a' && *in <= 'z') v = *in - 'a' + 26;
+        else if (*in >= '0' && *in <= '9') v = *in - '0' + 52;
+        else if (*in == '-' || *in == '+') v = 62;
+        else if (*in == '_' || *in == '/') v = 63;
+        else return -1;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n >= out_size) return -1;
+            out[n++] = acc >> bits;
+        }
+    }
+    return n;
+}
+
+static int h2_upgrade(h2_conn_t *conn, http_request_t *req) {
+    char settings[MAXBUF];
+    unsigned char payload[MAXBUF];
+    const char *switching =
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\n"
+        "Upgrade: h2c\r\n\r\n";
+    if (send(conn->fd, switching, strlen(switching), MSG_NOSIGNAL) < 0) return -1;
+
+    h2_send_settings(conn);
+    if (request_find_header(req->headers, "HTTP2-Settings", settings, sizeof(settings))) {
+        int len = base64url_decode(settings, payload, sizeof(payload));
+        if (len < 0 || h2_apply_settings(conn, payload, len) < 0) return -1;
+    }
+
+    char preface[sizeof(H2_PREFACE) - 1];
+    if (read_full(conn->fd, preface, sizeof(preface)) < 0 || memcmp(preface, H2_PREFACE, sizeof(preface))) return -1;
+
+    // The upgrading request becomes stream 1, already half-closed
+    h2_stream_t *s = h2_new_stream(conn, 1);
+    if (!s) return -1;
+    conn->last_stream_id = 1;
+    s->remote_closed = 1;
+    s->rate_checked = 1; // request_handle() counted it as HTTP/1.1
+    snprintf(s->method, sizeof(s->method), "%.31s", req->method);
+    s->path = strdup(req->uri);
+    s->headers = strdup(req->headers);
+    if (req->body_len > 0) {
+        if (membudget_acquire(req->body_len + 1, 0) < 0) {
+            h2_stream_respond(conn, s, 503);
+            return 0;
+        }
+        s->body = malloc(req->body_len + 1);
+        if (s->body) {
+            memcpy(s->body, req->body, req->body_len);
+            s->body[req->body_len] = '\0';
+            s->body_len = req->body_len;
+            s->body_cap = req->body_len + 1;
+        } else {
+            membudget_release(req->body_len + 1);
+        }
+    }
+    h2_stream_respond(conn, s, 0);
+    return 0;
+}
+
+void http2_serve(int fd, uint32_t client_ip, http_request_t *upgraded) {
+    h2_conn_t *conn = calloc(1, sizeof(h2_conn_t));
+    if (!conn) return;
+    conn->fd = fd;
+    conn->client_ip = client_ip;
+    conn->send_window = H2_DEFAULT_WINDOW;
+    conn->peer_initial_window = H2_DEFAULT_WINDOW;
+    conn->peer_max_frame = H2_MAX_FRAME;
+    hpack_decoder_init(&conn->decoder, HPACK_DEFAULT_TABLE_SIZE);
+    pthread_mutex_init(&conn->done_lock, NULL);
+    conn->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if (conn->wake_fd < 0) {
+        conn->dead = 1;
+    } else if (upgraded) {
+        if (h2_upgrade(conn, upgraded) < 0) conn->dead = 1;
+    } else {
+        // request_handle() consumed "PRI * HTTP/2.0\r\n\r\n" as a request
+        char tail[sizeof(H2_PREFACE_TAIL) - 1];
+        if (read_full(fd, tail, sizeof(tail)) < 0 || memcmp(tail, H2_PREFACE_TAIL, sizeof(tail))) {
+            conn->dead = 1;
+        } else {
+            h2_send_settings(conn);
+        }
+    }
+
+    // Alternate between reading one frame and sending one DATA frame so
+    // that a large upload never starves responses and vice versa; responses
+    // finished by workers are picked up in between
+    while (!conn->dead) {
+        int pending = h2_schedule(conn) != NULL;
+        if (conn->closing && !pending && !conn->inflight) break;
+
+        struct pollfd pfd[2] = {
+            { conn->wake_fd, POLLIN, 0 },
+            { fd, conn->closing ? 0 : POLLIN, 0 },
+        };
+        int rc = poll(pfd, conn->closing ? 1 : 2, pending ? 0 : H2_IDLE_TIMEOUT_MS);
+        if (rc < 0 && errno != EINTR) break;
+        if (rc == 0 && !pending && !conn->inflight) {
+            h2_send_goaway(conn, H2_NO_ERROR);
+            break;
+        }
+        if (rc > 0 && pfd[0].revents) h2_collect(conn);
+        if (rc > 0 && !conn->closing && pfd[1].revents && h2_read_frame(conn) < 0) break;
+        if (!conn->dead) h2_send_next_data(conn);
+    }
+
+    // Workers post to conn: wait for the ones still running
+    conn->dead = 1;
+    while (conn->inflight > 0) {
+        struct pollfd pfd = { conn->wake_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, -1) > 0) h2_collect(conn);
+    }
+    if (conn->wake_fd >= 0) close(conn->wake_fd);
+    pthread_mutex_destroy(&conn->done_lock);
+    while (conn->streams) h2_free_stream(conn, conn->streams);
+    hpack_decoder_free(&conn->decoder);
+    free(conn->block);
+    free(conn);
+}
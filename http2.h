@@ -0,0 +1,22 @@
+#ifndef __HTTP2_H__
+#define __HTTP2_H__
+#include "request.h"
+
+// HTTP/2 over cleartext TCP (h2c), either with prior knowledge or through
+// "Upgrade: h2c". Each stream is turned into an http_request_t and handed
+// to request_dispatch() on a thread of its own, so a slow handler holds up
+// only its stream; responses are interleaved on the connection by urgency
+// while respecting flow control.
+
+// Returns 1 if req is the first line of the HTTP/2 connection preface
+int http2_is_preface(http_request_t *req);
+
+// Returns 1 if req asks to upgrade the connection to h2c
+int http2_is_upgrade(http_request_t *req);
+
+// Runs an HTTP/2 connection on fd until the peer closes it. If upgraded
+// is not NULL it is the HTTP/1.1 request that asked for the upgrade and
+// is answered as stream 1.
+void http2_serve(int fd, uint32_t client_ip, http_request_t *upgraded);
+
+#endif // __HTTP2_H__
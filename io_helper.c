@@ -50,7 +50,7 @@ int open_client_fd(char *hostname, int port) {
 int open_listen_fd(int port) {
     // Create a socket descriptor 
     int listen_fd;
-    if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
         fprintf(stderr, "socket() failed\n");
         return -1;
     }
@@ -0,0 +1,314 @@
+#include "io_helper.h"
+#include "request.h"
+#include "mime.h"
+#include "router.h"
+#include "thumbnail.h"
+#include "upload_store.h"
+#include "manifest.h"
+#include <dirent.h>
+#include <time.h>
+
+#define UPLOAD_DIR "uploads"
+// Address space reserved for the mapping: pages past the end of the file
+// become readable as records are appended, without remapping
+#define MANIFEST_MAP_SIZE ((size_t) 1 << 30)
+
+_Static_assert(sizeof(manifest_record_t) == 256, "manifest records are 256 bytes");
+
+static int manifest_fd = -1;
+static const manifest_record_t *records = NULL;
+
+uint64_t manifest_count(void) {
+    struct stat st;
+    if (manifest_fd < 0 || fstat(manifest_fd, &st) < 0) return 0;
+    // Another process (e.g. during a restart) may append too, so the file
+    // size is the authority. Records never straddle a page, so whatever
+    // the size covers has been written in full.
+    uint64_t count = st.st_size / sizeof(manifest_record_t);
+    uint64_t max = MANIFEST_MAP_SIZE / sizeof(manifest_record_t);
+    return count < max ? count : max;
+}
+
+static int record_append(const char *blob_name, const char *filename, uint64_t size,
+                         const char *mime, time_t when) {
+    manifest_record_t rec;
+    const char *dot = strchr(blob_name, '.');
+    if (manifest_fd < 0 || !dot || dot - blob_name != sizeof(rec.sha256)) return -1;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = MANIFEST_MAGIC;
+    rec.time = when;
+    rec.size = size;
+    memcpy(rec.sha256, blob_name, sizeof(rec.sha256));
+    snprintf(rec.ext, sizeof(rec.ext), "%s", dot + 1);
+    snprintf(rec.mime, sizeof(rec.mime), "%s", mime && mime[0] ? mime : "application/octet-stream");
+    snprintf(rec.filename, sizeof(rec.filename), "%s", filename ? filename : blob_name);
+
+    ssize_t n;
+    do {
+        n = write(manifest_fd, &rec, sizeof(rec));
+    } while (n < 0 && errno == EINTR);
+    return n == (ssize_t) sizeof(rec) ? 0 : -1;
+}
+
+int manifest_append(const char *blob_name, const char *filename, uint64_t size, const char *mime) {
+    return record_append(blob_name, filename, size, mime, time(NULL));
+}
+
+static void write_json_string(FILE *f, const char *s, size_t max) {
+    fputc('"', f);
+    for (size_t i = 0; i < max && s[i]; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void write_html_string(FILE *f, const char *s, size_t max) {
+    for (size_t i = 0; i < max && s[i]; i++) {
+        switch (s[i]) {
+        case '<': fputs("&lt;", f); break;
+        case '>': fputs("&gt;", f); break;
+        case '&': fputs("&amp;", f); break;
+        case '"': fputs("&quot;", f); break;
+        case '\'': fputs("&#39;", f); break;
+        default: fputc(s[i], f);
+        }
+    }
+}
+
+static int is_image(const manifest_record_t *rec) {
+    size_t n = sizeof(rec->ext);
+    return strncmp(rec->ext, "jpg", n) == 0 || strncmp(rec->ext, "png", n) == 0 || strncmp(rec->ext, "gif", n) == 0;
+}
+
+static void write_record_json(FILE *f, uint64_t id, const manifest_record_t *rec, const char *blob) {
+    char thumb[MAXBUF];
+    fprintf(f, "{\"id\":%lu,\"name\":", (unsigned long) id);
+    write_json_string(f, rec->filename, sizeof(rec->filename));
+    fprintf(f, ",\"size\":%lu,\"type\":", (unsigned long) rec->size);
+    write_json_string(f, rec->mime, sizeof(rec->mime));
+    fprintf(f, ",\"time\":%ld,\"sha256\":\"%.64s\",\"url\":\"/%s/%s\"",
+            (long) rec->time, rec->sha256, UPLOAD_DIR, blob);
+    if (is_image(rec)) {
+        thumbnail_uri(blob, thumb, sizeof(thumb));
+        fprintf(f, ",\"thumb\":\"%s\"", thumb);
+    }
+    fputc('}', f);
+}
+
+static void write_record_html(FILE *f, const manifest_record_t *rec, const char *blob) {
+    char thumb[MAXBUF], when[64];
+    struct tm tm;
+    time_t t = rec->time;
+    gmtime_r(&t, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M UTC", &tm);
+
+    fprintf(f, "<div class=\"item\">\n    <a href=\"/%s/%s\">", UPLOAD_DIR, blob);
+    if (is_image(rec)) {
+        thumbnail_uri(blob, thumb, sizeof(thumb));
+        fprintf(f, "<img src=\"%s\" alt=\"\" loading=\"lazy\">", thumb);
+    } else {
+        fprintf(f, "<span class=\"file\">.%.*s</span>", (int) sizeof(rec->ext), rec->ext);
+    }
+    fprintf(f, "</a>\n    <p>");
+    write_html_string(f, rec->filename, sizeof(rec->filename));
+    fprintf(f, "<br>%lu bytes, %s</p>\n</div>\n", (unsigned long) rec->size, when);
+}
+
+void manifest_write_page(FILE *f, uint64_t cursor, int limit, int json) {
+    uint64_t count = manifest_count();
+    uint64_t id = cursor < count ? cursor : count;
+    char blob[sizeof(records->sha256) + sizeof(records->ext) + 2];
+    int n = 0;
+
+    if (json) {
+        fprintf(f, "{\"count\":%lu,\"items\":[", (unsigned long) count);
+    } else {
+        fprintf(f,
+            "<!DOCTYPE html>\n"
+            "<html>\n"
+            "<head>\n"
+            "    <title>Uploads</title>\n"
+            "    <style>\n"
+            "        body { font-family: Arial, sans-serif; margin: 0; padding: 20px; }\n"
+            "        h1 { color: #333; }\n"
+            "        .item { display: inline-block; vertical-align: top; width: 220px; margin: 10px; }\n"
+            "        .item img { max-width: 200px; max-height: 200px; border: 1px solid #ddd; padding: 5px; }\n"
+            "        .file { display: inline-block; width: 200px; padding: 80px 0; text-align: center; border: 1px solid #ddd; }\n"
+            "        .item p { word-wrap: break-word; color: #555; font-size: 13px; }\n"
+            "        a { color: #0066cc; text-decoration: none; }\n"
+            "        a:hover { text-decoration: underline; }\n"
+            "    </style>\n"
+            "</head>\n"
+            "<body>\n"
+            "    <h1>Uploads</h1>\n"
+            "    <p>%lu files &middot; <a href=\"/upload\">Upload more</a></p>\n",
+            (unsigned long) count);
+    }
+
+    // Newest first, straight from the mapping
+    while (id > 0 && n < limit) {
+        const manifest_record_t *rec = &records[--id];
+        if (rec->magic != MANIFEST_MAGIC) continue;
+        snprintf(blob, sizeof(blob), "%.64s.%.*s", rec->sha256, (int) sizeof(rec->ext), rec->ext);
+        if (json) {
+            if (n) fputc(',', f);
+            write_record_json(f, id, rec, blob);
+        } else {
+            write_record_html(f, rec, blob);
+        }
+        n++;
+    }
+
+    if (json) {
+        if (id > 0) fprintf(f, "],\"next_cursor\":%lu}\n", (unsigned long) id);
+        else fprintf(f, "],\"next_cursor\":null}\n");
+    } else {
+        if (n == 0) fprintf(f, "<p>Nothing has been uploaded yet.</p>\n");
+        if (id > 0) fprintf(f, "<p><a href=\"/uploads/?cursor=%lu&amp;limit=%d\">Older uploads</a></p>\n",
+                            (unsigned long) id, limit);
+        fprintf(f, "</body>\n</html>");
+    }
+}
+
+// Value of a query string parameter, or NULL
+static const char *query_param(const char *uri, const char *name, char *value, size_t size) {
+    const char *p = strchr(uri, '?');
+    size_t name_len = strlen(name);
+    while (p) {
+        p++;
+        if (strncmp(p, name, name_len) == 0 && p[name_len] == '=') {
+            size_t len = strcspn(p + name_len + 1, "&#");
+            if (len >= size) len = size - 1;
+            memcpy(value, p + name_len + 1, len);
+            value[len] = '\0';
+            return value;
+        }
+        p = strchr(p, '&');
+    }
+    return NULL;
+}
+
+// GET /uploads/
+static void route_gallery(int fd, http_request_t *req, route_match_t *match, void *ctx) {
+    char buf[MAXBUF], value[32];
+    char *page = NULL;
+    size_t len = 0;
+    (void) match; (void) ctx;
+
+    uint64_t cursor = UINT64_MAX;
+    int limit = MANIFEST_PAGE;
+    int json = query_param(req->uri, "format", value, sizeof(value)) && strcmp(value, "json") == 0;
+    if (query_param(req->uri, "cursor", value, sizeof(value))) cursor = strtoull(value, NULL, 10);
+    if (query_param(req->uri, "limit", value, sizeof(value))) limit = atoi(value);
+    if (limit <= 0) limit = MANIFEST_PAGE;
+    if (limit > MANIFEST_MAX_PAGE) limit = MANIFEST_MAX_PAGE;
+
+    FILE *f = open_memstream(&page, &len);
+    if (!f) {
+        request_error(fd, req->uri, "500", "Internal Server Error", "Out of memory");
+        return;
+    }
+    manifest_write_page(f, cursor, limit, json);
+    fclose(f);
+
+    // Pages further back only change if records are dropped, never by uploads
+    snprintf(buf, sizeof(buf), ""
+        "HTTP/1.0 200 OK\r\n"
+        "Server: Webserver C\r\n"
+        "Content-Type: %s\r\n"
+        "Cache-Control: %s\r\n"
+        "Content-Length: %zu\r\n\r\n",
+        json ? "application/json" : "text/html",
+        cursor == UINT64_MAX ? "no-cache" : "max-age=60", len);
+    write_or_die(fd, buf, strlen(buf));
+    write_or_die(fd, page, len);
+    free(page);
+}
+
+typedef struct {
+    char name[sizeof(((manifest_record_t *) 0)->sha256) + sizeof(((manifest_record_t *) 0)->ext) + 2];
+    time_t mtime;
+    off_t size;
+} backfill_t;
+
+static int compare_mtime(const void *a, const void *b) {
+    const backfill_t *x = a, *y = b;
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+// First start with a manifest: record the blobs already in uploads/, oldest first
+static void manifest_backfill(void) {
+    DIR *d = opendir(UPLOAD_DIR);
+    if (!d) return;
+
+    backfill_t *found = NULL;
+    size_t n = 0, cap = 0;
+    char path[MAXBUF];
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", UPLOAD_DIR, de->d_name);
+        if (strlen(de->d_name) >= sizeof(found->name) || !upload_store_is_blob(path)) continue;
+        if (fstatat(dirfd(d), de->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode)) continue;
+        if (n == cap) {
+            backfill_t *grown = realloc(found, (cap = cap ? cap * 2 : 64) * sizeof(backfill_t));
+            if (!grown) break;
+            found = grown;
+        }
+        strcpy(found[n].name, de->d_name); // length checked above
+        found[n].mtime = st.st_mtime;
+        found[n].size = st.st_size;
+        n++;
+    }
+    closedir(d);
+
+    qsort(found, n, sizeof(backfill_t), compare_mtime);
+    for (size_t i = 0; i < n; i++) {
+        char filetype[MAXBUF] = "application/octet-stream";
+        if (!strstr(found[i].name, ".bin")) mime_get_filetype(found[i].name, filetype);
+        record_append(found[i].name, found[i].name, found[i].size, filetype, found[i].mtime);
+    }
+    free(found);
+    if (n) fprintf(stderr, "manifest: recorded %zu existing uploads\n", n);
+}
+
+int manifest_init(void) {
+    create_upload_dir();
+
+    int created = 1;
+    manifest_fd = open(MANIFEST_FILE, O_RDWR | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (manifest_fd < 0 && errno == EEXIST) {
+        created = 0;
+        manifest_fd = open(MANIFEST_FILE, O_RDWR | O_APPEND | O_CLOEXEC);
+    }
+    if (manifest_fd < 0) {
+        fprintf(stderr, "manifest: cannot open %s: %s\n", MANIFEST_FILE, strerror(errno));
+        return -1;
+    }
+
+    // A write cut short by a crash leaves part of a record: drop it
+    struct stat st;
+    if (fstat(manifest_fd, &st) == 0 && st.st_size % sizeof(manifest_record_t) != 0) {
+        if (ftruncate(manifest_fd, st.st_size - st.st_size % sizeof(manifest_record_t)) < 0) {
+            fprintf(stderr, "manifest: cannot truncate %s: %s\n", MANIFEST_FILE, strerror(errno));
+        }
+    }
+
+    void *map = mmap(NULL, MANIFEST_MAP_SIZE, PROT_READ, MAP_SHARED, manifest_fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "manifest: cannot map %s: %s\n", MANIFEST_FILE, strerror(errno));
+        close(manifest_fd);
+        manifest_fd = -1;
+        return -1;
+    }
+    records = map;
+    if (created) manifest_backfill();
+
+    router_add("GET", "/uploads", ROUTE_EXACT, route_gallery, NULL);
+    router_add("GET", "/uploads/", ROUTE_EXACT, route_gallery, NULL);
+    return 0;
+}
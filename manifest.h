@@ -0,0 +1,46 @@
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+#include <stdint.h>
+#include <stdio.h>
+
+// Append-only record of stored uploads, uploads/.manifest. Every new blob
+// adds one fixed-size record with a single O_APPEND write, so records are
+// never torn or reordered, and a record's position in the file is its id.
+// Readers use a read-only mapping of the whole file: listing a page costs
+// the same however many uploads there are.
+//
+// GET /uploads/ shows the newest uploads as a gallery, ?format=json gives
+// the same page as JSON; ?cursor=<id> continues with the uploads older
+// than id and ?limit=<n> sets the page size.
+
+#define MANIFEST_FILE "uploads/.manifest"
+#define MANIFEST_MAGIC 0x31464d57 // "WMF1"
+#define MANIFEST_PAGE 24
+#define MANIFEST_MAX_PAGE 100
+
+typedef struct {
+    uint32_t magic;
+    uint32_t reserved;
+    int64_t time;                 // seconds since the epoch
+    uint64_t size;
+    char sha256[64];              // hex, also the blob's name
+    char ext[8];
+    char mime[48];
+    char filename[112];           // as sent by the client, truncated
+} manifest_record_t;
+
+// Opens (creating and filling from uploads/ the first time) and maps the
+// manifest, and registers the /uploads/ routes. Returns 0 or -1.
+int manifest_init(void);
+
+// Records a new blob ("<sha256>.<ext>") with its original name and type
+int manifest_append(const char *blob_name, const char *filename, uint64_t size, const char *mime);
+
+// Number of records; ids are 0 .. count-1, oldest first
+uint64_t manifest_count(void);
+
+// Writes the page of at most limit records older than cursor (all if
+// cursor is beyond the end) as JSON or as an HTML gallery
+void manifest_write_page(FILE *f, uint64_t cursor, int limit, int json);
+
+#endif // __MANIFEST_H__
@@ -0,0 +1,49 @@
+#include "membudget.h"
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+static size_t limit = MEMBUDGET_DEFAULT;
+static size_t in_use = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t freed = PTHREAD_COND_INITIALIZER;
+
+void membudget_init(size_t bytes) {
+    pthread_mutex_lock(&lock);
+    limit = bytes ? bytes : MEMBUDGET_DEFAULT;
+    pthread_mutex_unlock(&lock);
+}
+
+int membudget_acquire(size_t bytes, int wait_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wait_ms / 1000;
+    deadline.tv_nsec += (long) (wait_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (bytes > limit) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    while (in_use + bytes > limit) {
+        if (wait_ms <= 0 || pthread_cond_timedwait(&freed, &lock, &deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
+    }
+    in_use += bytes;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+void membudget_release(size_t bytes) {
+    if (bytes == 0) return;
+    pthread_mutex_lock(&lock);
+    in_use -= bytes;
+    pthread_cond_broadcast(&freed);
+    pthread_mutex_unlock(&lock);
+}
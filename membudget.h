@@ -0,0 +1,23 @@
+#ifndef __MEMBUDGET_H__
+#define __MEMBUDGET_H__
+#include <stddef.h>
+
+// Server-wide budget for memory held on behalf of requests: buffered
+// request bodies (HTTP/1.x and HTTP/2) and CGI output. Each holder
+// reserves bytes before allocating them and returns them when freed, so
+// the sum stays under the limit whatever mix of uploads arrives; a
+// reservation that does not fit waits for others to finish or fails.
+
+#define MEMBUDGET_DEFAULT (256 * 1024 * 1024)
+
+// Sets the limit in bytes (0: MEMBUDGET_DEFAULT)
+void membudget_init(size_t limit);
+
+// Reserves bytes, waiting up to wait_ms for room. Returns 0 on success,
+// -1 if the budget stayed exhausted (or bytes exceed the whole limit).
+int membudget_acquire(size_t bytes, int wait_ms);
+
+// Returns a reservation
+void membudget_release(size_t bytes);
+
+#endif // __MEMBUDGET_H__
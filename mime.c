@@ -0,0 +1,13 @@
+#include "mime.h"
+#include <string.h>
+
+void mime_get_filetype(const char *filename, char *filetype) {
+    if (strstr(filename, ".html")) strcpy(filetype, "text/html");
+    else if (strstr(filename, ".gif")) strcpy(filetype, "image/gif");
+    else if (strstr(filename, ".jpg")) strcpy(filetype, "image/jpeg");
+    else if (strstr(filename, ".jpeg")) strcpy(filetype, "image/jpeg");
+    else if (strstr(filename, ".png")) strcpy(filetype, "image/png");
+    else if (strstr(filename, ".css")) strcpy(filetype, "text/css");
+    else if (strstr(filename, ".js")) strcpy(filetype, "application/javascript");
+    else strcpy(filetype, "text/plain");
+}
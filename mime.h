@@ -0,0 +1,10 @@
+#ifndef __MIME_H__
+#define __MIME_H__
+
+// Content types by file extension. Kept apart from request.c so that the
+// offline tools (wbundle) can link it without the whole server.
+
+// Fills in filetype (at least 32 bytes) for filename
+void mime_get_filetype(const char *filename, char *filetype);
+
+#endif // __MIME_H__
@@ -0,0 +1,539 @@
+#include "io_helper.h"
+#include "request.h"
+#include "proxy.h"
+#include <poll.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
+
+#define PROXY_MAX_ROUTES 16
+#define PROXY_MAX_BACKENDS 16
+#define PROXY_MAX_PREFIX 128
+#define PROXY_MAX_IDLE 32               // pooled connections per backend
+#define PROXY_BUF (64 * 1024)           // relay buffer, also bounds the response head
+#define PROXY_CONNECT_TIMEOUT_MS 2000
+#define PROXY_IO_TIMEOUT 30             // seconds without progress on a backend
+#define PROXY_HEALTH_INTERVAL 2         // seconds between health checks
+
+typedef struct {
+    char name[64];                      // host:port as configured
+    struct sockaddr_in addr;
+    pthread_mutex_t lock;
+    int idle[PROXY_MAX_IDLE];           // keep-alive connections ready for reuse
+    int num_idle;
+    int active;                         // requests in flight
+    volatile int healthy;
+} proxy_backend_t;
+
+typedef struct {
+    char prefix[PROXY_MAX_PREFIX];
+    size_t len;
+    proxy_backend_t backends[PROXY_MAX_BACKENDS];
+    int num_backends;
+    int least_conn;
+    unsigned rr_next;
+} proxy_route_t;
+
+// Upstream connection with its read buffer
+typedef struct {
+    int fd;
+    char buf[PROXY_BUF];
+    size_t pos, len;
+} upstream_t;
+
+static proxy_route_t routes[PROXY_MAX_ROUTES];
+static int num_routes = 0;
+
+// Headers that describe one connection and are not forwarded (RFC 9110 7.6.1)
+static const char *hop_by_hop[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+    "Transfer-Encoding", "Upgrade", "HTTP2-Settings", NULL,
+};
+
+//
+// Configuration
+//
+
+static int parse_backend(const char *spec, size_t len, proxy_backend_t *b) {
+    char host[64];
+    const char *colon = memchr(spec, ':', len);
+    if (!colon || colon == spec || (size_t) (colon - spec) >= sizeof(host) || len >= sizeof(b->name)) return -1;
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+    int port = atoi(colon + 1);
+    if (port <= 0 || port > 65535) return -1;
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0) return -1;
+    memcpy(&b->addr, res->ai_addr, sizeof(b->addr));
+    b->addr.sin_port = htons(port);
+    freeaddrinfo(res);
+
+    memcpy(b->name, spec, len);
+    b->name[len] = '\0';
+    pthread_mutex_init(&b->lock, NULL);
+    b->num_idle = 0;
+    b->active = 0;
+    b->healthy = 1;
+    return 0;
+}
+
+int proxy_add_route(const char *spec) {
+    const char *eq = strchr(spec, '=');
+    if (!eq || spec[0] != '/' || eq - spec >= PROXY_MAX_PREFIX || num_routes == PROXY_MAX_ROUTES) return -1;
+
+    proxy_route_t *r = &routes[num_routes];
+    memset(r, 0, sizeof(*r));
+    r->len = eq - spec;
+    memcpy(r->prefix, spec, r->len);
+
+    const char *p = eq + 1;
+    const char *end = p + strlen(p);
+    const char *policy = strchr(p, '@');
+    if (policy) {
+        if (strcmp(policy, "@lc") == 0) r->least_conn = 1;
+        else if (strcmp(policy, "@rr") != 0) return -1;
+        end = policy;
+    }
+    while (p < end) {
+        const char *comma = memchr(p, ',', end - p);
+        size_t len = (comma ? comma : end) - p;
+        if (r->num_backends == PROXY_MAX_BACKENDS || parse_backend(p, len, &r->backends[r->num_backends]) < 0) {
+            return -1;
+        }
+        r->num_backends++;
+        p += len + (comma != NULL);
+    }
+    if (r->num_backends == 0) return -1;
+    num_routes++;
+    return 0;
+}
+
+//
+// Connections
+//
+
+static int connect_backend(proxy_backend_t *b) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    // Connect without blocking so a dead host costs at most the timeout
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (connect(fd, (sockaddr_t *) &b->addr, sizeof(b->addr)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (poll(&pfd, 1, PROXY_CONNECT_TIMEOUT_MS) != 1 ||
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, 0);
+
+    int one = 1;
+    struct timeval tv = { PROXY_IO_TIMEOUT, 0 };
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+// Returns a pooled connection (*reused = 1) or a new one
+static int pool_get(proxy_backend_t *b, int *reused) {
+    pthread_mutex_lock(&b->lock);
+    while (b->num_idle > 0) {
+        int fd = b->idle[--b->num_idle];
+        pthread_mutex_unlock(&b->lock);
+
+        // An idle connection must have nothing to read: anything there is
+        // the backend closing it
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 0) == 0) {
+            *reused = 1;
+            return fd;
+        }
+        close(fd);
+        pthread_mutex_lock(&b->lock);
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    *reused = 0;
+    int fd = connect_backend(b);
+    if (fd < 0 && b->healthy) {
+        fprintf(stderr, "proxy: backend %s is down\n", b->name);
+        b->healthy = 0;
+    }
+    return fd;
+}
+
+static void pool_put(proxy_backend_t *b, int fd) {
+    pthread_mutex_lock(&b->lock);
+    if (b->num_idle < PROXY_MAX_IDLE) {
+        b->idle[b->num_idle++] = fd;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&b->lock);
+    if (fd >= 0) close(fd);
+}
+
+static proxy_backend_t *pick_backend(proxy_route_t *r, proxy_backend_t *exclude) {
+    proxy_backend_t *best = NULL;
+    if (r->least_conn) {
+        for (int i = 0; i < r->num_backends; i++) {
+            proxy_backend_t *b = &r->backends[i];
+            if (!b->healthy || b == exclude) continue;
+            if (!best || b->active < best->active) best = b;
+        }
+        return best;
+    }
+    for (int i = 0; i < r->num_backends; i++) {
+        proxy_backend_t *b = &r->backends[__sync_fetch_and_add(&r->rr_next, 1) % r->num_backends];
+        if (b->healthy && b != exclude) return b;
+    }
+    return NULL;
+}
+
+static void *proxy_health(void *arg) {
+    (void) arg;
+    for (;;) {
+        sleep(PROXY_HEALTH_INTERVAL);
+        for (int i = 0; i < num_routes; i++) {
+            for (int j = 0; j < routes[i].num_backends; j++) {
+                proxy_backend_t *b = &routes[i].backends[j];
+                int fd = connect_backend(b);
+                int up = fd >= 0;
+                if (up) close(fd);
+                if (up != b->healthy) {
+                    fprintf(stderr, "proxy: backend %s is %s\n", b->name, up ? "up" : "down");
+                    b->healthy = up;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+void proxy_init(void) {
+    if (num_routes == 0) return;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, proxy_health, NULL) == 0) pthread_detach(thread);
+}
+
+//
+// Relaying
+//
+
+// Writes all of buf; fd may be a socket or (under HTTP/2) a memfd
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == ENOTSOCK) n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static ssize_t up_fill(upstream_t *u) {
+    if (u->pos < u->len) return u->len - u->pos;
+    ssize_t n;
+    do {
+        n = read(u->fd, u->buf, sizeof(u->buf));
+    } while (n < 0 && errno == EINTR);
+    u->pos = 0;
+    u->len = n > 0 ? n : 0;
+    return n;
+}
+
+// Reads one CRLF-terminated line (chunk sizes and trailers)
+static int up_getline(upstream_t *u, char *line, size_t size) {
+    size_t n = 0;
+    for (;;) {
+        if (up_fill(u) <= 0) return -1;
+        char c = u->buf[u->pos++];
+        if (n + 1 < size) line[n++] = c;
+        if (c == '\n') break;
+    }
+    line[n] = '\0';
+    return 0;
+}
+
+// Copies len body bytes from the backend to the client
+static int relay_fixed(upstream_t *u, int fd, long long len) {
+    while (len > 0) {
+        if (up_fill(u) <= 0) return -1;
+        size_t n = u->len - u->pos;
+        if ((long long) n > len) n = len;
+        if (send_all(fd, u->buf + u->pos, n) < 0) return -1;
+        u->pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Decodes a chunked body; the client (HTTP/1.0) gets it until close
+static int relay_chunked(upstream_t *u, int fd) {
+    char line[256];
+    for (;;) {
+        if (up_getline(u, line, sizeof(line)) < 0) return -1;
+        char *end;
+        long long size = strtoll(line, &end, 16);
+        if (end == line || size < 0) return -1;
+        if (size == 0) break;
+        if (relay_fixed(u, fd, size) < 0 || up_getline(u, line, sizeof(line)) < 0) return -1;
+    }
+    // Trailers, up to the empty line
+    do {
+        if (up_getline(u, line, sizeof(line)) < 0) return -1;
+    } while (strcmp(line, "\r\n") != 0 && strcmp(line, "\n") != 0);
+    return 0;
+}
+
+static int relay_until_close(upstream_t *u, int fd) {
+    for (;;) {
+        ssize_t n = up_fill(u);
+        if (n == 0) return 0;
+        if (n < 0) return -1;
+        if (send_all(fd, u->buf + u->pos, u->len - u->pos) < 0) return -1;
+        u->pos = u->len;
+    }
+}
+
+static int is_hop_by_hop(const char *line) {
+    for (int i = 0; hop_by_hop[i]; i++) {
+        size_t len = strlen(hop_by_hop[i]);
+        if (strncasecmp(line, hop_by_hop[i], len) == 0 && line[len] == ':') return 1;
+    }
+    return 0;
+}
+
+// Headers the client named in its Connection field are hop-by-hop too
+static int is_connection_option(const char *line, const char *options) {
+    for (const char *p = options; *p; ) {
+        p += strspn(p, " \t,");
+        size_t len = strcspn(p, " \t,");
+        if (len && strncasecmp(line, p, len) == 0 && line[len] == ':') return 1;
+        p += len;
+    }
+    return 0;
+}
+
+// A header line must end in CRLF and hold no other CR or LF: anything else
+// (a value decoded from HPACK, say) could end the head early and smuggle a
+// second request onto a pooled backend connection
+static int line_is_safe(const char *line, size_t len) {
+    if (len < 3 || line[len - 2] != '\r' || line[len - 1] != '\n') return 0;
+    return memchr(line, '\r', len - 2) == NULL && memchr(line, '\n', len - 2) == NULL;
+}
+
+// Sends the request head and body. Returns -1 if the backend failed
+// before any of the client's body was consumed (the request can be
+// retried), -2 if it failed later, -3 if the head cannot be forwarded
+// safely (nothing was sent).
+static int send_request(int up, proxy_backend_t *b, http_request_t *req, int body_fd, long long body_len, char *buf) {
+    if (strpbrk(req->method, " \t\r\n") || strpbrk(req->uri, " \t\r\n")) return -3;
+    size_t n = snprintf(buf, PROXY_BUF, "%s %s HTTP/1.1\r\n", req->method, req->uri);
+    char forwarded[MAXBUF / 2] = "";
+    char options[MAXBUF / 2] = "";
+    int has_host = 0;
+    request_find_header(req->headers, "Connection", options, sizeof(options));
+
+    for (const char *line = req->headers; line && *line; ) {
+        const char *eol = strchr(line, '\n');
+        size_t len = eol ? (size_t) (eol - line + 1) : strlen(line);
+        if (!line_is_safe(line, len)) return -3;
+        if (strncasecmp(line, "X-Forwarded-For:", 16) == 0) {
+            // The value without the surrounding whitespace; an empty one is dropped
+            const char *v = line + 16;
+            size_t v_len = len - 18;
+            while (v_len > 0 && (*v == ' ' || *v == '\t')) {
+                v++;
+                v_len--;
+            }
+            while (v_len > 0 && (v[v_len - 1] == ' ' || v[v_len - 1] == '\t')) v_len--;
+            if (v_len > 0) snprintf(forwarded, sizeof(forwarded), "%.*s, ", (int) v_len, v);
+        } else if (!is_hop_by_hop(line) && !is_connection_option(line, options) &&
+                   strncasecmp(line, "Content-Length:", 15) != 0 && strncasecmp(line, "Expect:", 7) != 0) {
+            if (strncasecmp(line, "Host:", 5) == 0) has_host = 1;
+            if (n + len + 1 >= PROXY_BUF - MAXBUF) return -2; // oversized head
+            memcpy(buf + n, line, len);
+            n += len;
+        }
+        line = eol ? eol + 1 : NULL;
+    }
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &req->client_ip, ip, sizeof(ip));
+    size_t start = n;
+    n += snprintf(buf + n, PROXY_BUF - n, "X-Forwarded-For: %s%s\r\n", forwarded, ip);
+    if (!line_is_safe(buf + start, n - start)) return -3;
+    if (!has_host) n += snprintf(buf + n, PROXY_BUF - n, "Host: %s\r\n", b->name);
+    if (body_len > 0) n += snprintf(buf + n, PROXY_BUF - n, "Content-Length: %lld\r\n", body_len);
+    n += snprintf(buf + n, PROXY_BUF - n, "\r\n");
+    if (send_all(up, buf, n) < 0) return -1;
+
+    if (req->body) {
+        return send_all(up, req->body, body_len) < 0 ? -1 : 0;
+    }
+    // Stream the client's body through the buffer. Expect is answered here
+    // rather than by the backend: the client waits for it before sending.
+    if (body_len > 0) request_expect_continue(body_fd, req);
+    while (body_len > 0) {
+        ssize_t got = read(body_fd, buf, body_len < PROXY_BUF ? body_len : PROXY_BUF);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0 || send_all(up, buf, got) < 0) return -2;
+        body_len -= got;
+    }
+    return 0;
+}
+
+// Reads the backend's response head into u->buf (skipping 1xx interim
+// responses). Returns its length, 0 if the backend closed the connection
+// first, -1 on error or timeout.
+static ssize_t read_response_head(upstream_t *u) {
+    u->pos = u->len = 0;
+    for (;;) {
+        char *end = memmem(u->buf, u->len, "\r\n\r\n", 4);
+        if (end) {
+            size_t head_len = end + 4 - u->buf;
+            if (strncmp(u->buf, "HTTP/1.1 1", 10) == 0 || strncmp(u->buf, "HTTP/1.0 1", 10) == 0) {
+                memmove(u->buf, u->buf + head_len, u->len - head_len);
+                u->len -= head_len;
+                continue;
+            }
+            return head_len;
+        }
+        if (u->len == sizeof(u->buf)) return -1;
+        ssize_t n = read(u->fd, u->buf + u->len, sizeof(u->buf) - u->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0 && u->len == 0) return 0;
+        if (n <= 0) return -1;
+        u->len += n;
+    }
+}
+
+// Relays the response; returns 1 if the connection can go back to the pool
+static int relay_response(upstream_t *u, size_t head_len, int fd, http_request_t *req) {
+    char out[PROXY_BUF];
+    long long content_length = -1;
+    int chunked = 0, keep_alive = strncmp(u->buf, "HTTP/1.1", 8) == 0;
+
+    // Status line, downgraded to the HTTP/1.0 this server speaks
+    char *line = u->buf;
+    char *eol = memchr(line, '\n', head_len);
+    const char *status = memchr(line, ' ', eol - line);
+    if (!status) return 0;
+    size_t n = snprintf(out, sizeof(out), "HTTP/1.0%.*s\n", (int) (eol - status), status);
+    int code = atoi(status + 1);
+
+    for (line = eol + 1; line < u->buf + head_len - 2; line = eol + 1) {
+        eol = memchr(line, '\n', u->buf + head_len - line);
+        if (strncasecmp(line, "Content-Length:", 15) == 0) content_length = strtoll(line + 15, NULL, 10);
+        if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strcasestr(line, "chunked")) chunked = 1;
+        if (strncasecmp(line, "Connection:", 11) == 0 && strcasestr(line, "close")) keep_alive = 0;
+        if (is_hop_by_hop(line)) continue;
+        memcpy(out + n, line, eol + 1 - line);
+        n += eol + 1 - line;
+    }
+    memcpy(out + n, "\r\n", 2);
+    n += 2;
+    u->pos = head_len;
+    if (send_all(fd, out, n) < 0) return 0;
+
+    int no_body = strcasecmp(req->method, "HEAD") == 0 || code == 204 || code == 304;
+    if (no_body) return keep_alive;
+    if (chunked) return relay_chunked(u, fd) == 0 && keep_alive;
+    if (content_length >= 0) return relay_fixed(u, fd, content_length) == 0 && keep_alive;
+    relay_until_close(u, fd);
+    return 0;
+}
+
+int proxy_serve(int fd, http_request_t *req, int body_fd) {
+    proxy_route_t *route = NULL;
+    size_t best = 0;
+    for (int i = 0; i < num_routes; i++) {
+        if (routes[i].len > best && strncmp(req->uri, routes[i].prefix, routes[i].len) == 0) {
+            route = &routes[i];
+            best = routes[i].len;
+        }
+    }
+    if (!route) return 0;
+
+    char value[64];
+    long long body_len = req->body ? req->body_len : 0;
+    if (!req->body && body_fd >= 0 && request_find_header(req->headers, "Content-Length", value, sizeof(value))) {
+        body_len = strtoll(value, NULL, 10);
+    }
+    if (!req->body && request_find_header(req->headers, "Transfer-Encoding", value, sizeof(value))) {
+        request_error(fd, req->method, "411", "Length Required", "Chunked request bodies are not supported");
+        return 1;
+    }
+
+    upstream_t *u = malloc(sizeof(upstream_t));
+    char *buf = malloc(PROXY_BUF);
+    if (!u || !buf) {
+        free(u);
+        free(buf);
+        request_error(fd, req->uri, "500", "Internal Server Error", "Out of memory");
+        return 1;
+    }
+
+    // A request can move to another connection or backend as long as none
+    // of its body has been consumed from the client
+    proxy_backend_t *b = NULL, *failed = NULL;
+    ssize_t head_len = -1;
+    for (int attempt = 0; attempt < 3 && head_len <= 0; attempt++) {
+        int reused = 0;
+        b = pick_backend(route, failed);
+        if (!b) break;
+        u->fd = pool_get(b, &reused);
+        if (u->fd < 0) {
+            failed = b;
+            continue;
+        }
+        __sync_fetch_and_add(&b->active, 1);
+
+        int rc = send_request(u->fd, b, req, body_fd, body_len, buf);
+        if (rc == -3) {
+            // Refused before anything was written: the connection is clean
+            pool_put(b, u->fd);
+            __sync_fetch_and_sub(&b->active, 1);
+            request_error(fd, req->uri, "400", "Bad Request", "Malformed request head");
+            free(u);
+            free(buf);
+            return 1;
+        }
+        if (rc == 0) head_len = read_response_head(u);
+        if (rc == 0 && head_len > 0) break;
+
+        close(u->fd);
+        __sync_fetch_and_sub(&b->active, 1);
+        int replayable = req->body || body_len == 0;
+        if (rc == -2 || !replayable || (head_len < 0 && !reused)) break;
+        if (!reused) failed = b; // a fresh connection failed: try elsewhere
+    }
+
+    if (head_len <= 0) {
+        if (!b) {
+            request_error_retry(fd, req->uri, "503", "Service Unavailable", "No backend is available", PROXY_HEALTH_INTERVAL);
+        } else if (head_len < 0 && errno == EAGAIN) {
+            request_error(fd, req->uri, "504", "Gateway Timeout", "The backend did not answer in time");
+        } else {
+            request_error(fd, req->uri, "502", "Bad Gateway", "The backend failed to answer");
+        }
+    } else {
+        if (relay_response(u, head_len, fd, req)) pool_put(b, u->fd);
+        else close(u->fd);
+        __sync_fetch_and_sub(&b->active, 1);
+    }
+    free(u);
+    free(buf);
+    return 1;
+}
@@ -0,0 +1,27 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+#include "request.h"
+
+// Reverse proxy: requests whose URI starts with a configured prefix are
+// forwarded, unchanged, to one of that route's HTTP/1.1 backends.
+//
+// Each backend keeps a pool of idle keep-alive connections. Backends are
+// picked round-robin or by fewest requests in flight, skipping those the
+// health checker (a TCP connect every few seconds) or a failed request
+// has marked down. Bodies are streamed in both directions through a
+// fixed buffer: nothing is held in memory in full.
+
+// Parses "prefix=host:port[,host:port...][@lc]"; "@lc" selects
+// least-connections instead of round-robin. Returns 0 on success.
+int proxy_add_route(const char *spec);
+
+// Starts the health checker; call once after all routes are added
+void proxy_init(void);
+
+// If req->uri matches a route, answers the request through a backend and
+// returns 1; otherwise returns 0 and leaves fd untouched. A request body
+// is taken from req->body if it is set, else Content-Length bytes are
+// streamed from body_fd (-1: no body).
+int proxy_serve(int fd, http_request_t *req, int body_fd);
+
+#endif // __PROXY_H__
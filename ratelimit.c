@@ -0,0 +1,238 @@
+#include "io_helper.h"
+#include "ratelimit.h"
+#include <pthread.h>
+#include <time.h>
+
+#define RL_SHARD_BITS 6
+#define RL_SHARDS (1 << RL_SHARD_BITS)
+#define RL_SHARD_INITIAL 256     // slots per shard, doubled when needed
+#define RL_MAX_ROUTES 16
+#define RL_MAX_PREFIX 128
+
+typedef struct {
+    double rate;                 // tokens per second
+    double burst;                // bucket capacity
+} rl_limit_t;
+
+typedef struct {
+    char prefix[RL_MAX_PREFIX];
+    size_t len;
+    rl_limit_t limit;
+} rl_route_t;
+
+typedef struct {
+    uint32_t ip;
+    uint16_t limit;              // 0 = per-IP limit, i + 1 = routes[i]
+    uint16_t used;
+    float tokens;
+    uint64_t last;               // ns of the last refill
+} rl_bucket_t;
+
+// Open addressing with linear probing; nothing is deleted in place, idle
+// buckets are dropped when the shard is rebuilt on growth
+typedef struct {
+    pthread_mutex_t lock;
+    rl_bucket_t *slots;
+    uint32_t cap;                // power of two
+    uint32_t count;
+} __attribute__((aligned(64))) rl_shard_t;
+
+static rl_limit_t global_limit;
+static int global_set = 0;
+static rl_route_t routes[RL_MAX_ROUTES];
+static int num_routes = 0;
+
+static rl_shard_t shards[RL_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static void shards_init(void) {
+    for (int i = 0; i < RL_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].slots = calloc(RL_SHARD_INITIAL, sizeof(rl_bucket_t));
+        shards[i].cap = shards[i].slots ? RL_SHARD_INITIAL : 0;
+        shards[i].count = 0;
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t rl_hash(uint32_t ip, int limit) {
+    uint64_t h = (((uint64_t) ip << 16) | (uint64_t) limit) * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 29);
+}
+
+static rl_limit_t *limit_of(int limit) {
+    return limit ? &routes[limit - 1].limit : &global_limit;
+}
+
+static void refill(rl_bucket_t *b, uint64_t now) {
+    rl_limit_t *l = limit_of(b->limit);
+    double tokens = b->tokens + (now - b->last) * 1e-9 * l->rate;
+    b->tokens = tokens > l->burst ? l->burst : tokens;
+    b->last = now;
+}
+
+// A bucket that would be full by now is the same as no bucket at all
+static int idle(rl_bucket_t *b, uint64_t now) {
+    rl_limit_t *l = limit_of(b->limit);
+    return b->tokens + (now - b->last) * 1e-9 * l->rate >= l->burst;
+}
+
+static void shard_insert(rl_bucket_t *slots, uint32_t cap, rl_bucket_t *b) {
+    uint32_t i = rl_hash(b->ip, b->limit) & (cap - 1);
+    while (slots[i].used) i = (i + 1) & (cap - 1);
+    slots[i] = *b;
+}
+
+// Drops idle buckets and grows the shard if it is still half full
+static void shard_rebuild(rl_shard_t *s, uint64_t now) {
+    uint32_t live = 0;
+    for (uint32_t i = 0; i < s->cap; i++) {
+        if (s->slots[i].used && !idle(&s->slots[i], now)) live++;
+    }
+    uint32_t cap = s->cap;
+    while (live * 2 >= cap) cap *= 2;
+
+    rl_bucket_t *slots = calloc(cap, sizeof(rl_bucket_t));
+    if (!slots) return;
+    for (uint32_t i = 0; i < s->cap; i++) {
+        if (s->slots[i].used && !idle(&s->slots[i], now)) shard_insert(slots, cap, &s->slots[i]);
+    }
+    free(s->slots);
+    s->slots = slots;
+    s->cap = cap;
+    s->count = live;
+}
+
+// Finds the bucket for (ip, limit); with create, a missing one is added
+// full. Called with the shard locked.
+static rl_bucket_t *shard_get(rl_shard_t *s, uint64_t h, uint32_t ip, int limit,
+                              uint64_t now, int create) {
+    if (s->cap == 0) return NULL;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        uint32_t i = h & (s->cap - 1);
+        while (s->slots[i].used) {
+            if (s->slots[i].ip == ip && s->slots[i].limit == limit) return &s->slots[i];
+            i = (i + 1) & (s->cap - 1);
+        }
+        if (!create) return NULL;
+        if ((s->count + 1) * 4 <= s->cap * 3) {
+            rl_bucket_t *b = &s->slots[i];
+            b->ip = ip;
+            b->limit = limit;
+            b->used = 1;
+            b->tokens = limit_of(limit)->burst;
+            b->last = now;
+            s->count++;
+            return b;
+        }
+        shard_rebuild(s, now);
+    }
+    return NULL;
+}
+
+// Checks the bucket, taking a token if consume. Returns 0 if it is empty.
+static int bucket_take(uint32_t ip, int limit, int consume, int *retry_after) {
+    uint64_t h = rl_hash(ip, limit);
+    rl_shard_t *s = &shards[h >> (64 - RL_SHARD_BITS)];
+    uint64_t now = now_ns();
+    int ok = 1;
+
+    pthread_mutex_lock(&s->lock);
+    rl_bucket_t *b = shard_get(s, h, ip, limit, now, consume);
+    if (b) {
+        refill(b, now);
+        if (b->tokens >= 1) {
+            if (consume) b->tokens -= 1;
+        } else {
+            double wait = (1 - b->tokens) / limit_of(limit)->rate;
+            *retry_after = (int) wait < wait ? (int) wait + 1 : (int) wait;
+            if (*retry_after < 1) *retry_after = 1;
+            ok = 0;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return ok;
+}
+
+static void bucket_refund(uint32_t ip, int limit) {
+    uint64_t h = rl_hash(ip, limit);
+    rl_shard_t *s = &shards[h >> (64 - RL_SHARD_BITS)];
+    uint64_t now = now_ns();
+
+    pthread_mutex_lock(&s->lock);
+    rl_bucket_t *b = shard_get(s, h, ip, limit, now, 0);
+    if (b) {
+        refill(b, now);
+        b->tokens += 1;
+        if (b->tokens > limit_of(limit)->burst) b->tokens = limit_of(limit)->burst;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int parse_limit(const char *spec, rl_limit_t *limit) {
+    char *end;
+    limit->rate = strtod(spec, &end);
+    if (end == spec || limit->rate <= 0) return -1;
+    limit->burst = limit->rate < 1 ? 1 : limit->rate;
+    if (*end == ':') {
+        spec = end + 1;
+        limit->burst = strtod(spec, &end);
+        if (end == spec || limit->burst < 1) return -1;
+    }
+    return *end == '\0' ? 0 : -1;
+}
+
+int ratelimit_set_global(const char *spec) {
+    if (parse_limit(spec, &global_limit) < 0) return -1;
+    pthread_once(&shards_once, shards_init);
+    global_set = 1;
+    return 0;
+}
+
+int ratelimit_add_route(const char *spec) {
+    const char *eq = strchr(spec, '=');
+    if (!eq || eq == spec || spec[0] != '/' || eq - spec >= RL_MAX_PREFIX) return -1;
+    if (num_routes == RL_MAX_ROUTES) return -1;
+
+    rl_route_t *r = &routes[num_routes];
+    if (parse_limit(eq + 1, &r->limit) < 0) return -1;
+    r->len = eq - spec;
+    memcpy(r->prefix, spec, r->len);
+    r->prefix[r->len] = '\0';
+    pthread_once(&shards_once, shards_init);
+    num_routes++;
+    return 0;
+}
+
+int ratelimit_enabled(void) {
+    return global_set || num_routes > 0;
+}
+
+int ratelimit_accept(uint32_t client_ip, int *retry_after) {
+    if (!global_set) return 1;
+    return bucket_take(client_ip, 0, 0, retry_after);
+}
+
+int ratelimit_request(uint32_t client_ip, const char *uri, int *retry_after) {
+    int route = 0;
+    size_t best = 0;
+    for (int i = 0; i < num_routes; i++) {
+        if (routes[i].len > best && strncmp(uri, routes[i].prefix, routes[i].len) == 0) {
+            route = i + 1;
+            best = routes[i].len;
+        }
+    }
+
+    if (route && !bucket_take(client_ip, route, 1, retry_after)) return 0;
+    if (global_set && !bucket_take(client_ip, 0, 1, retry_after)) {
+        // Refused anyway: the route token was not spent
+        if (route) bucket_refund(client_ip, route);
+        return 0;
+    }
+    return 1;
+}
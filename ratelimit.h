@@ -0,0 +1,31 @@
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+#include <stdint.h>
+
+// Per-client token buckets. Every client IP has a bucket for the global
+// limit (-r) and one per route limit (-R) it has used; a request takes a
+// token from each bucket that applies. Buckets live in a hash table split
+// into shards, each behind its own lock, and are reclaimed lazily: a
+// bucket that has refilled completely carries no state worth keeping and
+// is dropped the next time its shard is rebuilt.
+
+// Parses "rate[:burst]" (requests per second, burst defaults to rate) as
+// the per-IP limit. Returns 0 on success.
+int ratelimit_set_global(const char *spec);
+
+// Parses "prefix=rate[:burst]": requests whose URI starts with prefix
+// are limited per IP as well (the longest matching prefix applies)
+int ratelimit_add_route(const char *spec);
+
+// Returns 1 once any limit is configured
+int ratelimit_enabled(void);
+
+// Checked right after accept(): 0 if the client has no tokens left, so
+// the connection can be refused before a worker is spent on it. Takes no
+// token. retry_after receives the seconds until one is available.
+int ratelimit_accept(uint32_t client_ip, int *retry_after);
+
+// Checked after the request line: takes a token for uri, 0 if refused
+int ratelimit_request(uint32_t client_ip, const char *uri, int *retry_after);
+
+#endif // __RATELIMIT_H__
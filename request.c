@@ -1,42 +1,155 @@
 #include "io_helper.h"
 #include "request.h"
+#include "mime.h"
+#include "upload_store.h"
+#include "scan.h"
+#include "thumbnail.h"
+#include "http2.h"
+#include "docroot.h"
+#include "bundle.h"
+#include "ratelimit.h"
+#include "proxy.h"
+#include "router.h"
+#include "trace.h"
+#include "cgi.h"
+#include "membudget.h"
+#include "manifest.h"
+#include "template.h"
+#include "connpool.h"
+#include <limits.h>
 
 
-#define MAXBUF (8192)
 #define UPLOAD_DIR "uploads"
-#define MAX_FILE_SIZE (10 * 1024 * 1024) // 10MB
 #define BOUNDARY_PREFIX "--"
+#define BODY_BUDGET_WAIT_MS 2000 // how long a body may wait for memory
+#define SPLICE_MIN_BODY (64 * 1024)  // smaller uploads are buffered
 
+// Generated pages, compiled by request_init()
+static template_t tpl_error_head, tpl_error, tpl_upload_form;
+static template_t tpl_post_head, tpl_post_row, tpl_post_tail;
+static template_t tpl_upload_head, tpl_upload_ok, tpl_upload_failed, tpl_upload_tail;
 
+static const char *const error_slots[] = { "errnum", "shortmsg", "longmsg", "cause", "extra", "length", NULL };
+static const char *const post_slots[] = { "key", "value", NULL };
+static const char *const upload_slots[] = { "filename", "status", "preview", "path", "error", NULL };
 
-// Implementation of error response
-void request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
-    char buf[MAXBUF], body[MAXBUF];
-
-    // Create the body of error message first (have to know its length for header)
-    sprintf(body, ""
+static void request_compile_templates(void) {
+    template_compile(&tpl_error_head, "error_head",
+        "HTTP/1.0 {{&errnum}} {{&shortmsg}}\r\n"
+        "Content-Type: text/html\r\n"
+        "{{&extra}}"
+        "Content-Length: {{&length}}\r\n\r\n", error_slots);
+    template_compile(&tpl_error, "error",
         "<!doctype html>\r\n"
         "<head>\r\n"
         "  <title>WebServer Error</title>\r\n"
         "</head>\r\n"
         "<body>\r\n"
-        "  <h2>%s: %s</h2>\r\n" 
-        "  <p>%s: %s</p>\r\n"
+        "  <h2>{{errnum}}: {{shortmsg}}</h2>\r\n" 
+        "  <p>{{longmsg}}: {{cause:512}}</p>\r\n"
         "</body>\r\n"
-        "</html>\r\n", errnum, shortmsg, longmsg, cause);
+        "</html>\r\n", error_slots);
 
-    // Write out the header information for this response
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    write_or_die(fd, buf, strlen(buf));
+    template_compile(&tpl_upload_form, "upload_form",
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/html\r\n\r\n"
+        "<!DOCTYPE html>\n"
+        "<html>\n"
+        "<head>\n"
+        "    <title>Photo Upload</title>\n"
+        "    <style>\n"
+        "        body { font-family: Arial, sans-serif; margin: 0; padding: 20px; }\n"
+        "        h1 { color: #333; }\n"
+        "        form { margin: 20px 0; border: 1px solid #ddd; padding: 20px; border-radius: 5px; }\n"
+        "        .form-group { margin-bottom: 15px; }\n"
+        "        label { display: block; margin-bottom: 5px; font-weight: bold; }\n"
+        "        input[type=file] { padding: 10px; border: 1px solid #ddd; width: 100%; box-sizing: border-box; }\n"
+        "        button { background-color: #4CAF50; color: white; padding: 10px 15px; border: none; cursor: pointer; }\n"
+        "        button:hover { background-color: #45a049; }\n"
+        "    </style>\n"
+        "</head>\n"
+        "<body>\n"
+        "    <h1>Upload Photos</h1>\n"
+        "    <form action=\"/upload\" method=\"post\" enctype=\"multipart/form-data\">\n"
+        "        <div class=\"form-group\">\n"
+        "            <label for=\"photo\">Select photo to upload:</label>\n"
+        "            <input type=\"file\" id=\"photo\" name=\"photo\" accept=\"image/*\" required>\n"
+        "        </div>\n"
+        "        <button type=\"submit\">Upload Photo</button>\n"
+        "    </form>\n"
+        "</body>\n"
+        "</html>", NULL);
 
-    sprintf(buf, "Content-Type: text/html\r\n");
-    write_or_die(fd, buf, strlen(buf));
+    template_compile(&tpl_post_head, "post_head",
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/html\r\n"
+        "Connection: close\r\n\r\n"
+        "<!DOCTYPE html><html><head><title>POST Data</title></head><body>"
+        "<h1>Parsed POST Parameters</h1><table border='1'>", NULL);
+    template_compile(&tpl_post_row, "post_row",
+        "<tr><td><strong>{{key:100}}</strong></td><td>{{value:500}}</td></tr>", post_slots);
+    template_compile(&tpl_post_tail, "post_tail", "</table></body></html>", NULL);
 
-    sprintf(buf, "Content-Length: %lu\r\n\r\n", strlen(body));
-    write_or_die(fd, buf, strlen(buf));
+    template_compile(&tpl_upload_head, "upload_head",
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/html\r\n\r\n"
+        "<!DOCTYPE html>\n"
+        "<html>\n"
+        "<head>\n"
+        "    <title>Upload Results</title>\n"
+        "    <style>\n"
+        "        body { font-family: Arial, sans-serif; margin: 0; padding: 20px; }\n"
+        "        h1 { color: #333; }\n"
+        "        .success { color: green; }\n"
+        "        .error { color: red; }\n"
+        "        .file-container { margin-top: 20px; border: 1px solid #ddd; padding: 15px; border-radius: 5px; }\n"
+        "        .file-link { margin-top: 10px; }\n"
+        "        a { color: #0066cc; text-decoration: none; }\n"
+        "        a:hover { text-decoration: underline; }\n"
+        "        img { max-width: 300px; border: 1px solid #ddd; padding: 5px; }\n"
+        "    </style>\n"
+        "</head>\n"
+        "<body>\n"
+        "    <h1>Upload Results</h1>\n", NULL);
+    template_compile(&tpl_upload_ok, "upload_ok",
+        "<div class=\"file-container\">\n"
+        "    <p class=\"success\">File '{{filename:256}}' {{&status}}</p>\n"
+        "    <img src=\"{{preview}}\" alt=\"Uploaded Image\">\n"
+        "    <p class=\"file-link\"><a href=\"/{{path}}\" target=\"_blank\">View full size</a></p>\n"
+        "</div>\n", upload_slots);
+    template_compile(&tpl_upload_failed, "upload_failed",
+        "<div class=\"file-container\">\n"
+        "    <p class=\"error\">Error saving file '{{filename:256}}': {{error}}</p>\n"
+        "</div>\n", upload_slots);
+    template_compile(&tpl_upload_tail, "upload_tail", "{{&status}}</body>\n</html>", upload_slots);
+}
+
+// Error response with extra header lines (may be empty)
+static void request_error_headers(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg,
+                                  const char *extra) {
+    template_out_t head, body;
+    char length[32];
+    const char *values[] = { errnum, shortmsg, longmsg, cause, extra, length };
+
+    // Render the body first (have to know its length for header)
+    template_out_init(&body);
+    template_render(&body, &tpl_error, values);
+    snprintf(length, sizeof(length), "%zu", body.len);
+    template_out_init(&head);
+    template_render(&head, &tpl_error_head, values);
+    template_write(fd, &head, &body);
+}
+
+// Implementation of error response
+void request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
+    request_error_headers(fd, cause, errnum, shortmsg, longmsg, "");
+}
 
-    // Write out the body last
-    write_or_die(fd, body, strlen(body));
+// Error response telling the client when to try again (429, 503)
+void request_error_retry(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg, int retry_after) {
+    char extra[64];
+    snprintf(extra, sizeof(extra), "Retry-After: %d\r\n", retry_after);
+    request_error_headers(fd, cause, errnum, shortmsg, longmsg, extra);
 }
 
 // Reads and discards everything up to an empty text line
@@ -76,57 +189,110 @@ int request_parse_uri(char *uri, char *filename, char *cgiargs) {
     }
 }
 
-// Fills in the filetype given the filename
-void request_get_filetype(char *filename, char *filetype) {
-    if (strstr(filename, ".html")) strcpy(filetype, "text/html");
-    else if (strstr(filename, ".gif")) strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".jpg")) strcpy(filetype, "image/jpeg");
-    else if (strstr(filename, ".jpeg")) strcpy(filetype, "image/jpeg");
-    else if (strstr(filename, ".png")) strcpy(filetype, "image/png");
-    else if (strstr(filename, ".css")) strcpy(filetype, "text/css");
-    else if (strstr(filename, ".js")) strcpy(filetype, "application/javascript");
-    else strcpy(filetype, "text/plain");
-}
-
-void request_serve_static(int fd, char *filename, int filesize) {
+// Sends filename with the given type; etag may be NULL. Bundled files are
+// sent from the bundle, gzip-encoded if gzip_ok and a variant exists.
+static void request_serve_file(int fd, char *filename, int filesize, const char *filetype,
+                               const char *etag, int gzip_ok) {
     int srcfd;
-    char *srcp, filetype[MAXBUF], buf[MAXBUF];
+    char buf[MAXBUF], etag_line[128] = "";
 
-    request_get_filetype(filename, filetype);
+    uint64_t t = trace_start();
+    if (bundle_serve(fd, filename, gzip_ok)) {
+        trace_span(TRACE_SEND, t);
+        return;
+    }
     srcfd = open_or_die(filename, O_RDONLY, 0);
+    trace_span(TRACE_OPEN, t);
 
-    // Rather than call read() to read the file into memory, 
-    // which would require that we allocate a buffer, we memory-map the file
-    srcp = mmap_or_die(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    close_or_die(srcfd);
+    // Content-addressed uploads never change, so they may be cached forever
+    const char *cache_control = upload_store_is_blob(filename)
+        ? "Cache-Control: public, max-age=31536000, immutable\r\n" : "";
+    if (etag) snprintf(etag_line, sizeof(etag_line), "ETag: %s\r\n", etag);
 
     // put together response
     sprintf(buf, ""
         "HTTP/1.0 200 OK\r\n"
         "Server: Webserver C\r\n"
         "Content-Length: %d\r\n"
+        "%s%s"
         "Content-Type: %s\r\n\r\n", 
-        filesize, filetype);
+        filesize, cache_control, etag_line, filetype);
 
+    t = trace_start();
     write_or_die(fd, buf, strlen(buf));
 
-    //  Writes out to the client socket the memory-mapped file 
-    write_or_die(fd, srcp, filesize);
-    munmap_or_die(srcp, filesize);
+    // Rather than copying the file through a user-space buffer (or a
+    // mapping), let the kernel move it from the page cache to the socket.
+    // With kernel TLS the socket encrypts on the way, so this stays
+    // zero-copy under TLS as well.
+    off_t offset = 0;
+    while (offset < filesize) {
+        ssize_t n = sendfile(fd, srcfd, &offset, filesize - offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+    }
+    trace_span(TRACE_SEND, t);
+    close_or_die(srcfd);
+}
+
+void request_serve_static(int fd, char *filename, int filesize) {
+    char filetype[MAXBUF];
+    mime_get_filetype(filename, filetype);
+    request_serve_file(fd, filename, filesize, filetype, NULL, 0);
+}
+
+// Returns 1 if the client takes gzip (and did not rule it out with q=0)
+static int request_accepts_gzip(http_request_t *req) {
+    char value[MAXBUF];
+    if (!req->headers || !request_find_header(req->headers, "Accept-Encoding", value, sizeof(value))) return 0;
+    char *gzip = strcasestr(value, "gzip");
+    if (!gzip) return 0;
+    char *q = gzip + 4;
+    while (*q == ' ' || *q == '\t') q++;
+    if (*q != ';') return 1;
+    q = strcasestr(q, "q=");
+    return !q || strtod(q + 2, NULL) > 0;
+}
+
+// Answers a conditional GET whose If-None-Match lists the current ETag
+static int request_not_modified(int fd, http_request_t *req, const char *etag) {
+    char value[MAXBUF], buf[MAXBUF];
+    if (!req->headers || !request_find_header(req->headers, "If-None-Match", value, sizeof(value))) return 0;
+    if (strcmp(value, "*") != 0 && !strstr(value, etag)) return 0;
+    snprintf(buf, sizeof(buf), ""
+        "HTTP/1.0 304 Not Modified\r\n"
+        "Server: Webserver C\r\n"
+        "ETag: %s\r\n\r\n", etag);
+    write_or_die(fd, buf, strlen(buf));
+    return 1;
 }
 
+// Hex digits map to 0x10 | value, everything else (including '\0') to 0
+static const unsigned char hex_value[256] = {
+    ['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+    ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+    ['A'] = 0x1a, ['B'] = 0x1b, ['C'] = 0x1c, ['D'] = 0x1d, ['E'] = 0x1e, ['F'] = 0x1f,
+    ['a'] = 0x1a, ['b'] = 0x1b, ['c'] = 0x1c, ['d'] = 0x1d, ['e'] = 0x1e, ['f'] = 0x1f,
+};
+
 // URL decode function
 void url_decode(char *dst, const char *src) {
-    char a, b;
-    while (*src) {
-        if (*src == '%' && (a = src[1]) && (b = src[2]) && isxdigit(a) && isxdigit(b)) {
-            if (a >= 'a') a -= 'a'-'A';
-            if (a >= 'A') a -= ('A' - 10);
-            else a -= '0';
-            if (b >= 'a') b -= 'a'-'A';
-            if (b >= 'A') b -= ('A' - 10);
-            else b -= '0';
-            *dst++ = 16 * a + b;
+    const char *end = src + strlen(src);
+    unsigned char a, b;
+    while (src < end) {
+        // Copy the run up to the next '%' or '+' in one go
+        size_t run = scan_url_special(src, end - src);
+        if (run) {
+            memmove(dst, src, run);
+            dst += run;
+            src += run;
+            if (src == end) break;
+        }
+
+        // src[2] is only looked at when src[1] is a hex digit, not '\0'
+        if (*src == '%' && (a = hex_value[(unsigned char) src[1]]) &&
+            (b = hex_value[(unsigned char) src[2]])) {
+            *dst++ = ((a & 0x0f) << 4) | (b & 0x0f);
             src += 3;
         } else if (*src == '+') {
             *dst++ = ' ';
@@ -206,29 +372,16 @@ void request_handle_post(int fd, char* headers, char *body, int body_len) {
     int num_params = 0;
     post_param_t *params = parse_post_data(body, &num_params);
 
-    // Create HTML response
-    char response_head[MAXBUF];
-    snprintf(response_head, sizeof(response_head),
-        "HTTP/1.1 200 OK\r\n"
-        "Content-Type: text/html\r\n"
-        "Connection: close\r\n\r\n");
-    write_or_die(fd, response_head, strlen(response_head));
-
-    // Write response body
-    char *html_head = "<!DOCTYPE html><html><head><title>POST Data</title></head><body>"
-                     "<h1>Parsed POST Parameters</h1><table border='1'>";
-    write_or_die(fd, html_head, strlen(html_head));
-
+    // Create HTML response; rows are written as the output fills up
+    template_out_t out;
+    template_out_init(&out);
+    template_render(&out, &tpl_post_head, NULL);
     for (int i = 0; i < num_params; i++) {
-        char row[MAXBUF * 2];
-        snprintf(row, sizeof(row),
-            "<tr><td><strong>%.100s</strong></td><td>%.500s</td></tr>",
-            params[i].key, params[i].value);
-        write_or_die(fd, row, strlen(row));
+        const char *values[] = { params[i].key, params[i].value };
+        template_emit(fd, &out, &tpl_post_row, values);
     }
-
-    char *html_tail = "</table></body></html>";
-    write_or_die(fd, html_tail, strlen(html_tail));
+    template_emit(fd, &out, &tpl_post_tail, NULL);
+    template_write(fd, NULL, &out);
 
     free_post_params(params, num_params);
 }
@@ -241,14 +394,16 @@ int get_content_length(char *headers) {
     }
 
     if (cl_header != NULL) {
-        return atoi(cl_header + 15); // 15 = length of "Content-Length:"
+        // 15 = length of "Content-Length:"; anything past INT_MAX is just "too large"
+        long long length = strtoll(cl_header + 15, NULL, 10);
+        return length > INT_MAX ? INT_MAX : (int) length;
     }
 
     return 0;
 }
 
 // Parse request headers
-void request_parse_headers(int fd, char *headers, size_t headers_size) {
+size_t request_parse_headers(int fd, char *headers, size_t headers_size) {
     char buf[MAXBUF];
     int header_len = 0;
 
@@ -260,6 +415,7 @@ void request_parse_headers(int fd, char *headers, size_t headers_size) {
         header_len += strlen(buf);
         readline_or_die(fd, buf, MAXBUF);
     }
+    return header_len;
 }
 
 // Parse request body
@@ -289,6 +445,7 @@ void create_upload_dir() {
     struct stat st = {0};
     if (stat(UPLOAD_DIR, &st) == -1) {
         mkdir(UPLOAD_DIR, 0755);  // Changed permissions to be more permissive
+        docroot_refresh(UPLOAD_DIR);
         fprintf(stderr, "Created upload directory: %s\n", UPLOAD_DIR);
     }
 }
@@ -304,44 +461,10 @@ void generate_filename(char *buffer, const char *ext) {
 
 // Serve the upload form
 void serve_upload_form(int fd) {
-    char buf[MAXBUF];
-    
-    // HTTP header
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    write_or_die(fd, buf, strlen(buf));
-    
-    sprintf(buf, "Content-Type: text/html\r\n\r\n");
-    write_or_die(fd, buf, strlen(buf));
-    
-    // HTML content with file upload form
-    char *html = "<!DOCTYPE html>\n"
-                 "<html>\n"
-                 "<head>\n"
-                 "    <title>Photo Upload</title>\n"
-                 "    <style>\n"
-                 "        body { font-family: Arial, sans-serif; margin: 0; padding: 20px; }\n"
-                 "        h1 { color: #333; }\n"
-                 "        form { margin: 20px 0; border: 1px solid #ddd; padding: 20px; border-radius: 5px; }\n"
-                 "        .form-group { margin-bottom: 15px; }\n"
-                 "        label { display: block; margin-bottom: 5px; font-weight: bold; }\n"
-                 "        input[type=file] { padding: 10px; border: 1px solid #ddd; width: 100%; box-sizing: border-box; }\n"
-                 "        button { background-color: #4CAF50; color: white; padding: 10px 15px; border: none; cursor: pointer; }\n"
-                 "        button:hover { background-color: #45a049; }\n"
-                 "    </style>\n"
-                 "</head>\n"
-                 "<body>\n"
-                 "    <h1>Upload Photos</h1>\n"
-                 "    <form action=\"/upload\" method=\"post\" enctype=\"multipart/form-data\">\n"
-                 "        <div class=\"form-group\">\n"
-                 "            <label for=\"photo\">Select photo to upload:</label>\n"
-                 "            <input type=\"file\" id=\"photo\" name=\"photo\" accept=\"image/*\" required>\n"
-                 "        </div>\n"
-                 "        <button type=\"submit\">Upload Photo</button>\n"
-                 "    </form>\n"
-                 "</body>\n"
-                 "</html>";
-    
-    write_or_die(fd, html, strlen(html));
+    template_out_t out;
+    template_out_init(&out);
+    template_render(&out, &tpl_upload_form, NULL);
+    template_write(fd, NULL, &out);
 }
 
 // Extract boundary from Content-Type header
@@ -359,16 +482,14 @@ char* get_boundary(char *content_type) {
             if (end) {
                 size_t len = end - boundary_start;
                 boundary = malloc(len + 3); // +3 for "--" prefix and null terminator
-                sprintf(boundary, "--%s", boundary_start);
-                boundary[len + 2] = '\0';
+                sprintf(boundary, "--%.*s", (int) len, boundary_start);
             }
         } else {
             // Handle unquoted boundary
             char *end = strpbrk(boundary_start, " \t\r\n;");
             size_t len = end ? (size_t)(end - boundary_start) : strlen(boundary_start);
             boundary = malloc(len + 3); // +3 for "--" prefix and null terminator
-            sprintf(boundary, "--%s", boundary_start);
-            boundary[len + 2] = '\0';
+            sprintf(boundary, "--%.*s", (int) len, boundary_start);
         }
     }
     
@@ -396,47 +517,117 @@ void normalize_content_type(char *content_type) {
     }
 }
 
+// Start of the upload result page
+static void upload_page_begin(int fd) {
+    template_out_t out;
+    template_out_init(&out);
+    template_render(&out, &tpl_upload_head, NULL);
+    template_write(fd, NULL, &out);
+}
+
+// End of the upload result page
+static void upload_page_end(int fd, int files_uploaded) {
+    template_out_t out;
+    const char *values[] = { NULL,
+        files_uploaded ? "" :
+            "<p class=\"error\">No valid files were found in the upload.</p>\n"
+            "<p><a href=\"/upload\">Try again</a></p>\n" };
+    template_out_init(&out);
+    template_render(&out, &tpl_upload_tail, values);
+    template_write(fd, NULL, &out);
+}
+
+// Extracts filename and normalised Content-Type from a part's headers;
+// both are malloc'ed, NULL when absent
+static void parse_part_headers(const char *headers, char **filename, char **content_type) {
+    *filename = NULL;
+    *content_type = NULL;
+
+    // Parse Content-Disposition to get filename
+    const char *disp = strstr(headers, "Content-Disposition:");
+    if (disp) {
+        const char *filename_start = strstr(disp, "filename=\"");
+        if (filename_start) {
+            filename_start += 10; // Skip 'filename="'
+            const char *filename_end = strchr(filename_start, '"');
+            if (filename_end) {
+                size_t name_len = filename_end - filename_start;
+                *filename = malloc(name_len + 1);
+                memcpy(*filename, filename_start, name_len);
+                (*filename)[name_len] = '\0';
+            }
+        }
+    }
+    
+    const char *ct = strstr(headers, "Content-Type:");
+    if (ct) {
+        const char *ct_start = ct + 13;  // "Content-Type:" длина 13 символов
+        while (*ct_start == ' ' || *ct_start == '\t') ct_start++;
+        
+        const char *ct_end = strstr(ct_start, "\r\n");
+        if (!ct_end) ct_end = strchr(ct_start, '\0');
+        
+        size_t ct_len = ct_end - ct_start;
+        *content_type = malloc(ct_len + 1);
+        memcpy(*content_type, ct_start, ct_len);
+        (*content_type)[ct_len] = '\0';
+        
+        // Нормализуем Content-Type
+        normalize_content_type(*content_type);
+    }
+}
+
+// Records a new blob in the manifest and reports the stored file on the
+// result page; returns 1 on success
+static int upload_report(int fd, const char *filename, const char *content_type, size_t size,
+                         int stored, const char *new_filename) {
+    if (stored != UPLOAD_STORE_ERROR) {
+        // Success: the page shows a thumbnail, rendered in the background
+        const char *blob_name = new_filename + strlen(UPLOAD_DIR) + 1;
+        if (stored == UPLOAD_STORE_NEW) {
+            manifest_append(blob_name, filename, size, content_type);
+        }
+        char preview_uri[MAXBUF];
+        if (thumbnail_enqueue(blob_name) == 0) {
+            thumbnail_uri(blob_name, preview_uri, sizeof(preview_uri));
+        } else {
+            snprintf(preview_uri, sizeof(preview_uri), "/%s", new_filename);
+        }
+        template_out_t out;
+        const char *values[] = { filename,
+            stored == UPLOAD_STORE_DUP ? "was already stored" : "uploaded successfully",
+            preview_uri, new_filename, NULL };
+        template_out_init(&out);
+        template_render(&out, &tpl_upload_ok, values);
+        template_write(fd, NULL, &out);
+        return 1;
+    }
+
+    // File write error
+    template_out_t out;
+    const char *values[] = { filename, NULL, NULL, NULL, strerror(errno) };
+    template_out_init(&out);
+    template_render(&out, &tpl_upload_failed, values);
+    template_write(fd, NULL, &out);
+    return 0;
+}
+
 // Handle multipart form data upload
 void handle_multipart_upload(int fd, char *body, size_t body_size, char *boundary) {
     create_upload_dir();
     
     size_t boundary_len = strlen(boundary);
-    char *end_boundary = malloc(boundary_len + 3); // --boundary--
-    sprintf(end_boundary, "%s--", boundary);
     
     char *current = body;
     char *body_end = body + body_size;
     int files_uploaded = 0;
     
     // Start HTML response
-    char response[MAXBUF];
-    sprintf(response, 
-        "HTTP/1.0 200 OK\r\n"
-        "Content-Type: text/html\r\n\r\n"
-        "<!DOCTYPE html>\n"
-        "<html>\n"
-        "<head>\n"
-        "    <title>Upload Results</title>\n"
-        "    <style>\n"
-        "        body { font-family: Arial, sans-serif; margin: 0; padding: 20px; }\n"
-        "        h1 { color: #333; }\n"
-        "        .success { color: green; }\n"
-        "        .error { color: red; }\n"
-        "        .file-container { margin-top: 20px; border: 1px solid #ddd; padding: 15px; border-radius: 5px; }\n"
-        "        .file-link { margin-top: 10px; }\n"
-        "        a { color: #0066cc; text-decoration: none; }\n"
-        "        a:hover { text-decoration: underline; }\n"
-        "        img { max-width: 300px; border: 1px solid #ddd; padding: 5px; }\n"
-        "    </style>\n"
-        "</head>\n"
-        "<body>\n"
-        "    <h1>Upload Results</h1>\n"
-    );
-    write_or_die(fd, response, strlen(response));
+    upload_page_begin(fd);
     
     while (current < body_end) {
         // Find the next boundary
-        char *next_boundary = memmem(current, body_end - current, boundary, boundary_len);
+        char *next_boundary = scan_find(current, body_end - current, boundary, boundary_len);
         if (!next_boundary) {
             break; // No more boundaries found
         }
@@ -444,14 +635,13 @@ void handle_multipart_upload(int fd, char *body, size_t body_size, char *boundar
         // Move past this boundary
         current = next_boundary + boundary_len + 2; // +2 for CRLF
         
-        // Check if we've reached the end boundary
-        if (current >= body_end || 
-            memmem(next_boundary, body_end - next_boundary, end_boundary, strlen(end_boundary)) == next_boundary) {
+        // Check if we've reached the end boundary (--boundary--)
+        if (current >= body_end || memcmp(current - 2, "--", 2) == 0) {
             break;
         }
         
         // Find the end of headers (double CRLF)
-        char *headers_end = memmem(current, body_end - current, "\r\n\r\n", 4);
+        char *headers_end = scan_find(current, body_end - current, "\r\n\r\n", 4);
         if (!headers_end) {
             continue; // No headers end found, malformed
         }
@@ -463,7 +653,7 @@ void handle_multipart_upload(int fd, char *body, size_t body_size, char *boundar
         headers[headers_len] = '\0';
         
         // Find next boundary to determine content length
-        char *part_end = memmem(headers_end + 4, body_end - (headers_end + 4), boundary, boundary_len);
+        char *part_end = scan_find(headers_end + 4, body_end - (headers_end + 4), boundary, boundary_len);
         if (!part_end) {
             free(headers);
             break; // Malformed, no closing boundary
@@ -473,93 +663,16 @@ void handle_multipart_upload(int fd, char *body, size_t body_size, char *boundar
         size_t content_len = part_end - (headers_end + 4) - 2;
         char *content = headers_end + 4;
         
-        // Parse Content-Disposition to get filename
-        char *filename = NULL;
-        char *content_type = NULL;
-        char *disp = strstr(headers, "Content-Disposition:");
-        if (disp) {
-            char *filename_start = strstr(disp, "filename=\"");
-            if (filename_start) {
-                filename_start += 10; // Skip 'filename="'
-                char *filename_end = strchr(filename_start, '"');
-                if (filename_end) {
-                    size_t name_len = filename_end - filename_start;
-                    filename = malloc(name_len + 1);
-                    memcpy(filename, filename_start, name_len);
-                    filename[name_len] = '\0';
-                }
-            }
-        }
-        
-        char *ct = strstr(headers, "Content-Type:");
-        if (ct) {
-            char *ct_start = ct + 13;  // "Content-Type:" длина 13 символов
-            while (*ct_start == ' ' || *ct_start == '\t') ct_start++;
-            
-            char *ct_end = strstr(ct_start, "\r\n");
-            if (!ct_end) ct_end = strchr(ct_start, '\0');
-            
-            size_t ct_len = ct_end - ct_start;
-            content_type = malloc(ct_len + 1);
-            memcpy(content_type, ct_start, ct_len);
-            content_type[ct_len] = '\0';
-            
-            // Нормализуем Content-Type
-            normalize_content_type(content_type);
-        }
+        char *filename, *content_type;
+        parse_part_headers(headers, &filename, &content_type);
         
         // Process file if we have a filename and content
         if (filename && content_len > 0) {
-            const char *ext = "bin";
-            if (content_type) {
-                if (strcasecmp(content_type, "image/jpeg") == 0) ext = "jpg";
-                else if (strcasecmp(content_type, "image/pjpeg") == 0) ext = "jpg";
-                else if (strcasecmp(content_type, "image/png") == 0) ext = "png";
-                else if (strcasecmp(content_type, "image/gif") == 0) ext = "gif";
-            }
-            
-            // Generate unique filename
+            // Store content-addressed; identical uploads share one blob
             char new_filename[256];
-            generate_filename(new_filename, ext);
-            
-            // Save file
-            FILE *fp = fopen(new_filename, "wb");
-            if (fp) {
-                size_t written = fwrite(content, 1, content_len, fp);
-                fclose(fp);
-                
-                if (written == content_len) {
-                    // Success
-                    files_uploaded++;
-                    char success_msg[MAXBUF];
-                    sprintf(success_msg, 
-                        "<div class=\"file-container\">\n"
-                        "    <p class=\"success\">File '%s' uploaded successfully</p>\n"
-                        "    <img src=\"/%s\" alt=\"Uploaded Image\">\n"
-                        "    <p class=\"file-link\"><a href=\"/%s\" target=\"_blank\">View full size</a></p>\n"
-                        "</div>\n",
-                        filename, new_filename, new_filename);
-                    write_or_die(fd, success_msg, strlen(success_msg));
-                } else {
-                    // Write error
-                    char error_msg[MAXBUF];
-                    sprintf(error_msg, 
-                        "<div class=\"file-container\">\n"
-                        "    <p class=\"error\">Error writing file '%s': Only %zu of %zu bytes written</p>\n"
-                        "</div>\n",
-                        filename, written, content_len);
-                    write_or_die(fd, error_msg, strlen(error_msg));
-                }
-            } else {
-                // File open error
-                char error_msg[MAXBUF];
-                sprintf(error_msg, 
-                    "<div class=\"file-container\">\n"
-                    "    <p class=\"error\">Error saving file '%s': %s</p>\n"
-                    "</div>\n",
-                    filename, strerror(errno));
-                write_or_die(fd, error_msg, strlen(error_msg));
-            }
+            int stored = upload_store_buffer(content, content_len, upload_store_ext(content_type),
+                                             new_filename, sizeof(new_filename));
+            files_uploaded += upload_report(fd, filename, content_type, content_len, stored, new_filename);
         }
         
         // Free allocated memory
@@ -571,132 +684,420 @@ void handle_multipart_upload(int fd, char *body, size_t body_size, char *boundar
         current = part_end;
     }
     
-    // No files uploaded
-    if (files_uploaded == 0) {
-        char no_files_msg[] = 
-            "<p class=\"error\">No valid files were found in the upload.</p>\n"
-            "<p><a href=\"/upload\">Try again</a></p>\n";
-        write_or_die(fd, no_files_msg, strlen(no_files_msg));
-    } 
-    
-    // Close HTML
-    char html_close[] = "</body>\n</html>";
-    write_or_die(fd, html_close, strlen(html_close));
-    
-    free(end_boundary);
+    upload_page_end(fd, files_uploaded);
 }
 
-// Main request handler
-void request_handle(int fd) {
-    int is_static;
-    struct stat sbuf;
-    char buf[MAXBUF], method[MAXBUF], uri[MAXBUF], version[MAXBUF];
-    char filename[MAXBUF], cgiargs[MAXBUF];
-    char headers[MAXBUF * 8] = {0}; // Headers buffer
-    char *body = NULL;              // Body buffer (dynamically allocated)
+// Large uploads whose first part is a file skip the body buffer: after
+// the part headers the rest of the body is spliced from the socket into a
+// temporary file in uploads/, whose page cache is then mapped once to find
+// the closing boundary and compute the blob's hash. Returns 0 without
+// consuming anything if the body does not start that way.
+static int handle_multipart_splice(int fd, http_request_t *req, size_t content_length, const char *boundary) {
+    char head[MAXBUF];
+    size_t boundary_len = strlen(boundary);
+
+    // The part headers are looked at in place so that the buffered path
+    // can still take over
+    ssize_t n;
+    do {
+        n = recv(fd, head, sizeof(head) - 1, MSG_PEEK | MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+    if (n <= (ssize_t) boundary_len + 2) return 0;
+    head[n] = '\0';
+    if (memcmp(head, boundary, boundary_len) != 0 || memcmp(head + boundary_len, "\r\n", 2) != 0) return 0;
+    char *headers_end = strstr(head + boundary_len + 2, "\r\n\r\n");
+    if (!headers_end) return 0;
+    *headers_end = '\0';
+
+    char *filename, *content_type;
+    parse_part_headers(head + boundary_len + 2, &filename, &content_type);
+    if (!filename) {
+        free(content_type);
+        return 0;
+    }
+    const char *ext = upload_store_ext(content_type);
+
+    // Consume the part headers; the rest goes into the file
+    size_t head_len = headers_end + 4 - head;
+    size_t data_len = content_length - head_len;
+    char tmp_path[256];
+    create_upload_dir();
+    uint64_t t = trace_start();
+    int tmp_fd = -1;
+    if (read(fd, head, head_len) == (ssize_t) head_len) {
+        tmp_fd = upload_store_receive(fd, data_len, tmp_path, sizeof(tmp_path));
+    }
+    trace_span(TRACE_BODY, t);
+    if (tmp_fd < 0) {
+        free(filename);
+        free(content_type);
+        request_error(fd, req->method, "500", "Internal Server Error", "Failed to receive the upload");
+        return 1;
+    }
+
+    char *data = mmap(NULL, data_len, PROT_READ, MAP_PRIVATE, tmp_fd, 0);
+    char *end = data != MAP_FAILED ? scan_find(data, data_len, boundary, boundary_len) : NULL;
+    if (!end || end - data < 2 || memcmp(end - 2, "\r\n", 2) != 0 ||
+        (size_t) (end - data) + boundary_len + 2 > data_len) {
+        unlink(tmp_path);
+        request_error(fd, req->method, "400", "Bad Request", "Malformed multipart/form-data body");
+    } else if (memcmp(end + boundary_len, "--", 2) == 0) {
+        // The common case: one file and nothing after it
+        char new_filename[256];
+        size_t size = end - 2 - data;
+        int stored = upload_store_publish(tmp_fd, tmp_path, data, size, ext,
+                                          new_filename, sizeof(new_filename));
+        upload_page_begin(fd);
+        upload_page_end(fd, upload_report(fd, filename, content_type, size, stored, new_filename));
+    } else if (membudget_acquire(content_length + 1, BODY_BUDGET_WAIT_MS) < 0) {
+        unlink(tmp_path);
+        request_error_retry(fd, req->method, "503", "Service Unavailable", "Server is out of memory for request bodies", 1);
+    } else {
+        // More parts follow: reassemble the body for the general parser
+        unlink(tmp_path);
+        char *body = malloc(content_length + 1);
+        if (body) {
+            memcpy(body, head, head_len);
+            memcpy(body + head_len, data, data_len);
+            body[content_length] = '\0';
+            handle_multipart_upload(fd, body, content_length, (char *) boundary);
+            free(body);
+        } else {
+            request_error(fd, req->method, "500", "Internal Server Error", "Failed to allocate memory for request body");
+        }
+        membudget_release(content_length + 1);
+    }
+    if (data != MAP_FAILED) munmap(data, data_len);
+    close(tmp_fd);
+    free(filename);
+    free(content_type);
+    return 1;
+}
+
+// Finds a header value (case-insensitive name) in "Name: value\r\n" lines
+int request_find_header(const char *headers, const char *name, char *value, size_t size) {
+    size_t name_len = strlen(name);
+    const char *line = headers;
+    while (line && *line) {
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *v = line + name_len + 1;
+            while (*v == ' ' || *v == '\t') v++;
+            size_t len = strcspn(v, "\r\n");
+            if (len >= size) len = size - 1;
+            memcpy(value, v, len);
+            value[len] = '\0';
+            return 1;
+        }
+        line = strchr(line, '\n');
+        if (line) line++;
+    }
+    return 0;
+}
+
+// Extract Content-Type value from headers into content_type
+static void request_get_content_type(char *headers, char *content_type, size_t size) {
+    content_type[0] = '\0';
+    if (strstr(headers, "Content-Type:")) {
+        char *ct_start = strstr(headers, "Content-Type:") + 13;
+        // Skip whitespace
+        while (*ct_start == ' ' || *ct_start == '\t') ct_start++;
+        
+        char *ct_end = strstr(ct_start, "\r\n");
+        if (ct_end) {
+            size_t ct_len = ct_end - ct_start;
+            if (ct_len < size - 1) {
+                memcpy(content_type, ct_start, ct_len);
+                content_type[ct_len] = '\0';
+            }
+        }
+    }
+}
+
+//
+// Routes
+//
+
+static void route_upload_form(int fd, http_request_t *req, route_match_t *match, void *ctx) {
+    (void) req; (void) match; (void) ctx;
+    serve_upload_form(fd);
+}
+
+// GET /thumb/<blob_name>
+static void route_thumbnail(int fd, http_request_t *req, route_match_t *match, void *ctx) {
+    char name[MAXBUF];
+    (void) req; (void) ctx;
+    snprintf(name, sizeof(name), "%.*s", (int) match->param_len[0], match->params[0]);
+    thumbnail_serve(fd, name);
+}
+
+static void route_static(int fd, http_request_t *req, route_match_t *match, void *ctx) {
+    char filename[MAXBUF];
+    (void) match; (void) ctx;
+
+    // Metadata comes from the docroot index: no syscall until open()
+    docroot_entry_t entry;
+    uint64_t t = trace_start();
+    int found = docroot_lookup(req->uri, filename, sizeof(filename), &entry);
+    trace_span(TRACE_LOOKUP, t);
+    if (found == DOCROOT_INVALID) {
+        request_error(fd, req->uri, "403", "Forbidden", "Path is outside of the document root");
+        return;
+    }
+    if (found == DOCROOT_MISSING) {
+        request_error(fd, filename, "404", "Not found", "Server could not find this file");
+        return;
+    }
+    if (!(S_ISREG(entry.mode)) || !(S_IRUSR & entry.mode)) {
+        request_error(fd, filename, "403", "Forbidden", "Server could not read this file");
+        return;
+    }
+    // A bundled gzip variant has its own ETag: match the one that would be sent
+    int gzip_ok = request_accepts_gzip(req);
+    char variant_etag[64];
+    const char *etag = bundle_etag(filename, gzip_ok, variant_etag, sizeof(variant_etag));
+    if (request_not_modified(fd, req, etag ? etag : entry.etag)) return;
+    request_serve_file(fd, filename, entry.size, entry.mime, entry.etag, gzip_ok);
+}
+
+static void route_cgi(int fd, http_request_t *req, route_match_t *match, void *ctx) {
+    (void) match; (void) ctx;
+    cgi_serve(fd, req);
+}
+
+// POST /upload: multipart/form-data with files
+static void route_upload(int fd, http_request_t *req, route_match_t *match, void *ctx) {
+    char content_type[256];
+    (void) match; (void) ctx;
+
+    request_get_content_type(req->headers, content_type, sizeof(content_type));
+    if (!strstr(content_type, "multipart/form-data")) {
+        request_error(fd, "POST", "400", "Bad Request", "File uploads must use multipart/form-data");
+        return;
+    }
+    char *boundary = get_boundary(content_type);
+    if (!boundary) {
+        request_error(fd, "POST", "400", "Bad Request", "Missing or invalid boundary in multipart/form-data");
+        return;
+    }
+    handle_multipart_upload(fd, req->body ? req->body : "", req->body_len, boundary);
+    free(boundary);
+}
+
+// POST anywhere else: a standard form submission
+static void route_form(int fd, http_request_t *req, route_match_t *match, void *ctx) {
+    char content_type[256];
+    (void) match; (void) ctx;
+
+    request_get_content_type(req->headers, content_type, sizeof(content_type));
+    if (strstr(content_type, "application/x-www-form-urlencoded")) {
+        request_handle_post(fd, req->headers, req->body ? req->body : "", req->body_len);
+    } else {
+        request_error(fd, content_type, "415", "Unsupported Media Type", "Content type not supported");
+    }
+}
+
+// Built-in routes; modules with endpoints of their own add theirs alongside
+void request_init(void) {
+    request_compile_templates();
+    router_add("GET", "/upload", ROUTE_EXACT, route_upload_form, NULL);
+    router_add("POST", "/upload", ROUTE_EXACT, route_upload, NULL);
+    router_add("GET", THUMB_URI_PREFIX "*", ROUTE_EXACT, route_thumbnail, NULL);
+    router_add("GET", "/cgi/", ROUTE_PREFIX, route_cgi, NULL);
+    router_add("GET", "/cgi-bin/", ROUTE_PREFIX, route_cgi, NULL);
+    router_add("POST", "/cgi/", ROUTE_PREFIX, route_cgi, NULL);
+    router_add("POST", "/cgi-bin/", ROUTE_PREFIX, route_cgi, NULL);
+    router_add("GET", "/", ROUTE_PREFIX, route_static, NULL);
+    router_add("POST", "/", ROUTE_PREFIX, route_form, NULL);
+}
+
+// Protocol-independent request handling: everything after the request has
+// been read off the wire. HTTP/1.x and HTTP/2 both end up here.
+void request_dispatch(int fd, http_request_t *req) {
+    route_handler_t handler;
+    route_match_t match;
+    void *ctx;
+    uint64_t t = trace_start();
+
+    // Proxied prefixes take precedence over local content
+    if (proxy_serve(fd, req, -1)) {
+        trace_span(TRACE_PROXY, t);
+        return;
+    }
+
+    switch (router_lookup(req->method, req->uri, &handler, &ctx, &match)) {
+    case ROUTER_FOUND:
+        handler(fd, req, &match, ctx);
+        break;
+    case ROUTER_NO_METHOD:
+        request_error(fd, req->method, "501", "Not Implemented", "Server does not implement this method");
+        break;
+    default:
+        request_error(fd, req->uri, "404", "Not found", "Server could not find this file");
+    }
+    trace_span(TRACE_DISPATCH, t);
+}
+
+// Sends "100 Continue" to an HTTP/1.1 client waiting for it before the body
+void request_expect_continue(int fd, http_request_t *req) {
+    char expect[64];
+    if (req->body_fd < 0 && req->body) return; // the body has been read already
+    if (strcmp(req->version, "HTTP/1.1") == 0 &&
+        request_find_header(req->headers, "Expect", expect, sizeof(expect)) &&
+        strcasecmp(expect, "100-continue") == 0) {
+        write_or_die(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+    }
+}
+
+// POST /upload over HTTP/1.x, where the body may bypass the buffer
+static int request_is_upload(http_request_t *req) {
+    return strncmp(req->uri, "/upload", 7) == 0 && (req->uri[7] == '\0' || req->uri[7] == '?') &&
+           !http2_is_upgrade(req);
+}
+
+// Copies the next token of a request line (cut to size), like "%s" would
+static void request_line_token(const char **p, char *dst, size_t size) {
+    *p += strspn(*p, " \t\r\n");
+    size_t n = strcspn(*p, " \t\r\n");
+    snprintf(dst, size, "%.*s", (int) n, *p);
+    *p += n;
+}
+
+static void request_handle_one(int fd, conn_t *conn) {
+    // Buffers come with the pooled connection object, not from the stack
+    char *buf = conn->line;
+    char *headers = conn->headers;
+    http_request_t *req = &conn->req;
+    uint32_t client_ip = conn->client_ip;
+    int retry_after;
+    size_t reserved = 0;
 
     // Read first line of request
+    uint64_t t = trace_start();
     readline_or_die(fd, buf, MAXBUF);
-    sscanf(buf, "%s %s %s", method, uri, version);
-    printf("method:%s uri:%s version:%s\n", method, uri, version);
+    const char *p = buf;
+    request_line_token(&p, req->method, sizeof(req->method));
+    request_line_token(&p, req->uri, sizeof(req->uri));
+    request_line_token(&p, req->version, sizeof(req->version));
+    printf("method:%s uri:%s version:%s\n", req->method, req->uri, req->version);
+    req->client_ip = client_ip;
+    trace_span(TRACE_READ_LINE, t);
+    trace_request(req->method, req->uri);
+
+    // Per-client limits are decided before headers or body are looked at
+    if (ratelimit_enabled() && !http2_is_preface(req) &&
+        !ratelimit_request(client_ip, req->uri, &retry_after)) {
+        request_read_headers(fd);
+        request_error_retry(fd, req->uri, "429", "Too Many Requests", "Request rate limit exceeded", retry_after);
+        return;
+    }
 
     // Read all headers
-    request_parse_headers(fd, headers, sizeof(headers));
+    t = trace_start();
+    size_t headers_len = request_parse_headers(fd, headers, CONNPOOL_HEADERS_SIZE);
+    if (headers_len > conn->headers_used) conn->headers_used = headers_len;
+    req->headers = headers;
+    req->body = NULL;              // Body buffer (dynamically allocated)
+    req->body_len = 0;
+    req->body_fd = -1;
+    trace_span(TRACE_HEADERS, t);
 
-    // Handle upload form request
-    if (strcasecmp(method, "GET") == 0 && strcmp(uri, "/upload") == 0) {
-        serve_upload_form(fd);
+    // HTTP/2 with prior knowledge: the preface starts like a request line.
+    // Its streams are traced as requests of their own.
+    if (http2_is_preface(req)) {
+        trace_end();
+        http2_serve(fd, client_ip, NULL);
         return;
     }
 
-    // Handle based on request method
-    if (strcasecmp(method, "GET") == 0) {
-        // Handle GET request
-        is_static = request_parse_uri(uri, filename, cgiargs);
-        if (stat(filename, &sbuf) < 0) {
-            request_error(fd, filename, "404", "Not found", "Server could not find this file");
+    // Proxied requests stream their body straight from the socket
+    t = trace_start();
+    if (!http2_is_upgrade(req) && proxy_serve(fd, req, fd)) {
+        trace_span(TRACE_PROXY, t);
+        return;
+    }
+
+    if (strcasecmp(req->method, "POST") == 0) {
+        // Get Content-Length; an explicit 0 is an empty body
+        char value[32];
+        int content_length = get_content_length(headers);
+        if (content_length < 0 || (content_length == 0 && !request_find_header(headers, "Content-Length", value, sizeof(value)))) {
+            request_error(fd, req->method, "411", "Length Required", "Content-Length header is required for POST requests");
             return;
         }
-        
-        if (is_static) {
-            if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-                request_error(fd, filename, "403", "Forbidden", "Server could not read this file");
-                return;
+
+        // Refuse before the body is sent: a client that asked with
+        // "Expect: 100-continue" gets the verdict without uploading
+        char expect[64] = "";
+        request_find_header(headers, "Expect", expect, sizeof(expect));
+        if (expect[0] && strcasecmp(expect, "100-continue") != 0) {
+            request_error(fd, expect, "417", "Expectation Failed", "Only 100-continue is supported");
+            return;
+        }
+        if (content_length > MAX_BODY_SIZE) {
+            request_error(fd, req->method, "413", "Payload Too Large", "Request body is too large");
+            return;
+        }
+        int continued = 0;
+        if (content_length >= SPLICE_MIN_BODY && request_is_upload(req)) {
+            char content_type[256];
+            request_get_content_type(headers, content_type, sizeof(content_type));
+            char *boundary = strstr(content_type, "multipart/form-data") ? get_boundary(content_type) : NULL;
+            if (boundary) {
+                request_expect_continue(fd, req);
+                continued = 1;
+                int done = handle_multipart_splice(fd, req, content_length, boundary);
+                free(boundary);
+                if (done) return;
             }
-            request_serve_static(fd, filename, sbuf.st_size);
-        } else {
-            // Handle dynamic content if needed
-            request_error(fd, uri, "501", "Not Implemented", "CGI not implemented");
         }
-    } 
-    else if (strcasecmp(method, "POST") == 0) {
-        // Get Content-Length
-        int content_length = get_content_length(headers);
-        if (content_length <= 0) {
-            request_error(fd, method, "411", "Length Required", "Content-Length header is required for POST requests");
+        if (membudget_acquire(content_length + 1, BODY_BUDGET_WAIT_MS) < 0) {
+            request_error_retry(fd, req->method, "503", "Service Unavailable", "Server is out of memory for request bodies", 1);
             return;
         }
-        
+        reserved = content_length + 1;
+        if (!continued) request_expect_continue(fd, req);
+
         // Allocate memory for body
-        body = malloc(content_length + 1);
-        if (!body) {
-            request_error(fd, method, "500", "Internal Server Error", "Failed to allocate memory for request body");
+        req->body = malloc(content_length + 1);
+        if (!req->body) {
+            membudget_release(reserved);
+            request_error(fd, req->method, "500", "Internal Server Error", "Failed to allocate memory for request body");
             return;
         }
         
         // Read body
-        int body_len = 0;
+        t = trace_start();
         int bytes_remaining = content_length;
         while (bytes_remaining > 0) {
-            int n = read(fd, body + body_len, bytes_remaining);
+            int n = read(fd, req->body + req->body_len, bytes_remaining);
             if (n <= 0) break;
-            body_len += n;
+            req->body_len += n;
             bytes_remaining -= n;
         }
-        body[body_len] = '\0';
-        
-        // Extract Content-Type
-        char content_type[256] = {0};
-        if (strstr(headers, "Content-Type:")) {
-            char *ct_start = strstr(headers, "Content-Type:") + 13;
-            // Skip whitespace
-            while (*ct_start == ' ' || *ct_start == '\t') ct_start++;
-            
-            char *ct_end = strstr(ct_start, "\r\n");
-            if (ct_end) {
-                size_t ct_len = ct_end - ct_start;
-                if (ct_len < sizeof(content_type) - 1) {
-                    memcpy(content_type, ct_start, ct_len);
-                    content_type[ct_len] = '\0';
-                }
-            }
-        }
-        
-        // Process upload form submission
-        if (strcmp(uri, "/upload") == 0) {
-            if (strstr(content_type, "multipart/form-data")) {
-                char *boundary = get_boundary(content_type);
-                if (boundary) {
-                    handle_multipart_upload(fd, body, body_len, boundary);
-                    free(boundary);
-                } else {
-                    request_error(fd, "POST", "400", "Bad Request", "Missing or invalid boundary in multipart/form-data");
-                }
-            } else {
-                request_error(fd, "POST", "400", "Bad Request", "File uploads must use multipart/form-data");
-            }
-        }
-        else if (strstr(content_type, "application/x-www-form-urlencoded")) {
-            // Handle standard form submission
-            request_handle_post(fd, headers, body, body_len);
-        }
-        else {
-            request_error(fd, content_type, "415", "Unsupported Media Type", "Content type not supported");
-        }
-        
-        free(body);
+        req->body[req->body_len] = '\0';
+        trace_span(TRACE_BODY, t);
     }
-    else {
-        request_error(fd, method, "501", "Not Implemented", "Server does not implement this method");
+
+    // PUT and PATCH bodies are left on the socket for their handler to stream
+    if ((strcasecmp(req->method, "PUT") == 0 || strcasecmp(req->method, "PATCH") == 0) && !http2_is_upgrade(req)) {
+        req->body_fd = fd;
     }
-}
\ No newline at end of file
+
+    // "Upgrade: h2c" turns this request into stream 1 of an HTTP/2 connection
+    if (http2_is_upgrade(req)) {
+        trace_end();
+        http2_serve(fd, client_ip, req);
+    } else {
+        request_dispatch(fd, req);
+    }
+
+    free(req->body);
+    membudget_release(reserved);
+}
+
+// Main request handler
+void request_handle(int fd, conn_t *conn) {
+    trace_begin();
+    request_handle_one(fd, conn);
+    trace_end();
+}
@@ -8,6 +8,25 @@
 #include <uuid/uuid.h>
 #include <errno.h>
 #include <ctype.h>
+#include <stdint.h>
+
+#define MAXBUF (8192)
+#define MAXTOKEN (32) // method and protocol version
+#define MAX_FILE_SIZE (10 * 1024 * 1024) // 10MB
+#define MAX_BODY_SIZE (MAX_FILE_SIZE + MAXBUF) // room for multipart framing
+
+// A request as read off the wire, independent of the protocol (HTTP/1.x or
+// HTTP/2) that carried it
+typedef struct {
+    char method[MAXTOKEN];
+    char version[MAXTOKEN];
+    char uri[MAXBUF];
+    char *headers;  // "Name: value\r\n" lines
+    char *body;     // NULL if the request has no body
+    int body_len;
+    int body_fd;    // socket a streamed body (PUT/PATCH) is still to be read from, or -1
+    uint32_t client_ip; // IPv4 address of the peer, network byte order
+} http_request_t;
 
 // Structure for POST parameters
 typedef struct {
@@ -26,21 +45,27 @@ typedef struct {
 
 // Function declarations
 void request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
+void request_error_retry(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg, int retry_after);
 void request_read_headers(int fd);
 int request_parse_uri(char *uri, char *filename, char *cgiargs);
-void request_get_filetype(char *filename, char *filetype);
 void request_serve_static(int fd, char *filename, int filesize);
 void url_decode(char *dst, const char *src);
 post_param_t* parse_post_data(const char *data, int *num_params);
 void free_post_params(post_param_t *params, int num_params);
 void request_handle_post(int fd, char* headers, char *body, int body_len);
 int get_content_length(char *headers);
-void request_parse_headers(int fd, char *headers, size_t headers_size);
+size_t request_parse_headers(int fd, char *headers, size_t headers_size);
 int request_parse_body(int fd, char *headers, char *body, size_t body_size);
 void create_upload_dir();
 void generate_filename(char *buffer, const char *ext);
 void serve_upload_form(int fd);
 char* get_boundary(char *content_type);
+void normalize_content_type(char *content_type);
 void handle_multipart_upload(int fd, char *body, size_t body_size, char *boundary);
-void request_handle(int fd);
+int request_find_header(const char *headers, const char *name, char *value, size_t size);
+void request_expect_continue(int fd, http_request_t *req);
+void request_init(void);
+void request_dispatch(int fd, http_request_t *req);
+struct conn;
+void request_handle(int fd, struct conn *conn);
 #endif // __REQUEST_H__
\ No newline at end of file
@@ -0,0 +1,548 @@
+#include "io_helper.h"
+#include "request.h"
+#include "router.h"
+#include "upload_store.h"
+#include "thumbnail.h"
+#include "manifest.h"
+#include "membudget.h"
+#include "trace.h"
+#include "resumable.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+
+#define UPLOAD_DIR "uploads"
+#define SESSION_DIR "uploads/.sessions"
+#define SESSION_MAGIC 0x31535557 // "WUS1"
+#define SESSION_ID_LEN 36        // a UUID
+#define SESSION_MAX_RANGES 64    // missing ranges listed per status reply
+#define SESSION_SWEEP_EVERY 3600
+#define BLOCK_BUDGET_WAIT_MS 2000
+
+// Head of the .state file, followed by one bit per block
+typedef struct {
+    uint32_t magic;
+    uint32_t block_size;
+    uint64_t length;
+    char filename[112];
+    char mime[48];
+} state_header_t;
+
+typedef struct session {
+    char id[SESSION_ID_LEN + 1];
+    int part_fd, state_fd;
+    state_header_t head;
+    uint32_t num_blocks;
+    uint32_t blocks_done;
+    uint8_t *bitmap;
+    int refs;                   // handlers using it
+    int writers;                // chunks being written
+    int finalizing;
+    int dead;                   // finalized or deleted, freed with the last ref
+    struct session *next;
+} session_t;
+
+// Protects the list and every session's counters and bitmap
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static session_t *sessions = NULL;
+static time_t last_sweep = 0;
+
+static void session_path(char *path, size_t size, const char *id, const char *suffix) {
+    snprintf(path, size, "%s/%s.%s", SESSION_DIR, id, suffix);
+}
+
+static int valid_id(const char *id, size_t len) {
+    if (len != SESSION_ID_LEN) return 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!isxdigit((unsigned char) id[i]) && id[i] != '-') return 0;
+    }
+    return 1;
+}
+
+static void session_free(session_t *s) {
+    close(s->part_fd);
+    close(s->state_fd);
+    free(s->bitmap);
+    free(s);
+}
+
+// Unlinks a session from the list and from disk; caller holds sessions_lock
+static void session_remove_locked(session_t *s) {
+    char path[MAXBUF];
+    for (session_t **p = &sessions; *p; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            break;
+        }
+    }
+    session_path(path, sizeof(path), s->id, "part");
+    unlink(path);
+    session_path(path, sizeof(path), s->id, "state");
+    unlink(path);
+    s->dead = 1;
+    if (s->refs == 0) session_free(s);
+}
+
+// Reads a session persisted by an earlier run; caller holds sessions_lock
+static session_t *session_load(const char *id) {
+    char path[MAXBUF];
+    session_t *s = calloc(1, sizeof(session_t));
+    if (!s) return NULL;
+    snprintf(s->id, sizeof(s->id), "%s", id);
+    s->part_fd = s->state_fd = -1;
+
+    session_path(path, sizeof(path), id, "state");
+    s->state_fd = open(path, O_RDWR | O_CLOEXEC);
+    if (s->state_fd < 0 || pread(s->state_fd, &s->head, sizeof(s->head), 0) != sizeof(s->head) ||
+        s->head.magic != SESSION_MAGIC || s->head.block_size != RESUMABLE_BLOCK ||
+        s->head.length == 0 || s->head.length > RESUMABLE_MAX_LENGTH) {
+        goto fail;
+    }
+    s->num_blocks = (s->head.length + RESUMABLE_BLOCK - 1) / RESUMABLE_BLOCK;
+    size_t bitmap_len = (s->num_blocks + 7) / 8;
+    s->bitmap = calloc(1, bitmap_len);
+    if (!s->bitmap || pread(s->state_fd, s->bitmap, bitmap_len, sizeof(s->head)) != (ssize_t) bitmap_len) {
+        goto fail;
+    }
+    for (uint32_t b = 0; b < s->num_blocks; b++) {
+        if (s->bitmap[b / 8] & (1 << (b % 8))) s->blocks_done++;
+    }
+
+    session_path(path, sizeof(path), id, "part");
+    s->part_fd = open(path, O_RDWR | O_CLOEXEC);
+    if (s->part_fd < 0) goto fail;
+
+    s->next = sessions;
+    sessions = s;
+    return s;
+
+fail:
+    if (s->state_fd >= 0) close(s->state_fd);
+    free(s->bitmap);
+    free(s);
+    return NULL;
+}
+
+// Takes a reference on the session named by the route's '*', or replies 404
+static session_t *session_get(int fd, http_request_t *req, route_match_t *match) {
+    char id[SESSION_ID_LEN + 1];
+    session_t *s = NULL;
+
+    if (match->num_params == 1 && valid_id(match->params[0], match->param_len[0])) {
+        memcpy(id, match->params[0], SESSION_ID_LEN);
+        id[SESSION_ID_LEN] = '\0';
+        pthread_mutex_lock(&sessions_lock);
+        for (s = sessions; s && strcmp(s->id, id) != 0; s = s->next);
+        if (!s) s = session_load(id);
+        if (s) s->refs++;
+        pthread_mutex_unlock(&sessions_lock);
+    }
+    if (!s) request_error(fd, req->uri, "404", "Not found", "No such upload session");
+    return s;
+}
+
+static void session_put(session_t *s) {
+    pthread_mutex_lock(&sessions_lock);
+    if (--s->refs == 0 && s->dead) session_free(s);
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+// Records a block as written, in memory and in the state file
+static void session_mark(session_t *s, uint32_t block) {
+    uint8_t bit = 1 << (block % 8);
+    pthread_mutex_lock(&sessions_lock);
+    if (!(s->bitmap[block / 8] & bit)) {
+        s->bitmap[block / 8] |= bit;
+        s->blocks_done++;
+        if (pwrite(s->state_fd, &s->bitmap[block / 8], 1, sizeof(s->head) + block / 8) != 1) {
+            fprintf(stderr, "upload session %s: cannot persist block %u: %s\n", s->id, block, strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+static uint64_t block_len(session_t *s, uint32_t block) {
+    uint64_t start = (uint64_t) block * RESUMABLE_BLOCK;
+    return s->head.length - start < RESUMABLE_BLOCK ? s->head.length - start : RESUMABLE_BLOCK;
+}
+
+// Removes sessions idle for longer than RESUMABLE_TTL
+static void session_sweep(void) {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&sessions_lock);
+    if (now - last_sweep < SESSION_SWEEP_EVERY) {
+        pthread_mutex_unlock(&sessions_lock);
+        return;
+    }
+    last_sweep = now;
+
+    DIR *d = opendir(SESSION_DIR);
+    struct dirent *de;
+    while (d && (de = readdir(d)) != NULL) {
+        struct stat st;
+        char *dot = strrchr(de->d_name, '.');
+        if (!dot || strcmp(dot, ".state") != 0 || !valid_id(de->d_name, dot - de->d_name)) continue;
+        if (fstatat(dirfd(d), de->d_name, &st, 0) < 0 || now - st.st_mtime < RESUMABLE_TTL) continue;
+
+        char id[SESSION_ID_LEN + 1], path[MAXBUF];
+        memcpy(id, de->d_name, SESSION_ID_LEN);
+        id[SESSION_ID_LEN] = '\0';
+        session_t *s;
+        for (s = sessions; s && strcmp(s->id, id) != 0; s = s->next);
+        if (s && s->refs > 0) continue;
+        if (s) {
+            session_remove_locked(s);
+        } else {
+            session_path(path, sizeof(path), id, "part");
+            unlink(path);
+            session_path(path, sizeof(path), id, "state");
+            unlink(path);
+        }
+    }
+    if (d) closedir(d);
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+static void reply(int fd, const char *status, const char *extra, const char *json) {
+    char buf[MAXBUF];
+    size_t len = json ? strlen(json) : 0;
+    snprintf(buf, sizeof(buf), ""
+        "HTTP/1.0 %s\r\n"
+        "Server: Webserver C\r\n"
+        "Content-Type: application/json\r\n"
+        "Cache-Control: no-store\r\n"
+        "%s"
+        "Content-Length: %zu\r\n\r\n", status, extra, len);
+    write_or_die(fd, buf, strlen(buf));
+    if (len) write_or_die(fd, json, len);
+}
+
+// Progress of a session: what has arrived and which byte ranges are missing
+static void reply_status(int fd, session_t *s, const char *status, const char *location) {
+    char json[MAXBUF], extra[MAXBUF];
+    uint64_t received = 0, first_missing = s->head.length;
+    int n, ranges = 0;
+
+    pthread_mutex_lock(&sessions_lock);
+    n = snprintf(json, sizeof(json), "{\"id\":\"%s\",\"length\":%lu,\"block_size\":%d,\"missing\":[",
+                 s->id, (unsigned long) s->head.length, RESUMABLE_BLOCK);
+    for (uint32_t b = 0; b < s->num_blocks; ) {
+        if (s->bitmap[b / 8] & (1 << (b % 8))) {
+            received += block_len(s, b++);
+            continue;
+        }
+        uint32_t end = b;
+        while (end < s->num_blocks && !(s->bitmap[end / 8] & (1 << (end % 8)))) end++;
+        uint64_t from = (uint64_t) b * RESUMABLE_BLOCK;
+        uint64_t to = end == s->num_blocks ? s->head.length : (uint64_t) end * RESUMABLE_BLOCK;
+        if (first_missing == s->head.length) first_missing = from;
+        if (ranges++ < SESSION_MAX_RANGES) {
+            n += snprintf(json + n, sizeof(json) - n, "%s[%lu,%lu]", ranges > 1 ? "," : "",
+                          (unsigned long) from, (unsigned long) to);
+        }
+        b = end;
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    snprintf(json + n, sizeof(json) - n, "],\"received\":%lu,\"offset\":%lu,\"complete\":%s}\n",
+             (unsigned long) received, (unsigned long) first_missing,
+             received == s->head.length ? "true" : "false");
+    snprintf(extra, sizeof(extra), "%s%sUpload-Offset: %lu\r\n",
+             location ? location : "", location ? "\r\n" : "", (unsigned long) first_missing);
+    reply(fd, status, extra, json);
+}
+
+// POST /upload/sessions
+static void route_create(int fd, http_request_t *req, route_match_t *match, void *ctx) {
+    char value[MAXBUF], id[SESSION_ID_LEN + 1], path[MAXBUF], location[128];
+    char *end;
+    uuid_t uuid;
+    session_t *s;
+    (void) match; (void) ctx;
+
+    if (!request_find_header(req->headers, "Upload-Length", value, sizeof(value))) {
+        request_error(fd, req->uri, "400", "Bad Request", "Upload-Length is required");
+        return;
+    }
+    uint64_t length = strtoull(value, &end, 10);
+    if (end == value || *end || length == 0) {
+        request_error(fd, value, "400", "Bad Request", "Invalid Upload-Length");
+        return;
+    }
+    if (length > RESUMABLE_MAX_LENGTH) {
+        request_error(fd, value, "413", "Payload Too Large", "Upload is too large");
+        return;
+    }
+    session_sweep();
+
+    s = calloc(1, sizeof(session_t));
+    if (s) {
+        s->num_blocks = (length + RESUMABLE_BLOCK - 1) / RESUMABLE_BLOCK;
+        s->bitmap = calloc(1, (s->num_blocks + 7) / 8);
+        s->part_fd = s->state_fd = -1;
+    }
+    if (!s || !s->bitmap) {
+        if (s) free(s);
+        request_error(fd, req->uri, "500", "Internal Server Error", "Out of memory");
+        return;
+    }
+    s->head.magic = SESSION_MAGIC;
+    s->head.block_size = RESUMABLE_BLOCK;
+    s->head.length = length;
+    if (request_find_header(req->headers, "Upload-Filename", value, sizeof(value))) {
+        url_decode(value, value);
+        snprintf(s->head.filename, sizeof(s->head.filename), "%.*s", (int) sizeof(s->head.filename) - 1, value);
+    }
+    if (request_find_header(req->headers, "Upload-Type", value, sizeof(value))) {
+        normalize_content_type(value);
+        snprintf(s->head.mime, sizeof(s->head.mime), "%.*s", (int) sizeof(s->head.mime) - 1, value);
+    }
+
+    uuid_generate_random(uuid);
+    uuid_unparse_lower(uuid, id);
+    snprintf(s->id, sizeof(s->id), "%s", id);
+    create_upload_dir();
+    mkdir(SESSION_DIR, 0755);
+
+    // Reserve the whole file now: chunks never fail halfway for lack of
+    // space, and writes at any offset land in allocated blocks
+    session_path(path, sizeof(path), id, "part");
+    s->part_fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    int err = s->part_fd < 0 ? errno : posix_fallocate(s->part_fd, 0, length);
+    if (!err) {
+        session_path(path, sizeof(path), id, "state");
+        s->state_fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        size_t bitmap_len = (s->num_blocks + 7) / 8;
+        if (s->state_fd < 0 || write(s->state_fd, &s->head, sizeof(s->head)) != sizeof(s->head) ||
+            write(s->state_fd, s->bitmap, bitmap_len) != (ssize_t) bitmap_len) {
+            err = errno ? errno : EIO;
+        }
+    }
+    if (err) {
+        session_path(path, sizeof(path), id, "part");
+        unlink(path);
+        session_path(path, sizeof(path), id, "state");
+        unlink(path);
+        if (s->part_fd >= 0) close(s->part_fd);
+        if (s->state_fd >= 0) close(s->state_fd);
+        free(s->bitmap);
+        free(s);
+        if (err == ENOSPC) request_error(fd, req->uri, "507", "Insufficient Storage", "Not enough space for this upload");
+        else request_error(fd, req->uri, "500", "Internal Server Error", strerror(err));
+        return;
+    }
+
+    pthread_mutex_lock(&sessions_lock);
+    s->next = sessions;
+    sessions = s;
+    s->refs = 1;
+    pthread_mutex_unlock(&sessions_lock);
+
+    snprintf(location, sizeof(location), "Location: /upload/sessions/%s", id);
+    reply_status(fd, s, "201 Created", location);
+    session_put(s);
+}
+
+// Reads exactly len bytes of a streamed body
+static int read_full(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// PUT or PATCH /upload/sessions/<id>
+static void route_chunk(int fd, http_request_t *req, route_match_t *match, void *ctx) {
+    char value[32], *end;
+    (void) ctx;
+
+    session_t *s = session_get(fd, req, match);
+    if (!s) return;
+
+    uint64_t offset = 0, len = req->body ? req->body_len : 0;
+    if (!request_find_header(req->headers, "Upload-Offset", value, sizeof(value)) ||
+        (offset = strtoull(value, &end, 10), end == value || *end)) {
+        request_error(fd, req->uri, "400", "Bad Request", "Upload-Offset is required");
+        goto out;
+    }
+    if (req->body_fd >= 0) {
+        if (!request_find_header(req->headers, "Content-Length", value, sizeof(value))) {
+            request_error(fd, req->method, "411", "Length Required", "Content-Length header is required");
+            goto out;
+        }
+        len = strtoull(value, NULL, 10);
+    }
+    if (offset % RESUMABLE_BLOCK || offset > s->head.length || len > s->head.length - offset) {
+        request_error(fd, req->uri, "416", "Range Not Satisfiable", "Chunk lies outside the upload");
+        goto out;
+    }
+    if (len % RESUMABLE_BLOCK && offset + len != s->head.length) {
+        request_error(fd, req->uri, "400", "Bad Request", "Chunks must cover whole blocks");
+        goto out;
+    }
+
+    pthread_mutex_lock(&sessions_lock);
+    int finalizing = s->finalizing;
+    if (!finalizing) s->writers++;
+    pthread_mutex_unlock(&sessions_lock);
+    if (finalizing) {
+        request_error(fd, req->uri, "409", "Conflict", "Upload is being finalized");
+        goto out;
+    }
+
+    // A streamed chunk goes through one block-sized buffer
+    char *buf = NULL;
+    if (req->body_fd >= 0 && len > 0) {
+        if (membudget_acquire(RESUMABLE_BLOCK, BLOCK_BUDGET_WAIT_MS) == 0) {
+            buf = malloc(RESUMABLE_BLOCK);
+            if (!buf) membudget_release(RESUMABLE_BLOCK);
+        }
+        if (!buf) {
+            request_error_retry(fd, req->method, "503", "Service Unavailable", "Server is out of memory for request bodies", 1);
+            goto done;
+        }
+        request_expect_continue(fd, req);
+    }
+
+    // Every block is recorded as soon as it is on disk, so a connection
+    // dropped halfway keeps what it delivered
+    uint64_t t = trace_start();
+    int failed = 0;
+    for (uint64_t done = 0; done < len && !failed; ) {
+        size_t n = len - done < RESUMABLE_BLOCK ? len - done : RESUMABLE_BLOCK;
+        if (buf && read_full(req->body_fd, buf, n) < 0) {
+            failed = 1; // the client is gone
+            break;
+        }
+        const char *data = buf ? buf : req->body + done;
+        if (pwrite_full(s->part_fd, data, n, offset + done) < 0) {
+            failed = 2;
+            break;
+        }
+        session_mark(s, (offset + done) / RESUMABLE_BLOCK);
+        done += n;
+    }
+    trace_span(TRACE_UPLOAD_WRITE, t);
+    if (buf) {
+        free(buf);
+        membudget_release(RESUMABLE_BLOCK);
+    }
+
+    if (failed == 2) {
+        request_error(fd, req->uri, "500", "Internal Server Error", "Failed to write the chunk");
+    } else if (!failed) {
+        reply_status(fd, s, "200 OK", NULL);
+    }
+
+done:
+    pthread_mutex_lock(&sessions_lock);
+    s->writers--;
+    pthread_mutex_unlock(&sessions_lock);
+out:
+    session_put(s);
+}
+
+// GET /upload/sessions/<id>
+static void route_status(int fd, http_request_t *req, route_match_t *match, void *ctx) {
+    (void) ctx;
+    session_t *s = session_get(fd, req, match);
+    if (!s) return;
+    reply_status(fd, s, "200 OK", NULL);
+    session_put(s);
+}
+
+// POST /upload/sessions/<id>: hash the assembled file and link it in as a blob
+static void route_finalize(int fd, http_request_t *req, route_match_t *match, void *ctx) {
+    char path[MAXBUF], blob_path[256], json[MAXBUF];
+    (void) ctx;
+
+    session_t *s = session_get(fd, req, match);
+    if (!s) return;
+
+    pthread_mutex_lock(&sessions_lock);
+    int ready = s->blocks_done == s->num_blocks && s->writers == 0 && !s->finalizing;
+    if (ready) s->finalizing = 1;
+    pthread_mutex_unlock(&sessions_lock);
+    if (!ready) {
+        reply_status(fd, s, "409 Conflict", NULL);
+        session_put(s);
+        return;
+    }
+
+    char *data = mmap(NULL, s->head.length, PROT_READ, MAP_SHARED, s->part_fd, 0);
+    if (data == MAP_FAILED) {
+        pthread_mutex_lock(&sessions_lock);
+        s->finalizing = 0;
+        pthread_mutex_unlock(&sessions_lock);
+        request_error(fd, req->uri, "500", "Internal Server Error", "Failed to read the upload");
+        session_put(s);
+        return;
+    }
+    session_path(path, sizeof(path), s->id, "part");
+    const char *mime = s->head.mime[0] ? s->head.mime : NULL;
+    int stored = upload_store_publish(s->part_fd, path, data, s->head.length, upload_store_ext(mime),
+                                      blob_path, sizeof(blob_path));
+    munmap(data, s->head.length);
+
+    // Published or not, the part file is gone now
+    pthread_mutex_lock(&sessions_lock);
+    session_remove_locked(s);
+    pthread_mutex_unlock(&sessions_lock);
+
+    if (stored == UPLOAD_STORE_ERROR) {
+        request_error(fd, req->uri, "500", "Internal Server Error", "Failed to store the upload");
+    } else {
+        const char *blob_name = blob_path + strlen(UPLOAD_DIR) + 1;
+        if (stored == UPLOAD_STORE_NEW) {
+            manifest_append(blob_name, s->head.filename[0] ? s->head.filename : blob_name,
+                            s->head.length, mime);
+        }
+        thumbnail_enqueue(blob_name);
+        snprintf(json, sizeof(json), "{\"url\":\"/%s\",\"sha256\":\"%.64s\",\"length\":%lu,\"duplicate\":%s}\n",
+                 blob_path, blob_name, (unsigned long) s->head.length,
+                 stored == UPLOAD_STORE_DUP ? "true" : "false");
+        reply(fd, stored == UPLOAD_STORE_NEW ? "201 Created" : "200 OK", "", json);
+    }
+    session_put(s);
+}
+
+// DELETE /upload/sessions/<id>
+static void route_delete(int fd, http_request_t *req, route_match_t *match, void *ctx) {
+    (void) ctx;
+    session_t *s = session_get(fd, req, match);
+    if (!s) return;
+
+    pthread_mutex_lock(&sessions_lock);
+    int busy = s->finalizing || s->writers > 0;
+    if (!busy) session_remove_locked(s);
+    pthread_mutex_unlock(&sessions_lock);
+    if (busy) request_error(fd, req->uri, "409", "Conflict", "Upload is in use");
+    else reply(fd, "204 No Content", "", NULL);
+    session_put(s);
+}
+
+void resumable_init(void) {
+    session_sweep();
+    router_add("POST", "/upload/sessions", ROUTE_EXACT, route_create, NULL);
+    router_add("GET", "/upload/sessions/*", ROUTE_EXACT, route_status, NULL);
+    router_add("PUT", "/upload/sessions/*", ROUTE_EXACT, route_chunk, NULL);
+    router_add("PATCH", "/upload/sessions/*", ROUTE_EXACT, route_chunk, NULL);
+    router_add("POST", "/upload/sessions/*", ROUTE_EXACT, route_finalize, NULL);
+    router_add("DELETE", "/upload/sessions/*", ROUTE_EXACT, route_delete, NULL);
+}
@@ -0,0 +1,29 @@
+#ifndef __RESUMABLE_H__
+#define __RESUMABLE_H__
+
+// Resumable uploads: a file is sent as chunks, over any number of
+// connections in parallel and in any order, and a dropped connection
+// loses at most the block in flight.
+//
+//   POST   /upload/sessions       create; Upload-Length (bytes), optional
+//                                 Upload-Type (MIME) and Upload-Filename
+//                                 (percent-encoded) -> 201 + Location
+//   PUT    /upload/sessions/<id>  write the body at Upload-Offset (PATCH
+//                                 is the same); offsets are multiples of
+//                                 the session's block size
+//   GET    /upload/sessions/<id>  progress and the byte ranges still missing
+//   POST   /upload/sessions/<id>  finalize: publish the blob once complete
+//   DELETE /upload/sessions/<id>  abandon
+//
+// Chunks are written with pwrite() into a file preallocated at creation in
+// uploads/.sessions/. Which blocks have arrived is kept in a bitmap that
+// is persisted block by block beside it, so sessions survive a restart.
+
+#define RESUMABLE_BLOCK (256 * 1024)
+#define RESUMABLE_MAX_LENGTH ((uint64_t) 1 << 30)
+#define RESUMABLE_TTL (24 * 60 * 60) // idle sessions are removed after this
+
+// Removes expired sessions and registers the routes
+void resumable_init(void);
+
+#endif // __RESUMABLE_H__
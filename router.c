@@ -0,0 +1,208 @@
+#include "router.h"
+
+typedef struct route_entry {
+    char method[16];             // "" matches any method
+    route_handler_t handler;
+    void *ctx;
+    struct route_entry *next;
+} route_entry_t;
+
+// A node stands for the path spelled by the labels from the root to it.
+// Literal children are found by the first byte of their label, which is
+// kept in a separate array so the scan touches one cache line.
+typedef struct router_node {
+    char *label;
+    size_t len;
+    char *first;                 // first[i] == children[i]->label[0]
+    struct router_node **children;
+    int num_children;
+    struct router_node *wildcard; // '*': one segment, then its own subtree
+    route_entry_t *exact;
+    route_entry_t *prefix;
+} router_node_t;
+
+// Lookup state: the best route so far and the '*' segments on the way
+typedef struct {
+    const char *method;
+    const char *path;
+    size_t path_len;
+    route_match_t params;
+    route_entry_t *found;        // exact match
+    route_entry_t *best;         // longest prefix match
+    size_t best_len;
+    route_match_t best_params;
+    int path_known;              // some route covered the path
+} lookup_t;
+
+static router_node_t root;
+
+static router_node_t *node_new(const char *label, size_t len) {
+    router_node_t *n = calloc(1, sizeof(router_node_t));
+    if (!n) return NULL;
+    n->label = strndup(label, len);
+    n->len = len;
+    if (!n->label) {
+        free(n);
+        return NULL;
+    }
+    return n;
+}
+
+static router_node_t *child_find(router_node_t *n, char c) {
+    char *p = memchr(n->first, c, n->num_children);
+    return p ? n->children[p - n->first] : NULL;
+}
+
+static int child_add(router_node_t *n, router_node_t *child) {
+    router_node_t **children = realloc(n->children, (n->num_children + 1) * sizeof(*children));
+    if (!children) return -1;
+    n->children = children;
+    char *first = realloc(n->first, n->num_children + 1);
+    if (!first) return -1;
+    n->first = first;
+    n->children[n->num_children] = child;
+    n->first[n->num_children] = child->label[0];
+    n->num_children++;
+    return 0;
+}
+
+// Cuts n's label after len bytes; the rest and everything below n move to
+// a new child
+static int node_split(router_node_t *n, size_t len) {
+    router_node_t *tail = node_new(n->label + len, n->len - len);
+    if (!tail) return -1;
+    tail->first = n->first;
+    tail->children = n->children;
+    tail->num_children = n->num_children;
+    tail->wildcard = n->wildcard;
+    tail->exact = n->exact;
+    tail->prefix = n->prefix;
+
+    n->first = NULL;
+    n->children = NULL;
+    n->num_children = 0;
+    n->wildcard = NULL;
+    n->exact = NULL;
+    n->prefix = NULL;
+    n->len = len;
+    n->label[len] = '\0';
+    return child_add(n, tail);
+}
+
+// Returns the node for path, creating what is missing
+static router_node_t *node_insert(router_node_t *n, const char *path) {
+    while (*path) {
+        if (*path == '*') {
+            if (!n->wildcard && !(n->wildcard = node_new("", 0))) return NULL;
+            n = n->wildcard;
+            path++;
+            continue;
+        }
+        size_t seg = strcspn(path, "*");
+        router_node_t *c = child_find(n, *path);
+        if (!c) {
+            if (!(c = node_new(path, seg)) || child_add(n, c) < 0) return NULL;
+            n = c;
+            path += seg;
+            continue;
+        }
+        size_t common = 1;
+        while (common < c->len && common < seg && c->label[common] == path[common]) common++;
+        if (common < c->len && node_split(c, common) < 0) return NULL;
+        n = c;
+        path += common;
+    }
+    return n;
+}
+
+int router_add(const char *method, const char *path, int kind, route_handler_t handler, void *ctx) {
+    if (path[0] != '/' || (method && strlen(method) >= sizeof(((route_entry_t *) 0)->method))) return -1;
+    router_node_t *n = node_insert(&root, path);
+    if (!n) return -1;
+
+    route_entry_t **list = kind == ROUTE_PREFIX ? &n->prefix : &n->exact;
+    for (route_entry_t *e = *list; e; e = e->next) {
+        if (strcasecmp(e->method, method ? method : "") == 0) return -1;
+    }
+    route_entry_t *e = calloc(1, sizeof(route_entry_t));
+    if (!e) return -1;
+    strcpy(e->method, method ? method : "");
+    e->handler = handler;
+    e->ctx = ctx;
+    // Method-specific entries go first so they win over catch-alls
+    if (method) {
+        e->next = *list;
+        *list = e;
+    } else {
+        route_entry_t **tail = list;
+        while (*tail) tail = &(*tail)->next;
+        *tail = e;
+    }
+    return 0;
+}
+
+static route_entry_t *entry_for(route_entry_t *list, const char *method) {
+    for (; list; list = list->next) {
+        if (!list->method[0] || strcasecmp(list->method, method) == 0) return list;
+    }
+    return NULL;
+}
+
+// Matches the path from pos on below n; returns 1 once an exact route is found
+static int node_match(lookup_t *l, router_node_t *n, size_t pos) {
+    if (n->prefix) {
+        route_entry_t *e = entry_for(n->prefix, l->method);
+        l->path_known = 1;
+        if (e && (!l->best || pos >= l->best_len)) {
+            l->best = e;
+            l->best_len = pos;
+            l->best_params = l->params;
+        }
+    }
+    if (pos == l->path_len) {
+        if (!n->exact) return 0;
+        l->path_known = 1;
+        l->found = entry_for(n->exact, l->method);
+        return l->found != NULL;
+    }
+
+    router_node_t *c = child_find(n, l->path[pos]);
+    if (c && c->len <= l->path_len - pos && memcmp(c->label, l->path + pos, c->len) == 0) {
+        if (node_match(l, c, pos + c->len)) return 1;
+    }
+
+    if (n->wildcard && l->path[pos] != '/' && l->params.num_params < ROUTER_MAX_PARAMS) {
+        const char *slash = memchr(l->path + pos, '/', l->path_len - pos);
+        size_t seg = slash ? (size_t) (slash - l->path - pos) : l->path_len - pos;
+        int i = l->params.num_params++;
+        l->params.params[i] = l->path + pos;
+        l->params.param_len[i] = seg;
+        if (node_match(l, n->wildcard, pos + seg)) return 1;
+        l->params.num_params--;
+    }
+    return 0;
+}
+
+int router_lookup(const char *method, const char *uri, route_handler_t *handler, void **ctx, route_match_t *match) {
+    lookup_t l;
+    memset(&l, 0, sizeof(l));
+    l.method = method;
+    l.path = uri;
+    l.path_len = strcspn(uri, "?");
+
+    route_entry_t *e;
+    if (node_match(&l, &root, 0)) {
+        e = l.found;
+        *match = l.params;
+        match->rest = uri + l.path_len;
+    } else if (l.best) {
+        e = l.best;
+        *match = l.best_params;
+        match->rest = uri + l.best_len;
+    } else {
+        return l.path_known ? ROUTER_NO_METHOD : ROUTER_NO_PATH;
+    }
+    *handler = e->handler;
+    *ctx = e->ctx;
+    return ROUTER_FOUND;
+}
@@ -0,0 +1,41 @@
+#ifndef __ROUTER_H__
+#define __ROUTER_H__
+#include "request.h"
+
+// Route table: (method, path) -> handler. Paths are kept in a radix trie
+// built at startup, so a lookup walks the request path once, whatever
+// the number of routes. The query string is not part of the match.
+//
+// A path is matched exactly or, for prefix routes, as a prefix (the
+// longest matching prefix wins; an exact route beats any prefix). A '*'
+// in a registered path matches one non-empty segment, i.e. anything up
+// to the next '/'. Literal edges are tried before '*'.
+
+#define ROUTE_EXACT  0
+#define ROUTE_PREFIX 1
+
+#define ROUTER_MAX_PARAMS 4
+
+// Return values of router_lookup()
+#define ROUTER_NO_PATH   0   // no route covers the path
+#define ROUTER_FOUND     1
+#define ROUTER_NO_METHOD 2   // the path has routes, none for this method
+
+typedef struct {
+    const char *rest;                          // unmatched tail of a prefix route
+    const char *params[ROUTER_MAX_PARAMS];     // segments matched by '*',
+    size_t param_len[ROUTER_MAX_PARAMS];       // not NUL-terminated
+    int num_params;
+} route_match_t;
+
+typedef void (*route_handler_t)(int fd, http_request_t *req, route_match_t *match, void *ctx);
+
+// Registers a handler; method NULL matches any method. Not thread-safe:
+// routes are added before the server starts accepting. Returns 0 on
+// success, -1 for a malformed path or a duplicate route.
+int router_add(const char *method, const char *path, int kind, route_handler_t handler, void *ctx);
+
+// Finds the route for method and uri
+int router_lookup(const char *method, const char *uri, route_handler_t *handler, void **ctx, route_match_t *match);
+
+#endif // __ROUTER_H__
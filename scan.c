@@ -0,0 +1,161 @@
+#include "io_helper.h"
+#include "scan.h"
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+typedef char *(*find_fn)(const char *, size_t, const char *, size_t);
+typedef size_t (*special_fn)(const char *, size_t);
+
+static find_fn find_impl;
+static special_fn special_impl;
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+//
+// Scalar fallback
+//
+
+static char *find_scalar(const char *haystack, size_t haystack_len,
+                         const char *needle, size_t needle_len) {
+    return memmem(haystack, haystack_len, needle, needle_len);
+}
+
+static size_t special_scalar(const char *s, size_t len) {
+    size_t i = 0;
+    while (i < len && s[i] != '%' && s[i] != '+') i++;
+    return i;
+}
+
+#ifdef SCAN_X86
+
+//
+// SSE2: 16 candidate positions per iteration
+//
+
+__attribute__((target("sse2")))
+static char *find_sse2(const char *haystack, size_t haystack_len,
+                       const char *needle, size_t needle_len) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+
+    // Both loads must stay inside the haystack
+    for (; i + needle_len - 1 + 16 <= haystack_len; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *) (haystack + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *) (haystack + i + needle_len - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                                        _mm_cmpeq_epi8(last, block_last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(haystack + i + bit + 1, needle + 1, needle_len - 2) == 0) {
+                return (char *) haystack + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return find_scalar(haystack + i, haystack_len - i, needle, needle_len);
+}
+
+__attribute__((target("sse2")))
+static size_t special_sse2(const char *s, size_t len) {
+    const __m128i percent = _mm_set1_epi8('%');
+    const __m128i plus = _mm_set1_epi8('+');
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (s + i));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, percent),
+                                                       _mm_cmpeq_epi8(block, plus)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + special_scalar(s + i, len - i);
+}
+
+//
+// AVX2: 32 candidate positions per iteration
+//
+
+__attribute__((target("avx2")))
+static char *find_avx2(const char *haystack, size_t haystack_len,
+                       const char *needle, size_t needle_len) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+
+    for (; i + needle_len - 1 + 32 <= haystack_len; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *) (haystack + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *) (haystack + i + needle_len - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                                                              _mm256_cmpeq_epi8(last, block_last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(haystack + i + bit + 1, needle + 1, needle_len - 2) == 0) {
+                return (char *) haystack + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return find_sse2(haystack + i, haystack_len - i, needle, needle_len);
+}
+
+__attribute__((target("avx2")))
+static size_t special_avx2(const char *s, size_t len) {
+    const __m256i percent = _mm256_set1_epi8('%');
+    const __m256i plus = _mm256_set1_epi8('+');
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (s + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(block, percent),
+                                                             _mm256_cmpeq_epi8(block, plus)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + special_sse2(s + i, len - i);
+}
+
+#endif // SCAN_X86
+
+// Picks the widest kernels the CPU supports
+static void scan_init(void) {
+    find_impl = find_scalar;
+    special_impl = special_scalar;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_impl = find_avx2;
+        special_impl = special_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        find_impl = find_sse2;
+        special_impl = special_sse2;
+    }
+#endif
+}
+
+char *scan_find(const char *haystack, size_t haystack_len,
+                const char *needle, size_t needle_len) {
+    // The first/last byte filter needs two distinct positions
+    if (needle_len < 2 || needle_len > haystack_len) {
+        return find_scalar(haystack, haystack_len, needle, needle_len);
+    }
+    pthread_once(&scan_once, scan_init);
+    return find_impl(haystack, haystack_len, needle, needle_len);
+}
+
+// Short runs (words between '+', bytes between escapes) are the common
+// case in form data: look at a few bytes directly before paying for the
+// dispatch and the vector setup
+#define SCAN_SHORT_RUN 16
+
+size_t scan_url_special(const char *s, size_t len) {
+    size_t i = 0;
+    while (i < len && i < SCAN_SHORT_RUN) {
+        if (s[i] == '%' || s[i] == '+') return i;
+        i++;
+    }
+    if (i == len) return len;
+    pthread_once(&scan_once, scan_init);
+    return i + special_impl(s + i, len - i);
+}
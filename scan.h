@@ -0,0 +1,19 @@
+#ifndef __SCAN_H__
+#define __SCAN_H__
+#include <stddef.h>
+
+// Vectorised byte scanning for the request parsers. The kernels use AVX2
+// or SSE2 when the CPU has them (checked once at run time) and fall back
+// to portable scalar code otherwise; all of them return the same results.
+
+// Returns the first occurrence of needle in haystack, or NULL. Like
+// memmem(), but candidates are filtered 16/32 positions at a time by
+// comparing the first and the last byte of the needle.
+char *scan_find(const char *haystack, size_t haystack_len,
+                const char *needle, size_t needle_len);
+
+// Returns the offset of the first '%' or '+' in s[0..len), or len if
+// there is none
+size_t scan_url_special(const char *s, size_t len);
+
+#endif // __SCAN_H__
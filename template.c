@@ -0,0 +1,160 @@
+#include "io_helper.h"
+#include "template.h"
+
+static void compile_error(const char *name, const char *msg) {
+    fprintf(stderr, "template %s: %s\n", name, msg);
+    exit(1);
+}
+
+static void add_part(template_t *tpl, const char *text, size_t len, int slot, int raw) {
+    if (tpl->num_parts == TEMPLATE_MAX_PARTS) compile_error(tpl->name, "too many parts");
+    template_part_t *p = &tpl->parts[tpl->num_parts++];
+    p->text = text;
+    p->len = len;
+    p->slot = slot;
+    p->raw = raw;
+}
+
+void template_compile(template_t *tpl, const char *name, const char *src, const char *const *slots) {
+    tpl->name = name;
+    tpl->num_parts = 0;
+
+    const char *p = src;
+    for (;;) {
+        const char *open = strstr(p, "{{");
+        if (!open) break;
+        if (open > p) add_part(tpl, p, open - p, -1, 0);
+
+        const char *close = strstr(open + 2, "}}");
+        if (!close) compile_error(name, "unterminated slot");
+        const char *s = open + 2;
+        int raw = *s == '&';
+        if (raw) s++;
+        size_t name_len = strcspn(s, ":}");
+        size_t cap = TEMPLATE_MAX_VALUE;
+        if (s[name_len] == ':') {
+            cap = strtoul(s + name_len + 1, NULL, 10);
+            if (cap == 0 || cap > TEMPLATE_MAX_VALUE) compile_error(name, "bad slot cap");
+        }
+
+        int slot = -1;
+        for (int i = 0; slots && slots[i]; i++) {
+            if (strlen(slots[i]) == name_len && strncmp(slots[i], s, name_len) == 0) {
+                slot = i;
+                break;
+            }
+        }
+        if (slot < 0) compile_error(name, "unknown slot");
+        add_part(tpl, NULL, cap, slot, raw);
+        p = close + 2;
+    }
+    if (*p) add_part(tpl, p, strlen(p), -1, 0);
+}
+
+void template_out_init(template_out_t *out) {
+    out->num_iov = 0;
+    out->len = 0;
+    out->used = 0;
+}
+
+static int push(template_out_t *out, const char *data, size_t len) {
+    if (len == 0) return 0;
+    if (out->num_iov == TEMPLATE_MAX_IOV) return -1;
+    out->iov[out->num_iov].iov_base = (void *) data;
+    out->iov[out->num_iov].iov_len = len;
+    out->num_iov++;
+    out->len += len;
+    return 0;
+}
+
+static const char *escape_of(char c) {
+    switch (c) {
+    case '&': return "&amp;";
+    case '<': return "&lt;";
+    case '>': return "&gt;";
+    case '"': return "&quot;";
+    case '\'': return "&#39;";
+    }
+    return NULL;
+}
+
+// Escapes value into the scratch area, as one iovec
+static int push_escaped(template_out_t *out, const char *value, size_t len) {
+    char *start = out->scratch + out->used;
+    char *dst = start, *end = out->scratch + sizeof(out->scratch);
+    for (size_t i = 0; i < len; i++) {
+        const char *e = escape_of(value[i]);
+        size_t n = e ? strlen(e) : 1;
+        if ((size_t) (end - dst) < n) return -1;
+        if (e) memcpy(dst, e, n);
+        else *dst = value[i];
+        dst += n;
+    }
+    if (push(out, start, dst - start) < 0) return -1;
+    out->used += dst - start;
+    return 0;
+}
+
+int template_render(template_out_t *out, const template_t *tpl, const char *const *values) {
+    int num_iov = out->num_iov;
+    size_t len = out->len, used = out->used;
+
+    for (int i = 0; i < tpl->num_parts; i++) {
+        const template_part_t *p = &tpl->parts[i];
+        int rc;
+        if (p->text) {
+            rc = push(out, p->text, p->len);
+        } else {
+            const char *v = values[p->slot] ? values[p->slot] : "";
+            size_t n = strnlen(v, p->len);
+            // Values without special characters are referenced, not copied
+            size_t plain = 0;
+            if (p->raw) plain = n;
+            else while (plain < n && !escape_of(v[plain])) plain++;
+            rc = plain == n ? push(out, v, n) : push_escaped(out, v, n);
+        }
+        if (rc < 0) {
+            out->num_iov = num_iov;
+            out->len = len;
+            out->used = used;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int template_write(int fd, const template_out_t *head, const template_out_t *body) {
+    struct iovec iov[2 * TEMPLATE_MAX_IOV];
+    int n = 0;
+    if (head) {
+        memcpy(iov, head->iov, head->num_iov * sizeof(struct iovec));
+        n = head->num_iov;
+    }
+    memcpy(iov + n, body->iov, body->num_iov * sizeof(struct iovec));
+    n += body->num_iov;
+
+    struct iovec *v = iov;
+    while (n > 0) {
+        ssize_t w = writev(fd, v, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) return -1;
+        // Skip what was written; a short write may end inside an iovec
+        while (n > 0 && (size_t) w >= v->iov_len) {
+            w -= v->iov_len;
+            v++;
+            n--;
+        }
+        if (n > 0) {
+            v->iov_base = (char *) v->iov_base + w;
+            v->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+int template_emit(int fd, template_out_t *out, const template_t *tpl, const char *const *values) {
+    if (template_render(out, tpl, values) == 0) return 0;
+    if (template_write(fd, NULL, out) < 0) return -1;
+    template_out_init(out);
+    return template_render(out, tpl, values);
+}
@@ -0,0 +1,59 @@
+#ifndef __TEMPLATE_H__
+#define __TEMPLATE_H__
+#include <stddef.h>
+#include <sys/uio.h>
+
+// HTML templates for generated pages. A template is compiled once at
+// startup into static segments and slots; rendering only records iovecs,
+// so the static text (often most of the page) is never copied, and values
+// are copied only when they need escaping. The result goes out with one
+// writev().
+//
+// Slots are written {{name}} (HTML-escaped) or {{&name}} (inserted as is,
+// for trusted values); {{name:N}} keeps at most N bytes of the value.
+// Every value is capped, so the size of a rendered page is bounded.
+
+#define TEMPLATE_MAX_PARTS 32
+#define TEMPLATE_MAX_IOV 64
+#define TEMPLATE_SCRATCH 4096      // escaped values of one output
+#define TEMPLATE_MAX_VALUE 1024    // default cap of a slot
+
+typedef struct {
+    const char *text;              // static segment, or NULL for a slot
+    size_t len;                    // segment length, or the slot's cap
+    int slot;
+    int raw;
+} template_part_t;
+
+typedef struct {
+    const char *name;
+    int num_parts;
+    template_part_t parts[TEMPLATE_MAX_PARTS];
+} template_t;
+
+typedef struct {
+    struct iovec iov[TEMPLATE_MAX_IOV];
+    int num_iov;
+    size_t len;
+    size_t used;                   // of scratch
+    char scratch[TEMPLATE_SCRATCH];
+} template_out_t;
+
+// Compiles src, which must outlive the template, against the NULL-ended
+// slot names; values are later passed in the same order. Exits on a
+// malformed template, since templates are part of the program.
+void template_compile(template_t *tpl, const char *name, const char *src, const char *const *slots);
+
+void template_out_init(template_out_t *out);
+
+// Appends a rendering of tpl. Values must stay valid until the output is
+// written. Returns -1 (leaving out as it was) if out is full.
+int template_render(template_out_t *out, const template_t *tpl, const char *const *values);
+
+// Writes head (may be NULL) and body with writev(); 0 or -1
+int template_write(int fd, const template_out_t *head, const template_out_t *body);
+
+// Renders into out, first writing out and starting over if it is full
+int template_emit(int fd, template_out_t *out, const template_t *tpl, const char *const *values);
+
+#endif // __TEMPLATE_H__
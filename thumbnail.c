@@ -0,0 +1,592 @@
+#include "io_helper.h"
+#include "request.h"
+#include "thumbnail.h"
+#include "docroot.h"
+#include "upload_store.h"
+#include "trace.h"
+#include <pthread.h>
+#include <setjmp.h>
+#include <png.h>
+#include <jpeglib.h>
+
+#define THUMB_QUALITY 80
+#define THUMB_WAIT_MS 3000
+#define THUMB_MAX_WORKERS 16
+#define THUMB_NAME_MAX 96
+
+// Decoded image: tightly packed 8-bit RGB
+typedef struct {
+    unsigned char *pixels;
+    int width;
+    int height;
+} rgb_image_t;
+
+typedef struct thumb_job {
+    char name[THUMB_NAME_MAX];
+    struct thumb_job *next;
+} thumb_job_t;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_nonempty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+static thumb_job_t *queue_head = NULL;
+static thumb_job_t *queue_tail = NULL;
+// Names currently being processed, one slot per worker
+static char in_progress[THUMB_MAX_WORKERS][THUMB_NAME_MAX];
+static int started = 0;
+
+//
+// Name handling
+//
+
+// Accepts only "<sha256>.<ext>" so that names can be used in paths safely
+static int valid_blob_name(const char *name) {
+    for (int i = 0; i < UPLOAD_HASH_HEX_LEN; i++) {
+        if (!isxdigit((unsigned char) name[i])) return 0;
+    }
+    if (name[UPLOAD_HASH_HEX_LEN] != '.') return 0;
+    const char *ext = name + UPLOAD_HASH_HEX_LEN + 1;
+    size_t ext_len = strlen(ext);
+    if (ext_len == 0 || ext_len > 8) return 0;
+    for (size_t i = 0; i < ext_len; i++) {
+        if (!isalnum((unsigned char) ext[i])) return 0;
+    }
+    return 1;
+}
+
+static const char *blob_ext(const char *name) {
+    return name + UPLOAD_HASH_HEX_LEN + 1;
+}
+
+static void thumb_file(const char *blob_name, char *path, size_t path_size) {
+    snprintf(path, path_size, "%s/%.*s.jpg", THUMB_DIR, UPLOAD_HASH_HEX_LEN, blob_name);
+}
+
+void thumbnail_uri(const char *blob_name, char *uri, size_t uri_size) {
+    snprintf(uri, uri_size, "%s%s", THUMB_URI_PREFIX, blob_name);
+}
+
+//
+// Decoders
+//
+
+static int too_large(unsigned long width, unsigned long height) {
+    return width * height > THUMB_MAX_PIXELS;
+}
+
+static int decode_png(const char *path, rgb_image_t *img) {
+    png_image image;
+    memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_file(&image, path)) return -1;
+    if (too_large(image.width, image.height)) {
+        png_image_free(&image);
+        return -1;
+    }
+
+    // Transparent pixels are composed onto white since JPEG has no alpha
+    png_color background = { 255, 255, 255 };
+    image.format = PNG_FORMAT_RGB;
+    img->width = image.width;
+    img->height = image.height;
+    img->pixels = malloc(PNG_IMAGE_SIZE(image));
+    if (!img->pixels) {
+        png_image_free(&image);
+        return -1;
+    }
+    if (!png_image_finish_read(&image, &background, img->pixels, 0, NULL)) {
+        free(img->pixels);
+        img->pixels = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+} jpeg_error_t;
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+    jpeg_error_t *err = (jpeg_error_t *) cinfo->err;
+    longjmp(err->jump, 1);
+}
+
+static int decode_jpeg(const char *path, rgb_image_t *img) {
+    struct jpeg_decompress_struct cinfo;
+    jpeg_error_t jerr;
+    FILE *fp = fopen(path, "rbe");
+    if (!fp) return -1;
+
+    img->pixels = NULL;
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    if (setjmp(jerr.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(fp);
+        free(img->pixels);
+        img->pixels = NULL;
+        return -1;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, fp);
+    jpeg_read_header(&cinfo, TRUE);
+    if (too_large(cinfo.image_width, cinfo.image_height)) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(fp);
+        return -1;
+    }
+    cinfo.out_color_space = JCS_RGB;
+
+    // Let the decoder do most of the downscaling through its IDCT: pick
+    // the largest 1/2^n scale that keeps the image above thumbnail size
+    int longest = cinfo.image_width > cinfo.image_height ? cinfo.image_width : cinfo.image_height;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1;
+    while (cinfo.scale_denom < 8 && longest / (int) (cinfo.scale_denom * 2) >= THUMB_MAX_SIDE) {
+        cinfo.scale_denom *= 2;
+    }
+
+    jpeg_start_decompress(&cinfo);
+    img->width = cinfo.output_width;
+    img->height = cinfo.output_height;
+    img->pixels = malloc((size_t) img->width * img->height * 3);
+    if (!img->pixels) longjmp(jerr.jump, 1);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = img->pixels + (size_t) cinfo.output_scanline * img->width * 3;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(fp);
+    return 0;
+}
+
+// Expands the LZW-coded index stream of one GIF frame into out[0..count)
+static int gif_lzw_decode(const unsigned char *data, size_t len, int min_code_size,
+                          unsigned char *out, size_t count) {
+    // On the worker's stack: as static TLS these would be set up in every
+    // thread, connection threads included
+    unsigned short prefix[4096];
+    unsigned char suffix[4096];
+    unsigned char stack[4097];
+
+    if (min_code_size < 2 || min_code_size > 8) return -1;
+    int clear = 1 << min_code_size;
+    int end = clear + 1;
+    int code_size = min_code_size + 1;
+    int next_code = clear + 2;
+    int old_code = -1;
+    unsigned char first = 0;
+    unsigned int bits = 0, bit_count = 0;
+    size_t pos = 0, produced = 0;
+
+    for (int i = 0; i < clear; i++) {
+        prefix[i] = 0;
+        suffix[i] = i;
+    }
+
+    while (produced < count) {
+        while (bit_count < (unsigned int) code_size) {
+            if (pos >= len) return produced > 0 ? 0 : -1;
+            bits |= (unsigned int) data[pos++] << bit_count;
+            bit_count += 8;
+        }
+        int code = bits & ((1 << code_size) - 1);
+        bits >>= code_size;
+        bit_count -= code_size;
+
+        if (code == clear) {
+            code_size = min_code_size + 1;
+            next_code = clear + 2;
+            old_code = -1;
+            continue;
+        }
+        if (code == end) break;
+
+        if (old_code < 0) {
+            if (code >= clear) return -1;
+            out[produced++] = code;
+            old_code = code;
+            first = code;
+            continue;
+        }
+
+        int in_code = code;
+        int sp = 0;
+        if (code >= next_code) {
+            if (code > next_code) return -1;
+            stack[sp++] = first;
+            code = old_code;
+        }
+        while (code >= clear) {
+            stack[sp++] = suffix[code];
+            code = prefix[code];
+        }
+        first = code;
+        stack[sp++] = first;
+        while (sp > 0 && produced < count) out[produced++] = stack[--sp];
+
+        if (next_code < 4096) {
+            prefix[next_code] = old_code;
+            suffix[next_code] = first;
+            next_code++;
+            if (next_code == (1 << code_size) && code_size < 12) code_size++;
+        }
+        old_code = in_code;
+    }
+    return 0;
+}
+
+// Decodes the first frame of a GIF onto a white canvas of the screen size
+static int decode_gif(const char *path, rgb_image_t *img) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) < 0 || sbuf.st_size < 13) {
+        close(fd);
+        return -1;
+    }
+    size_t size = sbuf.st_size;
+    unsigned char *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return -1;
+
+    int rc = -1;
+    unsigned char *lzw = NULL, *indices = NULL;
+    const unsigned char *end = p + size;
+    const unsigned char *cur = p + 13;
+    if (memcmp(p, "GIF87a", 6) && memcmp(p, "GIF89a", 6)) goto out;
+
+    int screen_w = p[6] | (p[7] << 8);
+    int screen_h = p[8] | (p[9] << 8);
+    if (too_large(screen_w, screen_h)) goto out;
+    const unsigned char *palette = NULL;
+    int palette_size = 0;
+    if (p[10] & 0x80) {
+        palette = cur;
+        palette_size = 1 << ((p[10] & 7) + 1);
+        cur += palette_size * 3;
+    }
+    int transparent = -1;
+
+    while (cur < end) {
+        unsigned char tag = *cur++;
+        if (tag == 0x21) {
+            // Extension: only the graphic control block matters (transparency)
+            if (cur + 1 > end) goto out;
+            unsigned char label = *cur++;
+            if (label == 0xF9 && cur + 5 <= end && cur[0] >= 4 && (cur[1] & 1)) {
+                transparent = cur[4];
+            }
+            while (cur < end && *cur) cur += *cur + 1;
+            cur++;
+        } else if (tag == 0x2C) {
+            if (cur + 9 > end) goto out;
+            int left = cur[0] | (cur[1] << 8);
+            int top = cur[2] | (cur[3] << 8);
+            int w = cur[4] | (cur[5] << 8);
+            int h = cur[6] | (cur[7] << 8);
+            unsigned char flags = cur[8];
+            cur += 9;
+            if (flags & 0x80) {
+                palette = cur;
+                palette_size = 1 << ((flags & 7) + 1);
+                cur += palette_size * 3;
+            }
+            if (!palette || cur >= end || w == 0 || h == 0 || too_large(w, h)) goto out;
+            int min_code_size = *cur++;
+
+            // Concatenate the data sub-blocks
+            size_t lzw_len = 0;
+            lzw = malloc(end - cur);
+            if (!lzw) goto out;
+            while (cur < end && *cur) {
+                size_t n = *cur++;
+                if (cur + n > end) n = end - cur;
+                memcpy(lzw + lzw_len, cur, n);
+                lzw_len += n;
+                cur += n;
+            }
+
+            indices = calloc((size_t) w * h, 1);
+            if (!indices || gif_lzw_decode(lzw, lzw_len, min_code_size, indices, (size_t) w * h) < 0) goto out;
+
+            img->width = screen_w > 0 ? screen_w : w;
+            img->height = screen_h > 0 ? screen_h : h;
+            img->pixels = malloc((size_t) img->width * img->height * 3);
+            if (!img->pixels) goto out;
+            memset(img->pixels, 255, (size_t) img->width * img->height * 3);
+
+            // Interlaced frames store rows in four passes
+            static const int pass_start[] = { 0, 4, 2, 1 };
+            static const int pass_step[] = { 8, 8, 4, 2 };
+            int src_row = 0;
+            for (int pass = 0; pass < ((flags & 0x40) ? 4 : 1); pass++) {
+                int start = (flags & 0x40) ? pass_start[pass] : 0;
+                int step = (flags & 0x40) ? pass_step[pass] : 1;
+                for (int y = start; y < h; y += step, src_row++) {
+                    int dy = top + y;
+                    if (dy >= img->height) continue;
+                    for (int x = 0; x < w; x++) {
+                        int dx = left + x;
+                        int idx = indices[(size_t) src_row * w + x];
+                        if (dx >= img->width || idx == transparent || idx >= palette_size) continue;
+                        unsigned char *dst = img->pixels + ((size_t) dy * img->width + dx) * 3;
+                        memcpy(dst, palette + idx * 3, 3);
+                    }
+                }
+            }
+            rc = 0;
+            goto out;
+        } else {
+            goto out;
+        }
+    }
+
+out:
+    free(lzw);
+    free(indices);
+    munmap(p, size);
+    return rc;
+}
+
+//
+// Scaling and encoding
+//
+
+// Box-filter downscale so that the longest side is at most THUMB_MAX_SIDE
+static int downscale(const rgb_image_t *src, rgb_image_t *dst) {
+    int longest = src->width > src->height ? src->width : src->height;
+    if (longest <= THUMB_MAX_SIDE) {
+        dst->width = src->width;
+        dst->height = src->height;
+    } else {
+        dst->width = (int) ((long) src->width * THUMB_MAX_SIDE / longest);
+        dst->height = (int) ((long) src->height * THUMB_MAX_SIDE / longest);
+        if (dst->width < 1) dst->width = 1;
+        if (dst->height < 1) dst->height = 1;
+    }
+    dst->pixels = malloc((size_t) dst->width * dst->height * 3);
+    if (!dst->pixels) return -1;
+
+    for (int y = 0; y < dst->height; y++) {
+        int y0 = (int) ((long) y * src->height / dst->height);
+        int y1 = (int) ((long) (y + 1) * src->height / dst->height);
+        if (y1 <= y0) y1 = y0 + 1;
+        for (int x = 0; x < dst->width; x++) {
+            int x0 = (int) ((long) x * src->width / dst->width);
+            int x1 = (int) ((long) (x + 1) * src->width / dst->width);
+            if (x1 <= x0) x1 = x0 + 1;
+            unsigned long sum[3] = { 0, 0, 0 };
+            for (int sy = y0; sy < y1; sy++) {
+                const unsigned char *row = src->pixels + ((size_t) sy * src->width + x0) * 3;
+                for (int sx = x0; sx < x1; sx++, row += 3) {
+                    sum[0] += row[0];
+                    sum[1] += row[1];
+                    sum[2] += row[2];
+                }
+            }
+            unsigned long n = (unsigned long) (y1 - y0) * (x1 - x0);
+            unsigned char *out = dst->pixels + ((size_t) y * dst->width + x) * 3;
+            out[0] = sum[0] / n;
+            out[1] = sum[1] / n;
+            out[2] = sum[2] / n;
+        }
+    }
+    return 0;
+}
+
+static int encode_jpeg(const rgb_image_t *img, const char *path) {
+    struct jpeg_compress_struct cinfo;
+    jpeg_error_t jerr;
+    FILE *fp = fopen(path, "wbe");
+    if (!fp) return -1;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    if (setjmp(jerr.jump)) {
+        jpeg_destroy_compress(&cinfo);
+        fclose(fp);
+        return -1;
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, fp);
+    cinfo.image_width = img->width;
+    cinfo.image_height = img->height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, THUMB_QUALITY, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = img->pixels + (size_t) cinfo.next_scanline * img->width * 3;
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+static int thumbnail_generate(const char *blob_name) {
+    char src_path[MAXBUF], dst_path[MAXBUF], tmp_path[MAXBUF];
+    snprintf(src_path, sizeof(src_path), "uploads/%s", blob_name);
+    thumb_file(blob_name, dst_path, sizeof(dst_path));
+    if (access(dst_path, F_OK) == 0) return 0;
+
+    rgb_image_t full = { NULL, 0, 0 }, thumb = { NULL, 0, 0 };
+    const char *ext = blob_ext(blob_name);
+    int rc;
+    if (strcasecmp(ext, "png") == 0) rc = decode_png(src_path, &full);
+    else if (strcasecmp(ext, "jpg") == 0) rc = decode_jpeg(src_path, &full);
+    else if (strcasecmp(ext, "gif") == 0) rc = decode_gif(src_path, &full);
+    else rc = -1;
+
+    if (rc == 0) rc = downscale(&full, &thumb);
+    free(full.pixels);
+
+    if (rc == 0) {
+        // Publish atomically so /thumb/ never serves a half-written file
+        snprintf(tmp_path, sizeof(tmp_path), "%s/.tmp-%lx-%s.jpg", THUMB_DIR,
+                 (unsigned long) pthread_self(), blob_name);
+        rc = encode_jpeg(&thumb, tmp_path);
+        if (rc == 0 && rename(tmp_path, dst_path) < 0) rc = -1;
+        if (rc < 0) unlink(tmp_path);
+        else docroot_refresh(dst_path);
+    }
+    free(thumb.pixels);
+
+    if (rc < 0) fprintf(stderr, "Thumbnail generation failed for %s\n", blob_name);
+    return rc;
+}
+
+//
+// Queue and workers
+//
+
+// Must hold queue_lock
+static int job_pending(const char *name) {
+    for (thumb_job_t *job = queue_head; job; job = job->next) {
+        if (strcmp(job->name, name) == 0) return 1;
+    }
+    for (int i = 0; i < THUMB_MAX_WORKERS; i++) {
+        if (strcmp(in_progress[i], name) == 0) return 1;
+    }
+    return 0;
+}
+
+static void *thumbnail_worker(void *arg) {
+    int slot = (int) (long) arg;
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while (!queue_head) pthread_cond_wait(&queue_nonempty, &queue_lock);
+        thumb_job_t *job = queue_head;
+        queue_head = job->next;
+        if (!queue_head) queue_tail = NULL;
+        strcpy(in_progress[slot], job->name);
+        pthread_mutex_unlock(&queue_lock);
+
+        thumbnail_generate(job->name);
+
+        pthread_mutex_lock(&queue_lock);
+        in_progress[slot][0] = '\0';
+        pthread_cond_broadcast(&job_done);
+        pthread_mutex_unlock(&queue_lock);
+        free(job);
+    }
+    return NULL;
+}
+
+void thumbnail_init(int num_workers) {
+    if (num_workers < 1) num_workers = 1;
+    if (num_workers > THUMB_MAX_WORKERS) num_workers = THUMB_MAX_WORKERS;
+
+    mkdir("uploads", 0755);
+    mkdir(THUMB_DIR, 0755);
+
+    for (long i = 0; i < num_workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, thumbnail_worker, (void *) i) == 0) {
+            pthread_detach(thread);
+            started++;
+        }
+    }
+}
+
+int thumbnail_enqueue(const char *blob_name) {
+    if (!valid_blob_name(blob_name)) return -1;
+    const char *ext = blob_ext(blob_name);
+    if (strcasecmp(ext, "png") && strcasecmp(ext, "jpg") && strcasecmp(ext, "gif")) return -1;
+
+    char path[MAXBUF];
+    thumb_file(blob_name, path, sizeof(path));
+    if (access(path, F_OK) == 0) return 0;
+
+    // Without workers the thumbnail is generated inline by thumbnail_serve
+    if (started == 0) return 0;
+
+    pthread_mutex_lock(&queue_lock);
+    if (!job_pending(blob_name)) {
+        thumb_job_t *job = malloc(sizeof(thumb_job_t));
+        if (job) {
+            snprintf(job->name, sizeof(job->name), "%s", blob_name);
+            job->next = NULL;
+            if (queue_tail) queue_tail->next = job;
+            else queue_head = job;
+            queue_tail = job;
+            pthread_cond_signal(&queue_nonempty);
+        }
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return 0;
+}
+
+// Waits until no job for blob_name is queued or running, or until timeout
+static void thumbnail_wait(const char *blob_name, int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    while (job_pending(blob_name)) {
+        if (pthread_cond_timedwait(&job_done, &queue_lock, &deadline) == ETIMEDOUT) break;
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+void thumbnail_serve(int fd, const char *blob_name) {
+    char path[MAXBUF], original[MAXBUF];
+    struct stat sbuf;
+
+    if (!valid_blob_name(blob_name)) {
+        request_error(fd, (char *) blob_name, "404", "Not found", "No such thumbnail");
+        return;
+    }
+    thumb_file(blob_name, path, sizeof(path));
+
+    if (stat(path, &sbuf) < 0) {
+        snprintf(original, sizeof(original), "uploads/%s", blob_name);
+        if (access(original, F_OK) < 0 || thumbnail_enqueue(blob_name) < 0) {
+            request_error(fd, (char *) blob_name, "404", "Not found", "No such thumbnail");
+            return;
+        }
+        // Usually the job was queued by the upload a moment ago
+        uint64_t t = trace_start();
+        if (started > 0) thumbnail_wait(blob_name, THUMB_WAIT_MS);
+        else thumbnail_generate(blob_name);
+        trace_span(TRACE_THUMB_WAIT, t);
+
+        if (stat(path, &sbuf) < 0) {
+            request_error(fd, (char *) blob_name, "503", "Service Unavailable", "Thumbnail is not ready");
+            return;
+        }
+    }
+    request_serve_static(fd, path, sbuf.st_size);
+}
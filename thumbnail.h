@@ -0,0 +1,28 @@
+#ifndef __THUMBNAIL_H__
+#define __THUMBNAIL_H__
+
+// Thumbnails of uploaded images are produced by a pool of background
+// workers and stored as uploads/thumbs/<sha256>.jpg, next to the
+// content-addressed originals they are derived from.
+#define THUMB_DIR "uploads/thumbs"
+#define THUMB_MAX_SIDE 300
+#define THUMB_URI_PREFIX "/thumb/"
+// Images are decoded whole, so larger ones are refused before allocating:
+// a few bytes of header can claim gigabytes of pixels
+#define THUMB_MAX_PIXELS (40 * 1000 * 1000)
+
+// Starts num_workers thumbnail threads (at least one)
+void thumbnail_init(int num_workers);
+
+// Queues a blob (its name inside uploads/, e.g. "<sha256>.png") for
+// thumbnailing. Returns 0 if queued or already present, -1 if the file
+// type cannot be thumbnailed.
+int thumbnail_enqueue(const char *blob_name);
+
+// Fills uri with the public thumbnail URI of a blob
+void thumbnail_uri(const char *blob_name, char *uri, size_t uri_size);
+
+// Serves GET /thumb/<blob_name>; waits briefly for a queued job to finish
+void thumbnail_serve(int fd, const char *blob_name);
+
+#endif // __THUMBNAIL_H__
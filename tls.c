@@ -0,0 +1,231 @@
+#include "io_helper.h"
+#include "tls.h"
+#include <poll.h>
+#include <pthread.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#define TLS_SESSION_CACHE_SIZE 20480
+#define TLS_SESSION_TIMEOUT 300          // seconds
+#define TLS_HANDSHAKE_TIMEOUT 10         // seconds
+#define TLS_RELAY_BUF 16384              // one TLS record
+
+struct tls_conn {
+    SSL *ssl;
+    int sock;         // TCP socket
+    int app_fd;       // descriptor used by the HTTP layer
+    int relay_fd;     // relay thread's end of the socketpair
+    int relay;        // 1 if a relay thread serves app_fd
+    pthread_t thread;
+};
+
+static SSL_CTX *tls_ctx = NULL;
+
+// ALPN: prefer HTTP/2 and fall back to HTTP/1.1 (wire format: length-prefixed)
+static const unsigned char alpn_protos[] = "\x02h2\x08http/1.1";
+
+static int alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                       const unsigned char *in, unsigned int inlen, void *arg) {
+    (void) ssl;
+    (void) arg;
+    if (SSL_select_next_proto((unsigned char **) out, outlen, alpn_protos, sizeof(alpn_protos) - 1,
+                              in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+int tls_init(const char *cert_file, const char *key_file) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) return -1;
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) <= 0 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) <= 0 ||
+        SSL_CTX_check_private_key(ctx) <= 0) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+
+    // Resumption: a server-side cache for session IDs (TLS 1.2) and
+    // stateless tickets (TLS 1.2 and 1.3). Ticket keys live in the shared
+    // context, so any worker can resume a session issued by another.
+    static const unsigned char sid_ctx[] = "wserver";
+    SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+    SSL_CTX_set_num_tickets(ctx, 2);
+
+    SSL_CTX_set_alpn_select_cb(ctx, alpn_select, NULL);
+
+#ifdef SSL_OP_ENABLE_KTLS
+    // Let the kernel take over record encryption where it can
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    tls_ctx = ctx;
+    return 0;
+}
+
+int tls_enabled(void) {
+    return tls_ctx != NULL;
+}
+
+// Both directions: the HTTP layer reads and writes the same descriptor
+static int ktls_active(SSL *ssl) {
+#ifdef SSL_OP_ENABLE_KTLS
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#else
+    (void) ssl;
+    return 0;
+#endif
+}
+
+// Waits until the socket is ready for what OpenSSL asked for
+static int ssl_wait(tls_conn_t *c, int ret) {
+    struct pollfd pfd = { c->sock, 0, 0 };
+    int err = SSL_get_error(c->ssl, ret);
+    if (err == SSL_ERROR_WANT_READ) pfd.events = POLLIN;
+    else if (err == SSL_ERROR_WANT_WRITE) pfd.events = POLLOUT;
+    else return -1;
+    return poll(&pfd, 1, -1) < 0 && errno != EINTR ? -1 : 0;
+}
+
+static int ssl_write_all(tls_conn_t *c, const char *buf, int len) {
+    while (len > 0) {
+        int n = SSL_write(c->ssl, buf, len);
+        if (n > 0) {
+            buf += n;
+            len -= n;
+        } else if (ssl_wait(c, n) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int fd_write_all(int fd, const char *buf, int len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Moves plaintext between OpenSSL and the HTTP layer's end of the socketpair
+static void *tls_relay(void *arg) {
+    tls_conn_t *c = arg;
+    char buf[TLS_RELAY_BUF];
+    int peer_open = 1;
+
+    // A vanished peer must surface as EPIPE here, not kill the process
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    for (;;) {
+        struct pollfd fds[2] = {
+            { peer_open ? c->sock : -1, POLLIN, 0 },
+            { c->relay_fd, POLLIN, 0 },
+        };
+        // Decrypted bytes may already wait inside OpenSSL
+        if (!(peer_open && SSL_pending(c->ssl) > 0)) {
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+        } else {
+            fds[0].revents = POLLIN;
+        }
+
+        if (fds[0].revents) {
+            int n = SSL_read(c->ssl, buf, sizeof(buf));
+            if (n > 0) {
+                if (fd_write_all(c->relay_fd, buf, n) < 0) break;
+            } else {
+                int err = SSL_get_error(c->ssl, n);
+                if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+                    // Client is done sending: let the HTTP layer see EOF
+                    peer_open = 0;
+                    shutdown(c->relay_fd, SHUT_WR);
+                }
+            }
+        }
+        if (fds[1].revents) {
+            ssize_t n = read(c->relay_fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0 || ssl_write_all(c, buf, n) < 0) break;
+        }
+    }
+    return NULL;
+}
+
+int tls_accept(int fd, tls_conn_t **conn) {
+    *conn = NULL;
+    tls_conn_t *c = calloc(1, sizeof(tls_conn_t));
+    if (!c) {
+        close(fd);
+        return -1;
+    }
+    c->sock = fd;
+    c->app_fd = fd;
+    c->relay_fd = -1;
+    c->ssl = SSL_new(tls_ctx);
+    if (!c->ssl || !SSL_set_fd(c->ssl, fd)) goto fail;
+
+    // Bound the handshake so a silent client cannot pin a worker
+    struct timeval tv = { TLS_HANDSHAKE_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (SSL_accept(c->ssl) <= 0) goto fail;
+    tv.tv_sec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (ktls_active(c->ssl) && !SSL_has_pending(c->ssl)) {
+        // The kernel encrypts and decrypts: plain I/O and sendfile() work
+        *conn = c;
+        return fd;
+    }
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) goto fail;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    c->app_fd = pair[0];
+    c->relay_fd = pair[1];
+    c->relay = 1;
+    if (pthread_create(&c->thread, NULL, tls_relay, c) != 0) {
+        close(pair[0]);
+        close(pair[1]);
+        goto fail;
+    }
+    *conn = c;
+    return c->app_fd;
+
+fail:
+    ERR_clear_error();
+    if (c->ssl) SSL_free(c->ssl);
+    close(fd);
+    free(c);
+    return -1;
+}
+
+void tls_close(tls_conn_t *c) {
+    if (c->relay) {
+        // EOF on the socketpair ends the relay loop
+        close(c->app_fd);
+        pthread_join(c->thread, NULL);
+        close(c->relay_fd);
+        fcntl(c->sock, F_SETFL, fcntl(c->sock, F_GETFL) & ~O_NONBLOCK);
+    }
+    SSL_shutdown(c->ssl);
+    SSL_free(c->ssl);
+    close(c->sock);
+    free(c);
+}
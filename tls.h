@@ -0,0 +1,36 @@
+#ifndef __TLS_H__
+#define __TLS_H__
+
+// TLS termination (OpenSSL). One SSL_CTX is shared by all connections so
+// the server-side session cache and the session ticket keys are common to
+// every worker thread, which makes resumed handshakes cheap.
+//
+// After the handshake the connection is handed to the HTTP layer as a
+// plain file descriptor. When the kernel has taken over the record layer
+// in both directions (kTLS) that is the TCP socket itself, so sendfile()
+// and write() are encrypted in the kernel without extra copies. Otherwise
+// a relay thread moves bytes between OpenSSL and one end of a socketpair.
+//
+// The HTTP layer reads and writes one descriptor, so send-only offload
+// is not enough to skip the relay. OpenSSL 3.0 offloads only the send
+// side for TLS 1.3, so there only TLS 1.2 connections get zero-copy
+// sendfile(). The relay still benefits from send offload: its
+// SSL_write() is then a plain write to the kernel.
+
+typedef struct tls_conn tls_conn_t;
+
+// Loads the certificate chain and private key. Returns 0 on success.
+int tls_init(const char *cert_file, const char *key_file);
+
+// Returns 1 once tls_init() succeeded
+int tls_enabled(void);
+
+// Performs the server handshake on fd. Returns the descriptor the HTTP
+// layer should use, or -1 if the handshake failed (fd is closed then).
+int tls_accept(int fd, tls_conn_t **conn);
+
+// Sends close_notify, stops the relay and closes all descriptors of conn,
+// including the one returned by tls_accept()
+void tls_close(tls_conn_t *conn);
+
+#endif // __TLS_H__
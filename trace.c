@@ -0,0 +1,276 @@
+#include "io_helper.h"
+#include "request.h"
+#include "router.h"
+#include "trace.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+#define TRACE_RING 128          // requests kept per ring
+#define TRACE_MAX_SPANS 32      // spans kept per request
+#define TRACE_URI_LEN 96
+
+static const char *phase_names[TRACE_NUM_PHASES] = {
+    "read_line", "headers", "body", "dispatch", "lookup",
+    "open", "send", "upload_write", "thumb_wait", "proxy",
+};
+
+typedef struct {
+    uint64_t start;
+    uint32_t dur;               // ns, saturated
+    uint32_t phase;
+} trace_span_t;
+
+typedef struct {
+    uint64_t id;
+    uint64_t start, end;
+    char method[16];
+    char uri[TRACE_URI_LEN];
+    int num_spans;
+    trace_span_t spans[TRACE_MAX_SPANS];
+} trace_req_t;
+
+typedef struct trace_ring {
+    pthread_mutex_t lock;       // taken by the owner to commit, by exports to read
+    int lane;                   // "tid" in the export
+    int in_use;
+    uint64_t count;             // requests committed so far
+    trace_req_t reqs[TRACE_RING];
+    struct trace_ring *next;
+} trace_ring_t;
+
+typedef struct {
+    trace_ring_t *ring;
+    uint32_t rng;
+    int active;                 // a request is open
+    int recording;              // ... and its spans are wanted
+    int sampled;
+    trace_req_t cur;
+} trace_thread_t;
+
+static int enabled = 0;
+static uint32_t sample_threshold;   // sampled if rng < threshold
+static int sample_all;
+static uint64_t slow_ns;
+static uint64_t epoch;
+
+static trace_ring_t *rings = NULL;
+static int num_rings = 0;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static uint64_t next_id = 0;
+
+static __thread trace_thread_t *self;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Thread exit: the ring keeps its requests and goes back to the pool
+static void thread_release(void *arg) {
+    trace_thread_t *t = arg;
+    pthread_mutex_lock(&rings_lock);
+    t->ring->in_use = 0;
+    pthread_mutex_unlock(&rings_lock);
+    free(t);
+}
+
+static trace_thread_t *thread_get(void) {
+    if (self) return self;
+
+    trace_thread_t *t = calloc(1, sizeof(trace_thread_t));
+    if (!t) return NULL;
+    pthread_mutex_lock(&rings_lock);
+    trace_ring_t *r = rings;
+    while (r && r->in_use) r = r->next;
+    if (!r && (r = calloc(1, sizeof(trace_ring_t)))) {
+        pthread_mutex_init(&r->lock, NULL);
+        r->lane = num_rings++;
+        r->next = rings;
+        rings = r;
+    }
+    if (r) r->in_use = 1;
+    pthread_mutex_unlock(&rings_lock);
+    if (!r) {
+        free(t);
+        return NULL;
+    }
+
+    t->ring = r;
+    t->rng = (uint32_t) now_ns() ^ (uint32_t) (uintptr_t) t ^ 0x9e3779b9;
+    if (!t->rng) t->rng = 1;
+    pthread_setspecific(thread_key, t);
+    return self = t;
+}
+
+static void write_json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void log_slow(trace_req_t *req) {
+    uint64_t total[TRACE_NUM_PHASES] = {0};
+    char buf[MAXBUF];
+    int n = snprintf(buf, sizeof(buf), "slow request: %s %s %.1f ms [",
+                     req->method, req->uri, (req->end - req->start) / 1e6);
+    for (int i = 0; i < req->num_spans; i++) total[req->spans[i].phase] += req->spans[i].dur;
+    for (int p = 0; p < TRACE_NUM_PHASES && n < (int) sizeof(buf); p++) {
+        if (total[p]) n += snprintf(buf + n, sizeof(buf) - n, " %s %.1f", phase_names[p], total[p] / 1e6);
+    }
+    if (n < (int) sizeof(buf)) snprintf(buf + n, sizeof(buf) - n, " ]");
+    fprintf(stderr, "%s\n", buf);
+}
+
+void trace_begin(void) {
+    if (!enabled) return;
+    trace_thread_t *t = thread_get();
+    if (!t) return;
+    if (t->active) trace_end();
+
+    // xorshift32
+    t->rng ^= t->rng << 13;
+    t->rng ^= t->rng >> 17;
+    t->rng ^= t->rng << 5;
+    t->sampled = sample_all || t->rng < sample_threshold;
+    t->recording = t->sampled || slow_ns > 0;
+    t->active = 1;
+    if (!t->recording) return;
+
+    t->cur.start = now_ns();
+    t->cur.num_spans = 0;
+    strcpy(t->cur.method, "-");
+    strcpy(t->cur.uri, "-");
+}
+
+void trace_request(const char *method, const char *uri) {
+    trace_thread_t *t = self;
+    if (!t || !t->recording) return;
+    snprintf(t->cur.method, sizeof(t->cur.method), "%s", method);
+    snprintf(t->cur.uri, sizeof(t->cur.uri), "%s", uri);
+}
+
+uint64_t trace_start(void) {
+    trace_thread_t *t = self;
+    return t && t->recording ? now_ns() : 0;
+}
+
+void trace_span(int phase, uint64_t start) {
+    trace_thread_t *t = self;
+    if (!start || !t || !t->recording || t->cur.num_spans == TRACE_MAX_SPANS) return;
+    uint64_t dur = now_ns() - start;
+    trace_span_t *s = &t->cur.spans[t->cur.num_spans++];
+    s->start = start;
+    s->dur = dur > UINT32_MAX ? UINT32_MAX : dur;
+    s->phase = phase;
+}
+
+void trace_end(void) {
+    trace_thread_t *t = self;
+    if (!t || !t->active) return;
+    t->active = 0;
+    if (!t->recording) return;
+    t->recording = 0;
+
+    t->cur.end = now_ns();
+    int slow = slow_ns && t->cur.end - t->cur.start >= slow_ns;
+    if (slow) log_slow(&t->cur);
+    if (!t->sampled && !slow) return;
+
+    t->cur.id = __sync_add_and_fetch(&next_id, 1);
+    trace_ring_t *r = t->ring;
+    pthread_mutex_lock(&r->lock);
+    trace_req_t *dst = &r->reqs[r->count % TRACE_RING];
+    memcpy(dst, &t->cur, offsetof(trace_req_t, spans) + t->cur.num_spans * sizeof(trace_span_t));
+    r->count++;
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void write_event(FILE *f, int *first, const char *name, const char *cat,
+                        uint64_t start, uint64_t dur, int lane) {
+    fprintf(f, "%s\n{\"name\":", *first ? "" : ",");
+    write_json_string(f, name);
+    fprintf(f, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+            cat, (start - epoch) / 1e3, dur / 1e3, lane);
+    *first = 0;
+}
+
+void trace_write_json(FILE *f) {
+    char name[TRACE_URI_LEN + 32];
+    int first = 1;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    pthread_mutex_lock(&rings_lock);
+    for (trace_ring_t *r = rings; r; r = r->next) {
+        pthread_mutex_lock(&r->lock);
+        uint64_t from = r->count > TRACE_RING ? r->count - TRACE_RING : 0;
+        for (uint64_t i = from; i < r->count; i++) {
+            trace_req_t *req = &r->reqs[i % TRACE_RING];
+            snprintf(name, sizeof(name), "%s %s", req->method, req->uri);
+            write_event(f, &first, name, "request", req->start, req->end - req->start, r->lane);
+            for (int s = 0; s < req->num_spans; s++) {
+                write_event(f, &first, phase_names[req->spans[s].phase], "phase",
+                            req->spans[s].start, req->spans[s].dur, r->lane);
+            }
+        }
+        pthread_mutex_unlock(&r->lock);
+    }
+    pthread_mutex_unlock(&rings_lock);
+    fprintf(f, "\n]}\n");
+}
+
+int trace_dump(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+    trace_write_json(f);
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+// GET /debug/trace, for clients on the loopback interface only
+static void route_trace(int fd, http_request_t *req, route_match_t *match, void *ctx) {
+    char buf[MAXBUF];
+    char *json = NULL;
+    size_t len = 0;
+    (void) match; (void) ctx;
+
+    if ((ntohl(req->client_ip) >> 24) != 127) {
+        request_error(fd, req->uri, "404", "Not found", "Server could not find this file");
+        return;
+    }
+    FILE *f = open_memstream(&json, &len);
+    if (!f) {
+        request_error(fd, req->uri, "500", "Internal Server Error", "Out of memory");
+        return;
+    }
+    trace_write_json(f);
+    fclose(f);
+
+    snprintf(buf, sizeof(buf), ""
+        "HTTP/1.0 200 OK\r\n"
+        "Server: Webserver C\r\n"
+        "Content-Type: application/json\r\n"
+        "Cache-Control: no-store\r\n"
+        "Content-Length: %zu\r\n\r\n", len);
+    write_or_die(fd, buf, strlen(buf));
+    write_or_die(fd, json, len);
+    free(json);
+}
+
+void trace_init(double sample_rate, int slow_ms) {
+    if (sample_rate <= 0 && slow_ms <= 0) return;
+    if (sample_rate > 1) sample_rate = 1;
+    sample_all = sample_rate >= 1;
+    sample_threshold = sample_rate > 0 ? (uint32_t) (sample_rate * 4294967295.0) : 0;
+    slow_ns = slow_ms > 0 ? (uint64_t) slow_ms * 1000000 : 0;
+    epoch = now_ns();
+    pthread_key_create(&thread_key, thread_release);
+    router_add("GET", "/debug/trace", ROUTE_EXACT, route_trace, NULL);
+    enabled = 1;
+}
@@ -0,0 +1,58 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+#include <stdio.h>
+#include <stdint.h>
+
+// Per-request phase tracing. A request traced on a thread records spans
+// (phase, start, duration) into that thread's scratch record; when it
+// ends, the record is committed to a per-thread ring buffer if the
+// request was sampled or slow, and slow requests are also logged with
+// their time per phase. Threads return their ring to a pool on exit, so
+// the number of rings follows peak concurrency, not connection count.
+//
+// Rings are exported as Chrome trace-event JSON (chrome://tracing,
+// Perfetto): one lane per ring, a request and its phases as nested
+// complete ("X") events.
+//
+// With tracing off every call is a test of one flag; with sampling only,
+// unsampled requests take no timestamps at all.
+
+enum {
+    TRACE_READ_LINE,     // request line
+    TRACE_HEADERS,
+    TRACE_BODY,
+    TRACE_DISPATCH,      // routing and handler
+    TRACE_LOOKUP,        // docroot index / stat
+    TRACE_OPEN,
+    TRACE_SEND,          // response head and body to the socket
+    TRACE_UPLOAD_WRITE,  // storing an upload
+    TRACE_THUMB_WAIT,    // waiting for a thumbnail worker
+    TRACE_PROXY,         // answered through a backend
+    TRACE_NUM_PHASES
+};
+
+// sample_rate: fraction of requests to record (0..1); slow_ms: log and
+// always record requests that take at least this long (0: off). Tracing
+// stays off if both are 0. Registers GET /debug/trace (loopback only).
+void trace_init(double sample_rate, int slow_ms);
+
+// A request starts / ends on the calling thread. Beginning a new request
+// ends the previous one.
+void trace_begin(void);
+void trace_end(void);
+
+// Names the current request once its request line is known
+void trace_request(const char *method, const char *uri);
+
+// Returns the start of a span, or 0 if the current request is not being
+// recorded; trace_span() then records nothing
+uint64_t trace_start(void);
+void trace_span(int phase, uint64_t start);
+
+// Writes all rings as Chrome trace JSON
+void trace_write_json(FILE *f);
+
+// trace_write_json() into a file. Returns 0 on success.
+int trace_dump(const char *path);
+
+#endif // __TRACE_H__
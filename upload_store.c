@@ -0,0 +1,211 @@
+#include "io_helper.h"
+#include "upload_store.h"
+#include "docroot.h"
+#include "trace.h"
+#include <openssl/evp.h>
+#include <uuid/uuid.h>
+
+#define UPLOAD_DIR "uploads"
+#define HASH_CHUNK (64 * 1024)
+#define SPLICE_PIPE_SIZE (1024 * 1024) // fewer round trips through the pipe
+
+void upload_hash_hex(const char *data, size_t len, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    // Feed the digest in chunks so that the data is streamed through the
+    // cache once instead of being handed over as one huge block
+    for (size_t off = 0; off < len; off += HASH_CHUNK) {
+        size_t n = len - off < HASH_CHUNK ? len - off : HASH_CHUNK;
+        EVP_DigestUpdate(ctx, data + off, n);
+    }
+    EVP_DigestFinal_ex(ctx, digest, &digest_len);
+    EVP_MD_CTX_free(ctx);
+
+    for (unsigned int i = 0; i < digest_len; i++) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0xf];
+    }
+    hex[2 * digest_len] = '\0';
+}
+
+const char *upload_store_ext(const char *mime) {
+    if (mime) {
+        if (strcasecmp(mime, "image/jpeg") == 0) return "jpg";
+        if (strcasecmp(mime, "image/pjpeg") == 0) return "jpg";
+        if (strcasecmp(mime, "image/png") == 0) return "png";
+        if (strcasecmp(mime, "image/gif") == 0) return "gif";
+    }
+    return "bin";
+}
+
+// Creates a fresh temporary file inside UPLOAD_DIR
+static int open_temp_file(char *tmp_path, size_t tmp_size) {
+    uuid_t uuid;
+    char uuid_str[37];
+    uuid_generate_random(uuid);
+    uuid_unparse(uuid, uuid_str);
+    snprintf(tmp_path, tmp_size, "%s/.tmp-%s", UPLOAD_DIR, uuid_str);
+    return open(tmp_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+}
+
+// Links a finished temporary file in as the blob at path and removes the
+// temporary name. link() fails atomically if a concurrent upload of the
+// same content got there first, so readers never observe a partial blob.
+static int publish_temp_file(const char *tmp_path, const char *path) {
+    int rc = UPLOAD_STORE_NEW;
+    if (link(tmp_path, path) < 0) {
+        rc = (errno == EEXIST) ? UPLOAD_STORE_DUP : UPLOAD_STORE_ERROR;
+    } else {
+        // The result page links the blob: make it servable right away
+        docroot_refresh(path);
+    }
+    unlink(tmp_path);
+    return rc;
+}
+
+// Writes the whole buffer to a fresh temporary file inside UPLOAD_DIR
+static int write_temp_file(const char *data, size_t len, char *tmp_path, size_t tmp_size) {
+    int fd = open_temp_file(tmp_path, tmp_size);
+    if (fd < 0) return -1;
+
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, data + written, len - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            close(fd);
+            unlink(tmp_path);
+            return -1;
+        }
+        written += n;
+    }
+    close(fd);
+    return 0;
+}
+
+int upload_store_buffer(const char *data, size_t len, const char *ext,
+                        char *path, size_t path_size) {
+    char hex[UPLOAD_HASH_HEX_LEN + 1];
+    upload_hash_hex(data, len, hex);
+    snprintf(path, path_size, "%s/%s.%s", UPLOAD_DIR, hex, ext);
+
+    // Duplicate: the bytes are already on disk under the same name
+    if (access(path, F_OK) == 0) {
+        return UPLOAD_STORE_DUP;
+    }
+
+    // Write to a private temp file and publish it with link()
+    char tmp_path[256];
+    uint64_t t = trace_start();
+    if (write_temp_file(data, len, tmp_path, sizeof(tmp_path)) < 0) {
+        return UPLOAD_STORE_ERROR;
+    }
+    int rc = publish_temp_file(tmp_path, path);
+    trace_span(TRACE_UPLOAD_WRITE, t);
+    return rc;
+}
+
+// Copies what splice() cannot move, through a user-space buffer
+static int copy_to_file(int sock, int fd, size_t len) {
+    char buf[HASH_CHUNK];
+    while (len > 0) {
+        ssize_t n = read(sock, buf, len < sizeof(buf) ? len : sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t w = write(fd, buf + done, n - done);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) return -1;
+            done += w;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+int upload_store_receive(int sock, size_t len, char *tmp_path, size_t tmp_size) {
+    int fd = open_temp_file(tmp_path, tmp_size);
+    if (fd < 0) return -1;
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE); // best effort
+
+    size_t left = len;
+    int ok = 1;
+    while (ok && left > 0) {
+        ssize_t n = splice(sock, NULL, pipefd[1], NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EINVAL && left == len) {
+            // Not a socket splice() can read (nothing was consumed)
+            ok = copy_to_file(sock, fd, left) == 0;
+            left = 0;
+            break;
+        }
+        if (n <= 0) {
+            ok = 0;
+            break;
+        }
+        left -= n;
+        // Pages move from the pipe into the file's page cache
+        while (n > 0) {
+            ssize_t m = splice(pipefd[0], NULL, fd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m < 0 && errno == EINTR) continue;
+            if (m <= 0) {
+                ok = 0;
+                break;
+            }
+            n -= m;
+        }
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    if (!ok) {
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    return fd;
+}
+
+int upload_store_publish(int tmp_fd, const char *tmp_path, const char *data, size_t len,
+                         const char *ext, char *path, size_t path_size) {
+    char hex[UPLOAD_HASH_HEX_LEN + 1];
+    uint64_t t = trace_start();
+    upload_hash_hex(data, len, hex);
+    snprintf(path, path_size, "%s/%s.%s", UPLOAD_DIR, hex, ext);
+
+    int rc;
+    if (access(path, F_OK) == 0) {
+        unlink(tmp_path);
+        rc = UPLOAD_STORE_DUP;
+    } else if (ftruncate(tmp_fd, len) < 0) {
+        unlink(tmp_path);
+        rc = UPLOAD_STORE_ERROR;
+    } else {
+        rc = publish_temp_file(tmp_path, path);
+    }
+    trace_span(TRACE_UPLOAD_WRITE, t);
+    return rc;
+}
+
+int upload_store_is_blob(const char *filename) {
+    if (filename[0] == '.' && filename[1] == '/') filename += 2;
+    if (strncmp(filename, UPLOAD_DIR "/", sizeof(UPLOAD_DIR)) != 0) return 0;
+
+    // Thumbnails are derived from blobs and named after them
+    const char *name = filename + sizeof(UPLOAD_DIR);
+    if (strncmp(name, "thumbs/", 7) == 0) name += 7;
+    for (int i = 0; i < UPLOAD_HASH_HEX_LEN; i++) {
+        if (!isxdigit((unsigned char) name[i])) return 0;
+    }
+    return name[UPLOAD_HASH_HEX_LEN] == '.';
+}
@@ -0,0 +1,44 @@
+#ifndef __UPLOAD_STORE_H__
+#define __UPLOAD_STORE_H__
+#include <stddef.h>
+
+// Uploaded files are stored content-addressed: the name of a blob is the
+// hex SHA-256 of its bytes, so identical uploads share one file on disk
+// and a blob URL never changes meaning (safe to cache forever).
+#define UPLOAD_HASH_HEX_LEN 64
+
+// Return values of upload_store_buffer()
+#define UPLOAD_STORE_ERROR   (-1)
+#define UPLOAD_STORE_NEW       0  // bytes were written to a new blob
+#define UPLOAD_STORE_DUP       1  // an identical blob already existed
+
+// Computes the hex SHA-256 of data (hashed in chunks, no extra copy)
+void upload_hash_hex(const char *data, size_t len, char *hex);
+
+// Blob extension for a (normalised) MIME type; "bin" for unknown types
+const char *upload_store_ext(const char *mime);
+
+// Stores data as uploads/<sha256>.<ext>, writing it only when no identical
+// blob exists yet. On success path receives the relative blob path.
+int upload_store_buffer(const char *data, size_t len, const char *ext,
+                        char *path, size_t path_size);
+
+// Receives len bytes from socket sock into a new temporary file inside
+// uploads/ with splice() (socket -> pipe -> file), so the payload never
+// passes through user space; sockets splice() cannot read from are
+// copied through a buffer. Returns the file's descriptor (tmp_path
+// receives its name) or -1, in which case part of the bytes may have been
+// consumed.
+int upload_store_receive(int sock, size_t len, char *tmp_path, size_t tmp_size);
+
+// Publishes the first len bytes of a temporary file from
+// upload_store_receive() as uploads/<sha256>.<ext>; data maps them and is
+// only read for the hash. The temporary name is removed in any case.
+int upload_store_publish(int tmp_fd, const char *tmp_path, const char *data, size_t len,
+                         const char *ext, char *path, size_t path_size);
+
+// Returns 1 if the (relative) filename names a content-addressed blob or
+// a thumbnail derived from one
+int upload_store_is_blob(const char *filename);
+
+#endif // __UPLOAD_STORE_H__
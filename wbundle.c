@@ -0,0 +1,232 @@
+//
+// wbundle.c: packs a document root into one bundle file for "wserver -b".
+//
+// To run, try:
+//      wbundle [-z] [-o site.wb] docroot
+//
+// Every regular file below docroot is stored with a ready-made response
+// head; with -z, text assets also get a gzip variant when it is at least
+// 10% smaller. Symlinked directories are skipped, as in the server.
+//
+
+#include "io_helper.h"
+#include "request.h"
+#include "mime.h"
+#include "bundle.h"
+#include <dirent.h>
+#include <zlib.h>
+
+typedef struct {
+    char *path;        // relative to docroot
+    uint64_t hash;
+    struct stat st;
+} bundle_file_t;
+
+static bundle_file_t *files = NULL;
+static int num_files = 0, files_cap = 0;
+
+static void collect(const char *root, const char *dir) {
+    char full[MAXBUF], rel[MAXBUF];
+    snprintf(full, sizeof(full), "%s/%s", root, dir);
+    DIR *d = opendir(full);
+    if (!d) {
+        fprintf(stderr, "wbundle: cannot read %s: %s\n", full, strerror(errno));
+        exit(1);
+    }
+
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (dir[0]) snprintf(rel, sizeof(rel), "%s/%s", dir, de->d_name);
+        else snprintf(rel, sizeof(rel), "%s", de->d_name);
+
+        struct stat st;
+        if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            collect(root, rel);
+            continue;
+        }
+        if (S_ISLNK(st.st_mode) && fstatat(dirfd(d), de->d_name, &st, 0) < 0) continue;
+        if (!S_ISREG(st.st_mode)) continue;
+
+        if (num_files == files_cap) {
+            files_cap = files_cap ? files_cap * 2 : 256;
+            files = realloc(files, files_cap * sizeof(bundle_file_t));
+            if (!files) {
+                fprintf(stderr, "wbundle: out of memory\n");
+                exit(1);
+            }
+        }
+        files[num_files].path = strdup(rel);
+        files[num_files].hash = bundle_hash(rel, strlen(rel));
+        files[num_files].st = st;
+        num_files++;
+    }
+    closedir(d);
+}
+
+static int compare_files(const void *a, const void *b) {
+    const bundle_file_t *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+static int compressible(const char *mime) {
+    return strncmp(mime, "text/", 5) == 0 || strstr(mime, "javascript") ||
+           strstr(mime, "json") || strstr(mime, "xml") || strstr(mime, "svg");
+}
+
+// Returns a gzip stream of data, or NULL if it does not pay off
+static unsigned char *gzip_buffer(const unsigned char *data, size_t len, size_t *gz_len) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+
+    size_t cap = deflateBound(&zs, len);
+    unsigned char *out = malloc(cap);
+    if (!out) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    zs.next_in = (unsigned char *) data;
+    zs.avail_in = len;
+    zs.next_out = out;
+    zs.avail_out = cap;
+    int rc = deflate(&zs, Z_FINISH);
+    *gz_len = zs.total_out;
+    deflateEnd(&zs);
+
+    if (rc != Z_STREAM_END || *gz_len >= len - len / 10) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+static uint64_t out_off = 0;
+
+static uint64_t emit(int fd, const void *data, size_t len) {
+    uint64_t at = out_off;
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write_or_die(fd, (void *) p, len);
+        p += n;
+        len -= n;
+        out_off += n;
+    }
+    return at;
+}
+
+static void pad(int fd, size_t align) {
+    static const char zeros[16] = {0};
+    if (out_off % align) emit(fd, zeros, align - out_off % align);
+}
+
+static size_t make_head(char *buf, size_t size, uint64_t len, const char *mime, const char *etag,
+                        const char *encoding, int vary) {
+    return snprintf(buf, size, ""
+        "HTTP/1.0 200 OK\r\n"
+        "Server: Webserver C\r\n"
+        "Content-Length: %llu\r\n"
+        "ETag: %s\r\n"
+        "Content-Type: %s\r\n"
+        "%s%s%s"
+        "%s"
+        "\r\n",
+        (unsigned long long) len, etag, mime,
+        encoding ? "Content-Encoding: " : "", encoding ? encoding : "", encoding ? "\r\n" : "",
+        vary ? "Vary: Accept-Encoding\r\n" : "");
+}
+
+int main(int argc, char *argv[]) {
+    int c, use_gzip = 0;
+    char *out_path = "site.wb";
+
+    while ((c = getopt(argc, argv, "zo:")) != -1)
+    switch (c) {
+    case 'z':
+        use_gzip = 1;
+        break;
+    case 'o':
+        out_path = optarg;
+        break;
+    default:
+        fprintf(stderr, "usage: wbundle [-z] [-o out.wb] docroot\n");
+        exit(1);
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: wbundle [-z] [-o out.wb] docroot\n");
+        exit(1);
+    }
+    const char *root = argv[optind];
+
+    collect(root, "");
+    qsort(files, num_files, sizeof(bundle_file_t), compare_files);
+
+    bundle_record_t *index = calloc(num_files ? num_files : 1, sizeof(bundle_record_t));
+    int out = open_or_die(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bundle_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    emit(out, &hdr, sizeof(hdr));
+
+    size_t total = 0, total_gz = 0;
+    int num_gz = 0;
+    for (int i = 0; i < num_files; i++) {
+        bundle_file_t *f = &files[i];
+        bundle_record_t *r = &index[i];
+        char full[MAXBUF], filetype[MAXBUF], head[MAXBUF];
+
+        snprintf(full, sizeof(full), "%s/%s", root, f->path);
+        int fd = open_or_die(full, O_RDONLY, 0);
+        unsigned char *data = malloc(f->st.st_size ? f->st.st_size : 1);
+        size_t got = 0;
+        while (got < (size_t) f->st.st_size) {
+            ssize_t n = read_or_die(fd, data + got, f->st.st_size - got);
+            if (n == 0) break; // shrank while we read it
+            got += n;
+        }
+        close_or_die(fd);
+
+        r->hash = f->hash;
+        r->mode = f->st.st_mode;
+        r->mtime = f->st.st_mtime;
+        mime_get_filetype(f->path, filetype);
+        snprintf(r->mime, sizeof(r->mime), "%.31s", filetype);
+        snprintf(r->etag, sizeof(r->etag), "\"%08lx-%zx\"", crc32(0L, data, got), got);
+
+        size_t gz_len = 0;
+        unsigned char *gz = use_gzip && compressible(r->mime) ? gzip_buffer(data, got, &gz_len) : NULL;
+
+        r->path_len = strlen(f->path);
+        r->path_off = emit(out, f->path, r->path_len);
+        r->head_len = make_head(head, sizeof(head), got, r->mime, r->etag, NULL, gz != NULL);
+        r->head_off = emit(out, head, r->head_len);
+        r->body_len = got;
+        r->body_off = emit(out, data, got);
+        if (gz) {
+            char gz_etag[64];
+            bundle_gzip_etag(r->etag, gz_etag, sizeof(gz_etag));
+            r->gz_head_len = make_head(head, sizeof(head), gz_len, r->mime, gz_etag, "gzip", 1);
+            r->gz_head_off = emit(out, head, r->gz_head_len);
+            r->gz_len = gz_len;
+            r->gz_off = emit(out, gz, gz_len);
+            total_gz += gz_len;
+            num_gz++;
+            free(gz);
+        }
+        total += got;
+        free(data);
+    }
+
+    pad(out, sizeof(uint64_t));
+    memcpy(hdr.magic, BUNDLE_MAGIC, 8);
+    hdr.count = num_files;
+    hdr.index_off = emit(out, index, num_files * sizeof(bundle_record_t));
+    lseek_or_die(out, 0, SEEK_SET);
+    write_or_die(out, &hdr, sizeof(hdr));
+    close_or_die(out);
+
+    printf("%s: %d files, %zu bytes, %d gzip variants (%zu bytes)\n",
+           out_path, num_files, total, num_gz, total_gz);
+    return 0;
+}
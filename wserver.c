@@ -7,9 +7,28 @@
 #include <signal.h>
 #include "request.h"
 #include "io_helper.h"
+#include "thumbnail.h"
+#include "tls.h"
+#include "docroot.h"
+#include "bundle.h"
+#include "ratelimit.h"
+#include "proxy.h"
+#include "trace.h"
+#include "cgi.h"
+#include "membudget.h"
+#include "manifest.h"
+#include "resumable.h"
+#include "handoff.h"
+#include "connpool.h"
 
 char default_root[] = ".";
 volatile int keep_running = 1;
+volatile sig_atomic_t dump_trace = 0;
+volatile sig_atomic_t upgrade_requested = 0;
+volatile int upgrading = 0;
+volatile int handed_off = 0;
+volatile int active_connections = 0;
+int listen_fd = -1;
 
 // Обработчик сигналов для завершения сервера
 void handle_signal(int sig) {
@@ -17,41 +36,107 @@ void handle_signal(int sig) {
     keep_running = 0;
 }
 
-// Структура для передачи данных потоку
-typedef struct {
-    int fd;
-} thread_args_t;
+// SIGUSR1: выгрузить трассировку запросов (в основном цикле, не в обработчике)
+void handle_dump_signal(int sig) {
+    (void) sig;
+    dump_trace = 1;
+}
+
+// SIGUSR2: передать слушающий сокет новому процессу (перезапуск без простоя)
+void handle_upgrade_signal(int sig) {
+    (void) sig;
+    upgrade_requested = 1;
+}
+
+// Запуск преемника в отдельном потоке: пока он стартует, приём соединений продолжается
+void* upgrade_thread(void* args) {
+    (void) args;
+    pthread_detach(pthread_self());
+    int pid = handoff_start(listen_fd);
+    if (pid > 0) {
+        printf("Handed off to pid %d, draining connections\n", pid);
+        handed_off = 1;
+        keep_running = 0;
+    }
+    upgrading = 0;
+    return NULL;
+}
+
+// Обработка одного соединения (с TLS, если он включен); объект возвращается в пул
+void serve_connection(conn_t *conn) {
+    tls_conn_t *tls = NULL;
+    int fd = conn->fd;
+
+    if (tls_enabled()) {
+        int app_fd = tls_accept(fd, &tls);
+        if (app_fd >= 0) { // Иначе рукопожатие не удалось, сокет уже закрыт
+            request_handle(app_fd, conn);
+            tls_close(tls);
+        }
+        connpool_put(conn);
+        return;
+    }
+
+    request_handle(fd, conn);
+    close_or_die(fd);
+    connpool_put(conn);
+}
+
+// Отказ клиенту, исчерпавшему лимит, еще до выделения потока
+void refuse_connection(int fd, int retry_after) {
+    char buf[256];
+    if (!tls_enabled()) {
+        // Сокет только что принят, буфер отправки пуст: запись не блокирует
+        int n = snprintf(buf, sizeof(buf), ""
+            "HTTP/1.0 429 Too Many Requests\r\n"
+            "Retry-After: %d\r\n"
+            "Content-Length: 0\r\n\r\n", retry_after);
+        send(fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    close(fd);
+}
 
 // Функция потока для обработки запроса
 void* handle_request_thread(void* args) {
-    thread_args_t* thread_args = (thread_args_t*)args;
-    int fd = thread_args->fd;
-    
-    // Освобождаем память аргументов
-    free(args);
+    conn_t* conn = (conn_t*)args;
     
     // Устанавливаем режим отсоединенного потока
     pthread_detach(pthread_self());
     
-    // Обрабатываем запрос
-    request_handle(fd);
-    
-    // Закрываем соединение
-    close_or_die(fd);
+    // Обрабатываем запрос и закрываем соединение
+    serve_connection(conn);
+    __sync_fetch_and_sub(&active_connections, 1);
     
     return NULL;
 }
 
 //
-// ./wserver [-d <basedir>] [-p <portnum>] [-t <threads>]
+// ./wserver [-d <basedir>] [-p <portnum>] [-t <threads>] [-w <thumbnail workers>]
+//           [-c <cert.pem> -k <key.pem>] [-b <bundle>]
+//           [-r <rate[:burst]>] [-R <prefix=rate[:burst]>]...
+//           [-P <prefix=host:port[,host:port...][@lc]>]...
+//           [-T <sample rate>] [-S <slow ms>] [-M <cgi cache ttl>]
+//           [-m <request memory MB>] [-D <drain seconds>] [-H]
 // 
 int main(int argc, char *argv[]) {
     int c;
     char *root_dir = default_root;
     int port = 10000;
     int num_threads = 1; // По умолчанию однопоточный режим
+    int thumb_workers = 2;
+    char *cert_file = NULL, *key_file = NULL;
+    char *bundle_file = NULL;
+    double trace_rate = 0;
+    int slow_ms = 0;
+    int cgi_cache_ttl = 0;
+    size_t memory_mb = 0;
+    int drain_seconds = 30;
+    int huge_pages = 0;
+
+    // Запоминаем, как был запущен процесс: так же будет запущен преемник
+    handoff_init(argc, argv);
     
-    while ((c = getopt(argc, argv, "d:p:t:")) != -1)
+    while ((c = getopt(argc, argv, "d:p:t:w:c:k:b:r:R:P:T:S:M:m:D:H")) != -1)
     switch (c) {
     case 'd':
         root_dir = optarg;
@@ -63,25 +148,148 @@ int main(int argc, char *argv[]) {
         num_threads = atoi(optarg);
         if (num_threads <= 0) num_threads = 1;
         break;
+    case 'w':
+        thumb_workers = atoi(optarg);
+        break;
+    case 'c':
+        cert_file = optarg;
+        break;
+    case 'k':
+        key_file = optarg;
+        break;
+    case 'b':
+        bundle_file = optarg;
+        break;
+    case 'r':
+        // Лимит запросов в секунду на один IP
+        if (ratelimit_set_global(optarg) < 0) {
+            fprintf(stderr, "Invalid rate limit '%s', expected rate[:burst]\n", optarg);
+            exit(1);
+        }
+        break;
+    case 'R':
+        // Отдельный лимит для URI с заданным префиксом
+        if (ratelimit_add_route(optarg) < 0) {
+            fprintf(stderr, "Invalid route limit '%s', expected /prefix=rate[:burst]\n", optarg);
+            exit(1);
+        }
+        break;
+    case 'P':
+        // Проксирование префикса на бэкенды (round-robin или @lc)
+        if (proxy_add_route(optarg) < 0) {
+            fprintf(stderr, "Invalid proxy route '%s', expected /prefix=host:port[,host:port...][@lc]\n", optarg);
+            exit(1);
+        }
+        break;
+    case 'T':
+        // Доля запросов, попадающих в трассировку (0..1)
+        trace_rate = atof(optarg);
+        break;
+    case 'S':
+        // Порог медленного запроса в миллисекундах
+        slow_ms = atoi(optarg);
+        break;
+    case 'M':
+        // Микрокэш ответов CGI: верхняя граница TTL в секундах
+        cgi_cache_ttl = atoi(optarg);
+        break;
+    case 'm':
+        // Общий бюджет памяти под тела запросов и вывод CGI (МБ)
+        memory_mb = strtoul(optarg, NULL, 10);
+        break;
+    case 'D':
+        // Сколько секунд ждать завершения соединений при остановке и передаче
+        drain_seconds = atoi(optarg);
+        break;
+    case 'H':
+        // Пул объектов соединений на больших страницах
+        huge_pages = 1;
+        break;
     default:
-        fprintf(stderr, "usage: wserver [-d basedir] [-p port] [-t threads]\n");
+        fprintf(stderr, "usage: wserver [-d basedir] [-p port] [-t threads] [-w thumbnail workers] [-c cert -k key] [-b bundle] [-r rate[:burst]] [-R prefix=rate[:burst]] [-P prefix=host:port,...[@lc]] [-T sample rate] [-S slow ms] [-M cgi cache ttl] [-m request memory MB] [-D drain seconds] [-H]\n");
+        exit(1);
+    }
+
+    // TLS включается сертификатом и ключом (пути относительно исходного каталога)
+    if (cert_file || key_file) {
+        if (!cert_file || !key_file || tls_init(cert_file, key_file) < 0) {
+            fprintf(stderr, "Failed to set up TLS: both -c and -k must name a valid certificate and key\n");
+            exit(1);
+        }
+    }
+
+    // Статика из бандла (wbundle): один mmap при старте
+    if (bundle_file && bundle_open(bundle_file) < 0) {
+        fprintf(stderr, "Failed to open bundle %s\n", bundle_file);
         exit(1);
     }
 
     // Регистрация обработчика сигналов
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
+    signal(SIGUSR1, handle_dump_signal);
+    signal(SIGUSR2, handle_upgrade_signal);
     
     // Смена рабочего каталога
     chdir_or_die(root_dir);
 
+    // Фоновые потоки для генерации миниатюр загруженных изображений
+    thumbnail_init(thumb_workers);
+
+    // Индекс каталога документов (обход в несколько потоков, далее inotify)
+    docroot_init(sysconf(_SC_NPROCESSORS_ONLN));
+
+    // Таблица маршрутов (radix-дерево), строится один раз до приёма соединений
+    request_init();
+    cgi_init(cgi_cache_ttl);
+
+    // Журнал загрузок (uploads/.manifest) и галерея /uploads/
+    manifest_init();
+
+    // Докачиваемые загрузки частями (/upload/sessions/)
+    resumable_init();
+    membudget_init(memory_mb * 1024 * 1024);
+
+    // Объекты соединений (буферы запроса) из пула, а не со стека потока
+    connpool_init(huge_pages);
+    pthread_attr_t thread_attr;
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setstacksize(&thread_attr, CONNPOOL_STACK_SIZE);
+
+    // Трассировка фаз запросов: выборка и журнал медленных запросов
+    trace_init(trace_rate, slow_ms);
+
+    // Проверка доступности бэкендов обратного прокси
+    proxy_init();
+
     // Запуск сервера
-    printf("Starting server on port %d with %d threads\n", port, num_threads);
+    printf("Starting %s server on port %d with %d threads\n", tls_enabled() ? "HTTPS" : "HTTP", port, num_threads);
     printf("Serving documents from directory: %s\n", root_dir);
     
-    int listen_fd = open_listen_fd_or_die(port);
+    // Сокет от предшественника (SIGUSR2) или новый
+    listen_fd = handoff_receive();
+    if (listen_fd < 0) listen_fd = open_listen_fd_or_die(port);
+
+    // Все готово: предшественник может перестать принимать соединения
+    handoff_ready();
     
     while (keep_running) {
+        if (upgrade_requested) {
+            upgrade_requested = 0;
+            pthread_t thread;
+            if (!upgrading) {
+                upgrading = 1;
+                if (pthread_create(&thread, NULL, upgrade_thread, NULL) != 0) upgrading = 0;
+            }
+        }
+
+        if (dump_trace) {
+            dump_trace = 0;
+            char trace_path[256];
+            snprintf(trace_path, sizeof(trace_path), "/tmp/wserver-%d.trace.json", getpid());
+            if (trace_dump(trace_path) == 0) printf("Trace written to %s\n", trace_path);
+        }
+
         struct sockaddr_in client_addr;
         int client_len = sizeof(client_addr);
         
@@ -95,32 +303,43 @@ int main(int argc, char *argv[]) {
         tv.tv_usec = 0;
         
         if (select(listen_fd + 1, &read_fds, NULL, NULL, &tv) > 0) {
-            int conn_fd = accept(listen_fd, (sockaddr_t *) &client_addr, (socklen_t *) &client_len);
+            // SOCK_CLOEXEC: соединения не должны попадать в CGI и в преемника
+            int conn_fd = accept4(listen_fd, (sockaddr_t *) &client_addr, (socklen_t *) &client_len, SOCK_CLOEXEC);
             
-            if (conn_fd >= 0) {
-                if (num_threads > 1) {
+            int retry_after;
+            if (conn_fd >= 0 && ratelimit_enabled() &&
+                !ratelimit_accept(client_addr.sin_addr.s_addr, &retry_after)) {
+                refuse_connection(conn_fd, retry_after);
+            } else if (conn_fd >= 0) {
+                conn_t* conn = connpool_get(conn_fd, client_addr.sin_addr.s_addr);
+                if (!conn) {
+                    close(conn_fd); // Память под соединения исчерпана
+                } else if (num_threads > 1) {
                     // Многопоточная обработка
                     pthread_t thread;
-                    thread_args_t* args = (thread_args_t*)malloc(sizeof(thread_args_t));
-                    args->fd = conn_fd;
                     
-                    if (pthread_create(&thread, NULL, handle_request_thread, args) != 0) {
+                    __sync_fetch_and_add(&active_connections, 1);
+                    if (pthread_create(&thread, &thread_attr, handle_request_thread, conn) != 0) {
                         // Если не удалось создать поток, обрабатываем запрос в основном потоке
-                        request_handle(conn_fd);
-                        close_or_die(conn_fd);
+                        serve_connection(conn);
+                        __sync_fetch_and_sub(&active_connections, 1);
                     }
                 } else {
                     // Однопоточная обработка
-                    request_handle(conn_fd);
-                    close_or_die(conn_fd);
+                    serve_connection(conn);
                 }
             }
         }
     }
     
-    // Закрываем слушающий сокет перед выходом
+    // Закрываем слушающий сокет перед выходом (у преемника остается своя копия)
     close(listen_fd);
-    printf("Server stopped\n");
+
+    // Даем начатым соединениям завершиться, но не дольше drain_seconds
+    time_t drain_deadline = time(NULL) + drain_seconds;
+    while (active_connections > 0 && time(NULL) < drain_deadline) usleep(10000);
+    if (active_connections > 0) printf("Dropping %d connections after %d s\n", active_connections, drain_seconds);
+    printf(handed_off ? "Server handed off\n" : "Server stopped\n");
     
     return 0;
 }